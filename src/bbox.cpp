@@ -31,6 +31,33 @@ bool bbox_t::intersect(const ray_t &ray, const ivec3 &sign, const vec3& inv_dire
   return ( (tmin < ray.tmax) && (tmax > ray.tmin) );
 }
 
+unsigned int bbox_t::intersect(const ray_packet_t &packet, unsigned int mask) const {
+	simd_float_t min_x = simd_set1(min_point.x), max_x = simd_set1(max_point.x);
+	simd_float_t min_y = simd_set1(min_point.y), max_y = simd_set1(max_point.y);
+	simd_float_t min_z = simd_set1(min_point.z), max_z = simd_set1(max_point.z);
+	
+	unsigned int hit = 0;
+	for (size_t i = 0; i < packet.size; i += SIMD_WIDTH) {
+		if ( ( (mask >> i) & ( (1u << SIMD_WIDTH) - 1 ) ) == 0 )
+			continue;
+		
+		simd_float_t ox = simd_load(&packet.ox[i]), inv_dx = simd_load(&packet.inv_dx[i]);
+		simd_float_t oy = simd_load(&packet.oy[i]), inv_dy = simd_load(&packet.inv_dy[i]);
+		simd_float_t oz = simd_load(&packet.oz[i]), inv_dz = simd_load(&packet.inv_dz[i]);
+		
+		simd_float_t tx0 = simd_mul(simd_sub(min_x, ox), inv_dx), tx1 = simd_mul(simd_sub(max_x, ox), inv_dx);
+		simd_float_t ty0 = simd_mul(simd_sub(min_y, oy), inv_dy), ty1 = simd_mul(simd_sub(max_y, oy), inv_dy);
+		simd_float_t tz0 = simd_mul(simd_sub(min_z, oz), inv_dz), tz1 = simd_mul(simd_sub(max_z, oz), inv_dz);
+		
+		simd_float_t tnear = simd_max(simd_max(simd_min(tx0, tx1), simd_min(ty0, ty1)), simd_max(simd_min(tz0, tz1), simd_load(&packet.tmin[i])));
+		simd_float_t tfar = simd_min(simd_min(simd_max(tx0, tx1), simd_max(ty0, ty1)), simd_min(simd_max(tz0, tz1), simd_load(&packet.t[i])));
+		
+		hit |= simd_movemask(simd_le(tnear, tfar)) << i;
+	}
+	
+	return hit & mask;
+}
+
 std::string bbox_t::str() const {
 	std::stringstream ss;
 	ss << " max=" << string_cast::to_string(max_point);
@@ -11,6 +11,7 @@
 #include <glm/gtx/string_cast.hpp>
 
 #include "ray.hpp"
+#include "ray_packet.hpp"
 
 
 struct bbox_t {
@@ -37,6 +38,11 @@ struct bbox_t {
 		return *this;
 	}
 	
+	float surface_area() const {
+		glm::vec3 v = max_point - min_point;
+		return 2.0f * ( v.x * v.y + v.y * v.z + v.z * v.x );
+	}
+	
 	int maximum_extent() const {
 		glm::vec3 v = max_point - min_point;
 		return ( v.x > v.y ) ? ( (v.x > v.z) ? 0 : 2 ) : ( (v.y > v.z) ? 1 : 2 );
@@ -59,6 +65,8 @@ struct bbox_t {
 	}
 
 	bool intersect(const ray_t &ray, const glm::ivec3 &sign, const glm::vec3& inv_direction) const;
+	
+	unsigned int intersect(const ray_packet_t &packet, unsigned int mask) const;
 
 };
 
@@ -0,0 +1,361 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+
+#include <glm/glm.hpp>
+#include <tbb/tick_count.h>
+
+#include "triangle_mesh.hpp"
+#include "bvh.hpp"
+#include "grkt.hpp"
+
+
+using namespace std;
+using namespace glm;
+using namespace tbb;
+
+// Build and traversal benchmark. Everything is seeded, so two runs trace the same rays and
+// the hit counts double as a check that a layout or traversal change kept the results.
+// Results go to stdout as JSON.
+
+static const bvh_split_method_t split_methods[] = { BVH_SPLIT_MIDDLE, BVH_SPLIT_SAH, BVH_SPLIT_LBVH, BVH_SPLIT_HLBVH };
+static const bvh_layout_t layouts[] = { BVH_LAYOUT_BINARY, BVH_LAYOUT_COMPACT, BVH_LAYOUT_WIDE4, BVH_LAYOUT_WIDE8, BVH_LAYOUT_QUANTIZED };
+static const size_t CACHE_LINE_SIZE = 64;
+
+
+struct bench_options_t {
+	int repeats;
+	uint32_t seed;
+	size_t resolution;     // primary rays are resolution x resolution
+	size_t random_count;
+	bool synthetic;
+	std::vector<const char *> ctm_filepaths;
+
+	bench_options_t() : repeats(3), seed(5489u), resolution(512), random_count(262144), synthetic(true) { }
+
+};
+
+struct ray_set_t {
+	const char *name;
+	std::vector<ray_t> rays;
+
+	ray_set_t(const char *n) : name(n) { }
+
+};
+
+struct bench_scene_t {
+	std::string name;
+	triangle_mesh_t mesh;
+
+};
+
+// bytes of one node and the boxes it holds: a binary node carries its own box, a wide node its children's
+static size_t layout_node_size(bvh_layout_t layout, int *boxes) {
+	switch (layout) {
+		case BVH_LAYOUT_COMPACT: *boxes = 1; return sizeof(bvh_compact_node_t);
+		case BVH_LAYOUT_WIDE4: *boxes = 4; return sizeof(bvh_wide_node_t<4>);
+		case BVH_LAYOUT_WIDE8: *boxes = 8; return sizeof(bvh_wide_node_t<8>);
+		case BVH_LAYOUT_QUANTIZED: *boxes = bvh_quantized_node_t::N; return sizeof(bvh_quantized_node_t);
+		default: *boxes = 1; return sizeof(bvh_linear_node_t);
+	}
+}
+
+static void make_sphere_mesh(size_t n, triangle_mesh_t &mesh) {
+	for (size_t i = 0; i <= n; i++) {
+		for (size_t j = 0; j < 2 * n; j++) {
+			float theta = M_PI * i / n;
+			float phi = M_PI * j / n;
+			mesh.vertices.push_back(vec3(sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi)));
+		}
+	}
+	for (size_t i = 0; i < n; i++) {
+		for (size_t j = 0; j < 2 * n; j++) {
+			unsigned int a = i * 2 * n + j;
+			unsigned int b = i * 2 * n + (j + 1) % (2 * n);
+			unsigned int c = a + 2 * n;
+			unsigned int d = b + 2 * n;
+			unsigned int quad[6] = { a, c, b, b, c, d };
+			mesh.indices.insert(mesh.indices.end(), quad, quad + 6);
+		}
+	}
+}
+
+// small triangles scattered through a unit cube, overlapping at random; the hard case for a BVH
+static void make_soup_mesh(size_t n, uint32_t seed, triangle_mesh_t &mesh) {
+	rng_t rng(seed, 1);
+	for (size_t i = 0; i < n; i++) {
+		vec3 p = vec3(rng(), rng(), rng());
+		for (int k = 0; k < 3; k++) {
+			mesh.vertices.push_back(p + 0.02f * vec3(rng() - 0.5f, rng() - 0.5f, rng() - 0.5f));
+			mesh.indices.push_back(3 * i + k);
+		}
+	}
+}
+
+static vec3 random_direction(rng_t &rng) {
+	float z = 2.0f * rng() - 1.0f;
+	float r = sqrtf(std::max(0.0f, 1.0f - z * z));
+	float phi = 2.0f * M_PI * rng();
+	return vec3(r * cosf(phi), r * sinf(phi), z);
+}
+
+// pinhole camera outside the bounds, looking at their center
+static void make_primary_rays(const bbox_t &bound, size_t resolution, ray_set_t &set) {
+	vec3 center = 0.5f * ( bound.max_point + bound.min_point );
+	float radius = 0.5f * length(bound.max_point - bound.min_point);
+	vec3 origin = center + radius * vec3(0.6f, 0.5f, 1.6f);
+
+	vec3 w = normalize(center - origin);
+	vec3 u = normalize(cross(w, vec3(0.0f, 1.0f, 0.0f)));
+	vec3 v = cross(u, w);
+
+	set.rays.reserve(resolution * resolution);
+	for (size_t j = 0; j < resolution; j++) {
+		for (size_t i = 0; i < resolution; i++) {
+			float a = ( i + 0.5f ) / resolution - 0.5f;
+			float b = 0.5f - ( j + 0.5f ) / resolution;
+			set.rays.push_back(ray_t(origin, normalize(a * u + b * v + 1.2f * w)));
+		}
+	}
+}
+
+// from every primary hit toward a point on a spherical light above the scene
+static void make_shadow_rays(const bvh_tree_t &tree, const ray_set_t &primary, rng_t &rng, ray_set_t &set) {
+	bbox_t bound = tree.bound();
+	vec3 extent = bound.max_point - bound.min_point;
+	vec3 center = 0.5f * ( bound.max_point + bound.min_point );
+	sphere_t light(center + vec3(-0.5f * extent.x, 1.5f * extent.y, 0.5f * extent.z), 0.2f * length(extent));
+
+	for (size_t i = 0; i < primary.rays.size(); i++) {
+		const ray_t &ray = primary.rays[i];
+		isect_t isect;
+		if (!tree.intersect(ray, isect))
+			continue;
+
+		vec3 P = ray.point_at(isect.t);
+		vec3 Q = uniform_sphere_sample(light, P, rng);
+		vec3 L = normalize(Q - P);
+		ray_t shadow_ray(P + 1e-4f * length(extent) * L, L);
+		shadow_ray.tmax = length(Q - shadow_ray.origin);
+		set.rays.push_back(shadow_ray);
+	}
+}
+
+// origins anywhere in the bounds, directions anywhere on the sphere
+static void make_random_rays(const bbox_t &bound, size_t count, rng_t &rng, ray_set_t &set) {
+	vec3 extent = bound.max_point - bound.min_point;
+	set.rays.reserve(count);
+	for (size_t i = 0; i < count; i++) {
+		vec3 origin = bound.min_point + vec3(rng() * extent.x, rng() * extent.y, rng() * extent.z);
+		set.rays.push_back(ray_t(origin, random_direction(rng)));
+	}
+}
+
+// best of repeats, to keep other processes out of the number
+static double trace(const bvh_tree_t &tree, const ray_set_t &set, bool occlusion, int repeats, size_t *hits, traversal_counters_t *counters) {
+	double best = INFINITY;
+	for (int r = 0; r < repeats; r++) {
+		size_t n = 0;
+		reset_traversal_counters();
+		tick_count start = tick_count::now();
+		if (occlusion) {
+			for (size_t i = 0; i < set.rays.size(); i++) {
+				if (tree.occluded(set.rays[i]))
+					n++;
+			}
+		} else {
+			for (size_t i = 0; i < set.rays.size(); i++) {
+				isect_t isect;
+				isect.t = set.rays[i].tmax;
+				if (tree.intersect(set.rays[i], isect))
+					n++;
+			}
+		}
+		best = std::min(best, (tick_count::now() - start).seconds());
+		*hits = n;
+		*counters = combined_traversal_counters();
+	}
+	return best;
+}
+
+static void print_throughput(const bvh_tree_t &tree, const std::vector<ray_set_t> &sets, bool occlusion, int repeats) {
+	printf("\"%s\": {", occlusion ? "occlusion" : "closest_hit");
+	for (size_t s = 0; s < sets.size(); s++) {
+		size_t hits = 0;
+		traversal_counters_t counters;
+		double sec = trace(tree, sets[s], occlusion, repeats, &hits, &counters);
+		double mrays = (sec > 0.0) ? sets[s].rays.size() / sec * 1e-6 : 0.0;
+
+		int type = occlusion ? TRAVERSAL_SHADOW : TRAVERSAL_PRIMARY;
+		double n = std::max((double)counters.rays[type], 1.0);
+		printf("%s\"%s\": {\"rays\": %ld, \"hits\": %ld, \"sec\": %.6f, \"mrays_per_sec\": %.3f, \"nodes_per_ray\": %.2f, \"boxes_per_ray\": %.2f, \"primitives_per_ray\": %.2f, \"max_stack_depth\": %ld}",
+			(s > 0) ? ", " : "", sets[s].name, sets[s].rays.size(), hits, sec, mrays,
+			counters.nodes[type] / n, counters.boxes[type] / n, counters.primitives[type] / n, (size_t)counters.max_depth[type]);
+	}
+	printf("}");
+}
+
+// scene names are file paths, which may hold characters a JSON string can not
+static string json_escape(const string &text) {
+	string escaped;
+	for (size_t i = 0; i < text.size(); i++) {
+		unsigned char c = (unsigned char)text[i];
+		if (c == '"' || c == '\\') {
+			escaped += '\\';
+			escaped += (char)c;
+		} else if (c < 0x20) {
+			char code[8];
+			snprintf(code, sizeof(code), "\\u%04x", c);
+			escaped += code;
+		} else {
+			escaped += (char)c;
+		}
+	}
+	return escaped;
+}
+
+static void bench_scene(const bench_options_t &options, bench_scene_t &scene, bool first) {
+	vector<shape_ref_t> shapes;
+	scene.mesh.refine(shapes);
+
+	// every builder and layout is traced with the same rays, the shadow rays cast from hits against a SAH reference tree
+	std::vector<ray_set_t> sets;
+	sets.push_back(ray_set_t("primary"));
+	sets.push_back(ray_set_t("shadow"));
+	sets.push_back(ray_set_t("random"));
+	{
+		bvh_tree_t reference(shapes, BVH_SPLIT_SAH);
+		reference.build();
+		reference.flatten();
+
+		rng_t rng(options.seed);
+		make_primary_rays(reference.bound(), options.resolution, sets[0]);
+		make_shadow_rays(reference, sets[0], rng, sets[1]);
+		make_random_rays(reference.bound(), options.random_count, rng, sets[2]);
+	}
+
+	printf("%s\n    {\"name\": \"%s\", \"triangles\": %ld, \"builds\": [", first ? "" : ",", json_escape(scene.name).c_str(), shapes.size());
+
+	for (size_t m = 0; m < sizeof(split_methods) / sizeof(split_methods[0]); m++) {
+		bvh_tree_t tree(shapes, split_methods[m]);
+		// the Morton builders emit the flattened nodes during build(), so build and flatten are timed together for every builder
+		tick_count build_start = tick_count::now();
+		tree.build();
+		size_t arena_bytes = tree.node_arena.memory_size() + tree.build_scratch_bytes;
+		tree.flatten();
+		tick_count build_end = tick_count::now();
+
+		tree.pack_triangles();
+
+		printf("%s\n      {\"split\": \"%s\", \"build_sec\": %.6f, \"nodes\": %ld, \"sah_cost\": %.4f, \"build_arena_bytes\": %ld, \"triangle_store_bytes\": %ld, \"layouts\": [",
+			(m > 0) ? "," : "", split_name(split_methods[m]), (build_end - build_start).seconds(),
+			tree.total_node_count, tree.sah_cost(), arena_bytes, tree.triangle_store->memory_size());
+
+		for (size_t l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++) {
+			tick_count layout_start = tick_count::now();
+			tree.set_layout(layouts[l]);
+			tick_count layout_end = tick_count::now();
+
+			int boxes;
+			size_t node_bytes = layout_node_size(layouts[l], &boxes);
+			printf("%s\n        {\"layout\": \"%s\", \"bytes\": %ld, \"node_bytes\": %ld, \"nodes_per_cache_line\": %.3f, \"boxes_per_cache_line\": %.3f, \"convert_sec\": %.6f, ",
+				(l > 0) ? "," : "", layout_name(layouts[l]), tree.memory_size(), node_bytes, (double)CACHE_LINE_SIZE / node_bytes,
+				(double)CACHE_LINE_SIZE * boxes / node_bytes, (layout_end - layout_start).seconds());
+			print_throughput(tree, sets, false, options.repeats);
+			printf(", ");
+			print_throughput(tree, sets, true, options.repeats);
+			printf("}");
+			fflush(stdout);
+		}
+		printf("\n      ]}");
+	}
+	printf("\n    ]}");
+}
+
+void usage() {
+	cerr << "usage: bench [-r repeats] [-s seed] [-w resolution] [-n random_rays] [-X] [file.ctm ...]" << endl;
+	cerr << "  -r  runs per measurement, the fastest is reported (default 3)" << endl;
+	cerr << "  -s  seed of the shadow and random ray sets" << endl;
+	cerr << "  -w  primary rays are traced at resolution x resolution (default 512)" << endl;
+	cerr << "  -n  number of random rays (default 262144)" << endl;
+	cerr << "  -X  skip the synthetic meshes" << endl;
+}
+
+int main(int argc, char** argv) {
+	bench_options_t options;
+
+	int c;
+	while ((c = getopt(argc, argv, "n:r:s:w:X")) != -1) {
+		switch (c) {
+			case 'n': {
+				options.random_count = atoi(optarg);
+				break;
+			}
+			case 'r': {
+				options.repeats = atoi(optarg);
+				if (options.repeats < 1) {
+					usage();
+					return -1;
+				}
+				break;
+			}
+			case 's': {
+				options.seed = strtoul(optarg, NULL, 10);
+				break;
+			}
+			case 'w': {
+				options.resolution = atoi(optarg);
+				if (options.resolution < 1) {
+					usage();
+					return -1;
+				}
+				break;
+			}
+			case 'X': {
+				options.synthetic = false;
+				break;
+			}
+			default: {
+				usage();
+				return -1;
+			}
+		}
+	}
+	for (int i = optind; i < argc; i++)
+		options.ctm_filepaths.push_back(argv[i]);
+
+	printf("{\n  \"simd_width\": %d, \"repeats\": %d, \"seed\": %u, \"resolution\": %ld,\n  \"scenes\": [",
+		SIMD_WIDTH, options.repeats, options.seed, options.resolution);
+
+	bool first = true;
+	for (size_t i = 0; i < options.ctm_filepaths.size(); i++) {
+		bench_scene_t scene;
+		scene.name = options.ctm_filepaths[i];
+		if (!triangle_mesh_t::load(options.ctm_filepaths[i], scene.mesh)) {
+			cerr << "Loading .ctm file failed: " << options.ctm_filepaths[i] << endl;
+			continue;
+		}
+		bench_scene(options, scene, first);
+		first = false;
+	}
+
+	if (options.synthetic) {
+		bench_scene_t sphere;
+		sphere.name = "synthetic-sphere";
+		make_sphere_mesh(256, sphere.mesh);
+		bench_scene(options, sphere, first);
+		first = false;
+
+		bench_scene_t soup;
+		soup.name = "synthetic-soup";
+		make_soup_mesh(100000, options.seed, soup.mesh);
+		bench_scene(options, soup, first);
+	}
+
+	printf("\n  ]\n}\n");
+	return 0;
+}
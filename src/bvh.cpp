@@ -1,12 +1,74 @@
+#include <tbb/parallel_invoke.h>
+
 #include "bvh.hpp"
 
 using namespace std;
 using namespace glm;
+using namespace tbb;
+
+static const size_t SAH_BUCKET_COUNT = 16;
+static const size_t SAH_MAX_SHAPES_IN_LEAF = 4;
+static const float SAH_TRAVERSAL_COST = 0.125f;
+static const float SAH_INTERSECTION_COST = 1.0f;
+static const size_t PARALLEL_BUILD_THRESHOLD = 4096;
+static const size_t PARALLEL_REFIT_THRESHOLD = 4096;
+
+
+const char* split_name(bvh_split_method_t method) {
+	switch (method) {
+		case BVH_SPLIT_SAH: return "sah";
+		case BVH_SPLIT_LBVH: return "lbvh";
+		case BVH_SPLIT_HLBVH: return "hlbvh";
+		default: return "middle";
+	}
+}
+
+const char* layout_name(bvh_layout_t layout) {
+	switch (layout) {
+		case BVH_LAYOUT_COMPACT: return "compact";
+		case BVH_LAYOUT_WIDE4: return "bvh4";
+		case BVH_LAYOUT_WIDE8: return "bvh8";
+		case BVH_LAYOUT_QUANTIZED: return "qbvh4";
+		default: return "binary";
+	}
+}
+
+
+struct bvh_build_task_t {
+	bvh_tree_t *tree;
+	vector<bvh_node_info_t> *node_info_list;
+	size_t start;
+	size_t end;
+	size_t *total_nodes;
+	vector<shape_ref_t> *ordered_shapes;
+	bvh_node_t **result;
+	
+	bvh_build_task_t(bvh_tree_t *t, vector<bvh_node_info_t> *list, size_t s, size_t e, size_t *n, vector<shape_ref_t> *ordered, bvh_node_t **r) :
+		tree(t), node_info_list(list), start(s), end(e), total_nodes(n), ordered_shapes(ordered), result(r) { }
+	
+	void operator() () const {
+		*result = tree->recursive_build(*node_info_list, start, end, total_nodes, *ordered_shapes, tree->node_arena.local_blocks());
+	}
+	
+};
+
+
+struct bvh_refit_task_t {
+	bvh_tree_t *tree;
+	size_t offset;
+	size_t end;
+	float *cost;
+	
+	bvh_refit_task_t(bvh_tree_t *t, size_t o, size_t e, float *c) : tree(t), offset(o), end(e), cost(c) { }
+	
+	void operator() () const {
+		*cost = tree->recursive_refit(offset, end);
+	}
+	
+};
 
-int bvh_node_t::node_id_sequence = 1;
 
-bvh_node_t::bvh_node_t() {
-	node_id = node_id_sequence++;
+bvh_node_t::bvh_node_t() : split_axis(0), first_shape_offset(0), shape_num(0) {
 	children[0] = children[1] = NULL;
 }
 
@@ -26,16 +88,49 @@ bvh_node_t& bvh_node_t::initialize_as_leaf(int first, int n, const bbox_t &b) {
 	return *this;		
 }
 
-bvh_tree_t::bvh_tree_t(const vector<shape_ref_t> &input_shapes) {
+bvh_tree_t::bvh_tree_t(const vector<shape_ref_t> &input_shapes, bvh_split_method_t method) : split_method(method) {
 	shapes.resize(input_shapes.size());
 	copy(input_shapes.begin(), input_shapes.end(), shapes.begin());
 	
 	root = NULL;
 	nodes = NULL;
 	total_node_count = 0;
+	layout = BVH_LAYOUT_BINARY;
+	wide4 = NULL;
+	wide8 = NULL;
+	compact = NULL;
+	quantized = NULL;
+	triangle_store = NULL;
+	nodes_owned = false;
+	built_sah_cost = 0.0f;
+	build_scratch_bytes = 0;
+}
+
+bvh_tree_t::~bvh_tree_t() {
+	release_nodes();
+	delete wide4;
+	delete wide8;
+	delete compact;
+	delete quantized;
+	delete triangle_store;
+}
+
+void bvh_tree_t::release_nodes() {
+	node_arena.release();
+	root = NULL;
+	if (nodes_owned)
+		delete [] nodes;
+	nodes = NULL;
+	nodes_owned = false;
+	total_node_count = 0;
 }
 
 void bvh_tree_t::build() {
+	if (split_method == BVH_SPLIT_LBVH || split_method == BVH_SPLIT_HLBVH) {
+		build_morton();
+		return;
+	}
+	
 	vector<bvh_node_info_t> node_info_list;
 	node_info_list.reserve(shapes.size());
 	for (size_t i = 0; i < shapes.size(); i++) {
@@ -44,39 +139,51 @@ void bvh_tree_t::build() {
 	}
 
 	size_t total_nodes = 0;
-	vector<shape_ref_t> ordered_shapes;
-	ordered_shapes.reserve(shapes.size());
-	root = recursive_build(node_info_list, 0, shapes.size(), &total_nodes, ordered_shapes);
+	vector<shape_ref_t> ordered_shapes(shapes.size());
+	vector<unsigned int> input_order;
+	input_order.swap(shape_indices);
+	shape_indices.resize(shapes.size());
+	root = recursive_build(node_info_list, 0, shapes.size(), &total_nodes, ordered_shapes, node_arena.local_blocks());
 	
-	assert(shapes.size() == ordered_shapes.size());	
-		
 	shapes.swap(ordered_shapes);
 	total_node_count = total_nodes;
+	build_scratch_bytes = node_info_list.capacity() * sizeof(bvh_node_info_t) + ordered_shapes.capacity() * sizeof(shape_ref_t);
+	
+	// a rebuild starts from the previous leaf order; keep shape_indices relative to the input
+	if (!input_order.empty()) {
+		for (size_t i = 0; i < shape_indices.size(); i++) {
+			shape_indices[i] = input_order[shape_indices[i]];
+		}
+	}
 }
 
-bvh_node_t* bvh_tree_t::recursive_build(vector<bvh_node_info_t> &node_info_list, size_t start, size_t end, size_t *total_nodes, vector<shape_ref_t> &ordered_shapes) {
+bvh_node_t* bvh_tree_t::recursive_build(vector<bvh_node_info_t> &node_info_list, size_t start, size_t end, size_t *total_nodes, vector<shape_ref_t> &ordered_shapes,
+	bvh_node_arena_t::block_list_t &blocks) {
+	size_t shape_num = end - start;
+	if (shape_num < 1) {
+		return NULL;
+	}
+	
 	(*total_nodes)++;
 
-	bvh_node_t *node = new bvh_node_t();
+	bvh_node_t *node = bvh_node_arena_t::allocate(blocks);
 
 	bbox_t bound;
 	for (size_t i = start; i < end; i++) {
 		bound.merge(node_info_list[i].bound);
 	}
 
-	size_t shape_num = end - start;
-	if (shape_num < 1) {
-		return NULL;
-	} else if (shape_num <= 2) {
+	if (shape_num <= 2) {
 		leaf_node:
 		
-		size_t first_shape_offset = ordered_shapes.size();
+		// shapes of a leaf are contiguous in node_info_list, so the leaf owns [start, end) of ordered_shapes
 		for (size_t i = start; i < end; i++) {
 			size_t shape_index = node_info_list[i].shape_index;
-			ordered_shapes.push_back(shapes[shape_index]);
+			ordered_shapes[i] = shapes[shape_index];
+			shape_indices[i] = shape_index;
 		}
 		
-		node->initialize_as_leaf(first_shape_offset, shape_num, bound);			
+		node->initialize_as_leaf(start, shape_num, bound);			
 		return node;
 	} else {
 		bbox_t centroid_bound;
@@ -87,30 +194,123 @@ bvh_node_t* bvh_tree_t::recursive_build(vector<bvh_node_info_t> &node_info_list,
 		
 		if (centroid_bound.max_point[dim] == centroid_bound.min_point[dim]) {
 			goto leaf_node;
-		}		
-		float mid_point = 0.5f * (centroid_bound.max_point[dim] + centroid_bound.min_point[dim]);
-		const bvh_node_info_t *node_info = partition(&node_info_list[start], &node_info_list[end - 1] + 1, bvh_mid_comparator_t(dim, mid_point));			
-		size_t mid = node_info - &node_info_list[0];
+		}
+		
+		size_t mid;
+		if (split_method == BVH_SPLIT_SAH) {
+			mid = sah_partition(node_info_list, start, end, bound, centroid_bound, dim);
+			if (mid == start) {
+				goto leaf_node;
+			}
+		} else {
+			float mid_point = 0.5f * (centroid_bound.max_point[dim] + centroid_bound.min_point[dim]);
+			const bvh_node_info_t *node_info = partition(&node_info_list[start], &node_info_list[end - 1] + 1, bvh_mid_comparator_t(dim, mid_point));			
+			mid = node_info - &node_info_list[0];
+		}
 		
-		node->initialize_as_branch(
-			dim,
-			recursive_build(node_info_list, start, mid, total_nodes, ordered_shapes),
-			recursive_build(node_info_list, mid, end, total_nodes, ordered_shapes)
-		);		
+		bvh_node_t *children[2];
+		if (shape_num >= PARALLEL_BUILD_THRESHOLD) {
+			size_t child_nodes[2] = { 0, 0 };
+			parallel_invoke(
+				bvh_build_task_t(this, &node_info_list, start, mid, &child_nodes[0], &ordered_shapes, &children[0]),
+				bvh_build_task_t(this, &node_info_list, mid, end, &child_nodes[1], &ordered_shapes, &children[1])
+			);
+			(*total_nodes) += child_nodes[0] + child_nodes[1];
+		} else {
+			children[0] = recursive_build(node_info_list, start, mid, total_nodes, ordered_shapes, blocks);
+			children[1] = recursive_build(node_info_list, mid, end, total_nodes, ordered_shapes, blocks);
+		}
+		
+		node->initialize_as_branch(dim, children[0], children[1]);		
 		return node;
 	}
 }
 
+size_t bvh_tree_t::sah_partition(vector<bvh_node_info_t> &node_info_list, size_t start, size_t end, const bbox_t &bound, const bbox_t &centroid_bound, int dim) const {
+	size_t shape_num = end - start;
+	float min_centroid = centroid_bound.min_point[dim];
+	float scale = (float)SAH_BUCKET_COUNT / (centroid_bound.max_point[dim] - min_centroid);
+	
+	bvh_sah_bucket_t buckets[SAH_BUCKET_COUNT];
+	for (size_t i = start; i < end; i++) {
+		size_t b = std::min((size_t)( (node_info_list[i].centroid[dim] - min_centroid) * scale ), SAH_BUCKET_COUNT - 1);
+		buckets[b].count++;
+		buckets[b].bound.merge(node_info_list[i].bound);
+	}
+	
+	// sweep from the right to get the cost of every right-hand side, then from the left
+	float right_area[SAH_BUCKET_COUNT];
+	size_t right_count[SAH_BUCKET_COUNT];
+	bbox_t right_bound;
+	size_t count = 0;
+	for (size_t i = SAH_BUCKET_COUNT - 1; i > 0; i--) {
+		if (buckets[i].count > 0) 
+			right_bound.merge(buckets[i].bound);
+		count += buckets[i].count;
+		right_count[i] = count;
+		right_area[i] = (count > 0) ? right_bound.surface_area() : 0.0f;
+	}
+	
+	float min_cost = INFINITY;
+	size_t min_cost_split = 0;
+	bbox_t left_bound;
+	count = 0;
+	for (size_t i = 0; i < SAH_BUCKET_COUNT - 1; i++) {
+		if (buckets[i].count > 0) 
+			left_bound.merge(buckets[i].bound);
+		count += buckets[i].count;
+		if (count == 0 || right_count[i + 1] == 0)
+			continue;
+		float cost = count * left_bound.surface_area() + right_count[i + 1] * right_area[i + 1];
+		if (cost < min_cost) {
+			min_cost = cost;
+			min_cost_split = i;
+		}
+	}
+	
+	float inv_area = 1.0f / bound.surface_area();
+	float split_cost = SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST * min_cost * inv_area;
+	float leaf_cost = SAH_INTERSECTION_COST * shape_num;
+	if (shape_num <= SAH_MAX_SHAPES_IN_LEAF && leaf_cost <= split_cost) {
+		return start;
+	}
+	if (min_cost == INFINITY) {
+		return start + shape_num / 2;
+	}
+	
+	const bvh_node_info_t *node_info = partition(&node_info_list[start], &node_info_list[end - 1] + 1, bvh_sah_comparator_t(dim, min_centroid, scale, min_cost_split));
+	return node_info - &node_info_list[0];
+}
+
 void bvh_tree_t::flatten() {
+	// the Morton builders emit the flattened nodes themselves
+	if (nodes != NULL) {
+		built_sah_cost = sah_cost();
+		return;
+	}
+	
+	if (total_node_count == 0) {
+		// no shapes, so no root to flatten
+		built_sah_cost = 0.0f;
+		node_arena.release();
+		root = NULL;
+		return;
+	}
+	
 	nodes = new bvh_linear_node_t[total_node_count];
+	nodes_owned = true;
 	size_t offset = 0;
 	recursive_flatten(root, &offset);
+	built_sah_cost = sah_cost();
+	
+	// the pointer tree was only scaffolding for the flattened nodes
+	node_arena.release();
+	root = NULL;
 }
 
 size_t bvh_tree_t::recursive_flatten(const bvh_node_t *node, size_t *offset) {
 	bvh_linear_node_t &linear_node = nodes[*offset];
 	linear_node.bounds = node->bounds;
-	linear_node.node_id = node->node_id;
 	size_t _offset = (*offset)++;
 			
 	if (node->shape_num > 0) {
@@ -126,30 +326,243 @@ size_t bvh_tree_t::recursive_flatten(const bvh_node_t *node, size_t *offset) {
 	return _offset;
 }
 
-bool bvh_tree_t::intersect(const ray_t& ray, isect_t &isect, bvh_stat_t *stat) const {
+void bvh_tree_t::attach(bvh_linear_node_t *linear_nodes, size_t node_count, const unsigned int *order) {
+	// nodes flattened by an earlier run; only the shapes have to be put back in leaf order
+	vector<shape_ref_t> ordered_shapes(shapes.size());
+	shape_indices.assign(order, order + shapes.size());
+	for (size_t i = 0; i < shapes.size(); i++) {
+		ordered_shapes[i] = shapes[order[i]];
+	}
+	shapes.swap(ordered_shapes);
+	
+	root = NULL;
+	nodes = linear_nodes;
+	nodes_owned = false;
+	total_node_count = node_count;
+	built_sah_cost = sah_cost();
+}
+
+float bvh_tree_t::refit() {
+	if (total_node_count == 0)
+		return 0.0f;
+	
+	float cost = recursive_refit(0, total_node_count) / nodes[0].bounds.surface_area();
+	update_layouts();
+	return cost;
+}
+
+// Recomputes the bounds of the subtree flattened into [offset, end) and returns its
+// SAH cost, not yet divided by the root area. Leaves own disjoint shape ranges, so
+// subtrees are refitted in parallel without locking.
+float bvh_tree_t::recursive_refit(size_t offset, size_t end) {
+	bvh_linear_node_t &node = nodes[offset];
+	
+	if (node.is_leaf()) {
+		bbox_t bound;
+		for (size_t i = node.shape_offset; i < node.shape_offset + node.shape_num; i++) {
+			shapes[i]->update_bound();
+			bound.merge(shapes[i]->bound());
+		}
+		node.bounds = bound;
+		return node.bounds.surface_area() * SAH_INTERSECTION_COST * node.shape_num;
+	}
+	
+	size_t second = node.second_child_offset;
+	float cost[2];
+	if (end - offset >= PARALLEL_REFIT_THRESHOLD) {
+		parallel_invoke(
+			bvh_refit_task_t(this, offset + 1, second, &cost[0]),
+			bvh_refit_task_t(this, second, end, &cost[1])
+		);
+	} else {
+		cost[0] = recursive_refit(offset + 1, second);
+		cost[1] = recursive_refit(second, end);
+	}
+	
+	node.bounds = nodes[offset + 1].bounds;
+	node.bounds.merge(nodes[second].bounds);
+	return cost[0] + cost[1] + node.bounds.surface_area() * SAH_TRAVERSAL_COST;
+}
+
+// Refits, then rebuilds from scratch once the SAH cost has grown past rebuild_ratio times
+// the cost of the last build. Returns true when the tree was rebuilt.
+bool bvh_tree_t::update(float rebuild_ratio) {
+	float cost = refit();
+	if (cost <= rebuild_ratio * built_sah_cost)
+		return false;
+	
+	rebuild();
+	return true;
+}
+
+void bvh_tree_t::rebuild() {
+	release_nodes();
+	build();
+	flatten();
+	update_layouts();
+}
+
+void bvh_tree_t::update_layouts() {
+	// the other layouts and the triangle store are copies of the binary nodes and the shapes
+	if (compact != NULL)
+		compact->compact();
+	if (wide4 != NULL)
+		wide4->collapse();
+	if (wide8 != NULL)
+		wide8->collapse();
+	if (quantized != NULL)
+		quantized->quantize();
+	if (triangle_store != NULL)
+		triangle_store->pack(shapes);
+}
+
+bool bvh_tree_t::intersect(const ray_t& ray, isect_t &isect, bvh_stat_t *stat, size_t root_offset) const {
+	if (total_node_count == 0)
+		return false;
+	
 	bool hit = false;
-	vec3 origin = ray.point_at(ray.tmin);
 	vec3 inv_direction = 1.0f / ray.direction;
 	ivec3 sign = ivec3(inv_direction.x < 0.0f, inv_direction.y < 0.0f, inv_direction.z < 0.0f);
 	
-	size_t node_num = 0;
+	traversal_count_t count(TRAVERSAL_PRIMARY);
+	size_t node_num = root_offset;
 	size_t todo_offset = 0;
 	size_t todo[64];
 	while (true) {
 		bvh_linear_node_t *node = &nodes[node_num];
+		count.visit(1);
 		if (node->bounds.intersect(ray, sign, inv_direction)) {
 			#if BVH_DEBUG
-			if (stat != NULL) stat->record_node_id(node->node_id);
+			if (stat != NULL) stat->record_node_id((int)node_num);
 			#endif
 			
 			if (node->shape_num > 0) {
-				for (size_t i = 0; i < node->shape_num; i++) {
-					size_t k = node->shape_offset + i;
-					assert(k < shapes.size());
-					if (shapes[k]->intersect(ray, isect)) {
-						hit = true;
-					}
+				assert(node->shape_offset + node->shape_num <= shapes.size());
+				count.leaf(node->shape_num);
+				if (intersect_shapes(ray, node->shape_offset, node->shape_num, isect))
+					hit = true;
+				
+				if (todo_offset == 0)
+					break;
+				node_num = todo[--todo_offset];	
+				
+			} else {
+				if (sign[node->axis]) {
+					todo[todo_offset++] = node_num + 1;
+					node_num = node->second_child_offset;
+				} else {
+					todo[todo_offset++] = node->second_child_offset;
+					node_num = node_num + 1;
 				}
+				count.depth(todo_offset);
+			}
+		} else {
+			if (todo_offset == 0)
+				break;
+			node_num = todo[--todo_offset];
+		}
+	}
+	
+	return hit;
+}
+
+void bvh_tree_t::pack_triangles() {
+	if (triangle_store == NULL)
+		triangle_store = new triangle_store_t();
+	triangle_store->pack(shapes);
+}
+
+void bvh_tree_t::set_layout(bvh_layout_t new_layout) {
+	switch (new_layout) {
+		case BVH_LAYOUT_COMPACT: {
+			if (compact == NULL) {
+				compact = new bvh_compact_tree_t(this);
+				compact->compact();
+			}
+			break;
+		}
+		case BVH_LAYOUT_WIDE4: {
+			if (wide4 == NULL) {
+				wide4 = new bvh_wide_tree_t<4>(this);
+				wide4->collapse();
+			}
+			break;
+		}
+		case BVH_LAYOUT_WIDE8: {
+			if (wide8 == NULL) {
+				wide8 = new bvh_wide_tree_t<8>(this);
+				wide8->collapse();
+			}
+			break;
+		}
+		case BVH_LAYOUT_QUANTIZED: {
+			if (quantized == NULL) {
+				quantized = new bvh_quantized_tree_t(this);
+				quantized->quantize();
+			}
+			break;
+		}
+		default: {
+			break;
+		}
+	}
+	layout = new_layout;
+}
+
+// A copy of the flattened tree with its layout and triangle store, all allocated and written by the calling
+// thread, so that on a NUMA machine the copy sits on that thread's node. The shapes themselves are shared.
+bvh_tree_t* bvh_tree_t::replicate() const {
+	bvh_tree_t *copy = new bvh_tree_t(shapes, split_method);
+	copy->shape_indices = shape_indices;
+	copy->nodes = new bvh_linear_node_t[total_node_count];
+	std::copy(nodes, nodes + total_node_count, copy->nodes);
+	copy->nodes_owned = true;
+	copy->total_node_count = total_node_count;
+	copy->built_sah_cost = built_sah_cost;
+	copy->set_layout(layout);
+	if (triangle_store != NULL)
+		copy->pack_triangles();
+	return copy;
+}
+
+size_t bvh_tree_t::memory_size() const {
+	switch (layout) {
+		case BVH_LAYOUT_COMPACT: return compact->memory_size();
+		case BVH_LAYOUT_WIDE4: return wide4->memory_size();
+		case BVH_LAYOUT_WIDE8: return wide8->memory_size();
+		case BVH_LAYOUT_QUANTIZED: return quantized->memory_size();
+		default: return total_node_count * sizeof(bvh_linear_node_t);
+	}
+}
+
+bool bvh_tree_t::occluded(const ray_t& ray) const {
+	if (total_node_count == 0)
+		return false;
+	if (layout == BVH_LAYOUT_COMPACT)
+		return compact->occluded(ray);
+	if (layout == BVH_LAYOUT_WIDE4)
+		return wide4->occluded(ray);
+	if (layout == BVH_LAYOUT_WIDE8)
+		return wide8->occluded(ray);
+	if (layout == BVH_LAYOUT_QUANTIZED)
+		return quantized->occluded(ray);
+	
+	vec3 inv_direction = 1.0f / ray.direction;
+	ivec3 sign = ivec3(inv_direction.x < 0.0f, inv_direction.y < 0.0f, inv_direction.z < 0.0f);
+	
+	traversal_count_t count(TRAVERSAL_SHADOW);
+	size_t node_num = 0;
+	size_t todo_offset = 0;
+	size_t todo[64];
+	while (true) {
+		const bvh_linear_node_t *node = &nodes[node_num];
+		count.visit(1);
+		if (node->bounds.intersect(ray, sign, inv_direction)) {
+			if (node->shape_num > 0) {
+				// any hit inside [tmin, tmax] blocks the ray, so stop at the first one
+				count.leaf(node->shape_num);
+				if (occluded_shapes(ray, node->shape_offset, node->shape_num))
+					return true;
 				
 				if (todo_offset == 0)
 					break;
@@ -163,6 +576,7 @@ bool bvh_tree_t::intersect(const ray_t& ray, isect_t &isect, bvh_stat_t *stat) c
 					todo[todo_offset++] = node->second_child_offset;
 					node_num = node_num + 1;
 				}
+				count.depth(todo_offset);
 			}
 		} else {
 			if (todo_offset == 0)
@@ -171,6 +585,99 @@ bool bvh_tree_t::intersect(const ray_t& ray, isect_t &isect, bvh_stat_t *stat) c
 		}
 	}
 	
+	return false;
+}
+
+unsigned int bvh_tree_t::intersect(ray_packet_t &packet) const {
+	unsigned int hit = 0;
+	if (total_node_count == 0)
+		return hit;
+	
+	// the rays traced one by one below are all part of this packet's count
+	traversal_count_t count(TRAVERSAL_PACKET);
+	
+	if (layout != BVH_LAYOUT_BINARY || !packet.coherent()) {
+		// mixed direction octants share no traversal order, so trace the rays one by one
+		for (size_t i = 0; i < packet.size; i++) {
+			ray_t ray = packet.ray(i);
+			isect_t isect;
+			isect.t = packet.t[i];
+			if (intersect(ray, isect)) {
+				packet.t[i] = isect.t;
+				packet.shape[i] = isect.shape;
+				packet.object_shape[i] = isect.object_shape;
+				packet.object_index[i] = isect.object_index;
+				hit |= (1u << i);
+			}
+		}
+		return hit;
+	}
+	
+	int sign[3] = { packet.dx[0] < 0.0f, packet.dy[0] < 0.0f, packet.dz[0] < 0.0f };
+	unsigned int full_mask = packet.full_mask();
+	
+	size_t node_num = 0;
+	size_t todo_offset = 0;
+	size_t todo[64];
+	while (true) {
+		const bvh_linear_node_t *node = &nodes[node_num];
+		unsigned int active = node->bounds.intersect(packet, full_mask);
+		count.visit(packet.size);
+		
+		if (active != 0 && (active & (active - 1)) == 0) {
+			// only one ray is left in this subtree, continue it with the single-ray traversal
+			size_t i = __builtin_ctz(active);
+			ray_t ray = packet.ray(i);
+			isect_t isect;
+			isect.t = packet.t[i];
+			if (intersect(ray, isect, NULL, node_num)) {
+				packet.t[i] = isect.t;
+				packet.shape[i] = isect.shape;
+				packet.object_shape[i] = isect.object_shape;
+				packet.object_index[i] = isect.object_index;
+				hit |= active;
+			}
+		} else if (active != 0) {
+			if (node->shape_num > 0) {
+				count.leaf(node->shape_num);
+				for (size_t i = 0; i < node->shape_num; i++) {
+					hit |= shapes[node->shape_offset + i]->intersect_packet(packet, active);
+				}
+			} else {
+				if (sign[node->axis]) {
+					todo[todo_offset++] = node_num + 1;
+					node_num = node->second_child_offset;
+				} else {
+					todo[todo_offset++] = node->second_child_offset;
+					node_num = node_num + 1;
+				}
+				count.depth(todo_offset);
+				continue;
+			}
+		}
+		
+		if (todo_offset == 0)
+			break;
+		node_num = todo[--todo_offset];
+	}
+	
 	return hit;
 }
 
+float bvh_tree_t::sah_cost() const {
+	if (total_node_count == 0)
+		return 0.0f;
+	
+	float inv_root_area = 1.0f / nodes[0].bounds.surface_area();
+	float cost = 0.0f;
+	for (size_t i = 0; i < total_node_count; i++) {
+		const bvh_linear_node_t &node = nodes[i];
+		float p = node.bounds.surface_area() * inv_root_area;
+		if (node.is_leaf()) {
+			cost += p * SAH_INTERSECTION_COST * node.shape_num;
+		} else {
+			cost += p * SAH_TRAVERSAL_COST;
+		}
+	}
+	return cost;
+}
@@ -2,6 +2,32 @@
 #define BVH_HPP
 
 #include "triangle_mesh.hpp"
+#include "bvh_wide.hpp"
+#include "bvh_compact.hpp"
+#include "bvh_quantized.hpp"
+#include "triangle_store.hpp"
+#include "bvh_counters.hpp"
+#include "bvh_arena.hpp"
+
+
+enum bvh_split_method_t {
+	BVH_SPLIT_MIDDLE,
+	BVH_SPLIT_SAH,
+	BVH_SPLIT_LBVH,     // Morton code order, written straight into the flattened nodes
+	BVH_SPLIT_HLBVH     // LBVH below, binned SAH over the Morton clusters above
+};
+
+enum bvh_layout_t {
+	BVH_LAYOUT_BINARY,
+	BVH_LAYOUT_COMPACT,
+	BVH_LAYOUT_WIDE4,
+	BVH_LAYOUT_WIDE8,
+	BVH_LAYOUT_QUANTIZED
+};
+
+// the names main takes for -b and -l, and bench reports
+const char* split_name(bvh_split_method_t method);
+const char* layout_name(bvh_layout_t layout);
 
 
 struct bvh_node_info_t {
@@ -22,10 +48,6 @@ struct bvh_node_t {
 	size_t first_shape_offset;
 	size_t shape_num;
 	
-	int node_id;
-	
-	static int node_id_sequence;
-	
 	bvh_node_t();
 	
 	bool is_leaf() const {
@@ -59,6 +81,29 @@ struct bvh_mid_comparator_t {
 	
 };
 
+struct bvh_sah_comparator_t {
+	int dim;
+	float min_centroid;
+	float scale;
+	size_t split_bucket;
+	
+	bvh_sah_comparator_t(int d, float min_c, float s, size_t b) : dim(d), min_centroid(min_c), scale(s), split_bucket(b) { }
+	
+	bool operator()(const bvh_node_info_t &node_info) const {
+		size_t b = (size_t)( (node_info.centroid[dim] - min_centroid) * scale );
+		return b <= split_bucket;
+	}
+	
+};
+
+struct bvh_sah_bucket_t {
+	size_t count;
+	bbox_t bound;
+	
+	bvh_sah_bucket_t() : count(0) { }
+	
+};
+
 struct bvh_linear_node_t {
 	bbox_t bounds;
 	
@@ -70,8 +115,6 @@ struct bvh_linear_node_t {
 	size_t shape_num;
 	int axis;
 	
-	int node_id;
-	
 	bool is_leaf() const {
 		return ( shape_num > 0 );
 	}
@@ -82,28 +125,107 @@ struct bvh_stat_t;
 
 struct bvh_tree_t {
 	std::vector<shape_ref_t> shapes;
+	std::vector<unsigned int> shape_indices;  // input index of each shape in leaf order
 	size_t total_node_count;	
-	bvh_node_t *root;
+	bvh_node_t *root;        // the unflattened tree, only between build() and flatten()
+	bvh_node_arena_t node_arena;
 	bvh_linear_node_t *nodes;
+	bvh_split_method_t split_method;
+	bvh_layout_t layout;
+	bvh_wide_tree_t<4> *wide4;
+	bvh_wide_tree_t<8> *wide8;
+	bvh_compact_tree_t *compact;
+	bvh_quantized_tree_t *quantized;
+	triangle_store_t *triangle_store;
+	bool nodes_owned;       // false when nodes point into a mapped cache file
+	float built_sah_cost;   // SAH cost when the topology was last built, for refit()
+	size_t build_scratch_bytes;  // what the last build() allocated besides the node arena and freed before returning
 	
-	bvh_tree_t(const std::vector<shape_ref_t> &input_shapes);
+	bvh_tree_t(const std::vector<shape_ref_t> &input_shapes, bvh_split_method_t method = BVH_SPLIT_MIDDLE);
+	~bvh_tree_t();
 
 	void build();
-	bvh_node_t* recursive_build(std::vector<bvh_node_info_t> &node_info_list, size_t start, size_t end, size_t *total_nodes, std::vector<shape_ref_t> &ordered_shapes);
+	void build_morton();
+	bvh_node_t* recursive_build(std::vector<bvh_node_info_t> &node_info_list, size_t start, size_t end, size_t *total_nodes, std::vector<shape_ref_t> &ordered_shapes,
+		bvh_node_arena_t::block_list_t &blocks);
+	size_t sah_partition(std::vector<bvh_node_info_t> &node_info_list, size_t start, size_t end, const bbox_t &bound, const bbox_t &centroid_bound, int dim) const;
 	
 	void flatten();	
 	size_t recursive_flatten(const bvh_node_t *node, size_t *offset);
 	
-	bool intersect(const ray_t& ray, isect_t &isect, bvh_stat_t *stat) const;
+	void attach(bvh_linear_node_t *linear_nodes, size_t node_count, const unsigned int *order);
+	
+	float refit();
+	float recursive_refit(size_t offset, size_t end);
+	bool update(float rebuild_ratio = 1.25f);
+	void rebuild();
+	void update_layouts();
+	void release_nodes();
+	
+	void pack_triangles();
+	void set_layout(bvh_layout_t new_layout);
+	bvh_tree_t* replicate() const;
+	size_t memory_size() const;
+	
+	float sah_cost() const;
+	
+	// a tree over no shapes has no nodes; nothing hits it and its bound is empty
+	bool empty() const {
+		return total_node_count == 0;
+	}
+	
+	bbox_t bound() const {
+		return empty() ? bbox_t() : nodes[0].bounds;
+	}
+	
+	bool intersect(const ray_t& ray, isect_t &isect, bvh_stat_t *stat, size_t root_offset = 0) const;
 	
 	bool intersect(const ray_t& ray, isect_t &isect) const {
-		return intersect(ray, isect, NULL);
+		if (empty())
+			return false;
+		switch (layout) {
+			case BVH_LAYOUT_COMPACT: return compact->intersect(ray, isect);
+			case BVH_LAYOUT_WIDE4: return wide4->intersect(ray, isect);
+			case BVH_LAYOUT_WIDE8: return wide8->intersect(ray, isect);
+			case BVH_LAYOUT_QUANTIZED: return quantized->intersect(ray, isect);
+			default: return intersect(ray, isect, NULL);
+		}
 	}	
 	
 	bool intersect(const ray_t& ray) const {
-		isect_t isect;
-		return intersect(ray, isect);
+		return occluded(ray);
 	}
+	
+	bool occluded(const ray_t& ray) const;
+	
+	bool intersect_shapes(const ray_t& ray, size_t offset, size_t n, isect_t &isect) const {
+		if (triangle_store != NULL)
+			return triangle_store->intersect(ray, offset, n, isect);
+		
+		bool hit = false;
+		for (size_t i = offset; i < offset + n; i++) {
+			if (shapes[i]->intersect(ray, isect))
+				hit = true;
+		}
+		return hit;
+	}
+	
+	bool occluded_shapes(const ray_t& ray, size_t offset, size_t n) const {
+		if (triangle_store != NULL)
+			return triangle_store->occluded(ray, offset, n);
+		
+		for (size_t i = offset; i < offset + n; i++) {
+			if (shapes[i]->occluded(ray))
+				return true;
+		}
+		return false;
+	}
+	
+	unsigned int intersect(ray_packet_t &packet) const;
+	
+private:
+	bvh_tree_t(const bvh_tree_t &);
+	bvh_tree_t& operator=(const bvh_tree_t &);
 		
 };
 
@@ -135,8 +257,9 @@ struct bvh_stat_t {
 		} else {
 			size_t i = offset + 1;
 			size_t j = node.second_child_offset;
-			std::printf("%d -> %d ;\n", node.node_id, bvh_tree.nodes[i].node_id);
-			std::printf("%d -> %d ;\n", node.node_id, bvh_tree.nodes[j].node_id);
+			// a node's id is its offset in the flattened array
+			std::printf("%ld -> %ld ;\n", offset, i);
+			std::printf("%ld -> %ld ;\n", offset, j);
 			
 			recursive_output_graph(bvh_tree, i);
 			recursive_output_graph(bvh_tree, j);
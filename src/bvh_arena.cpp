@@ -0,0 +1,33 @@
+#include "bvh.hpp"
+#include "bvh_arena.hpp"
+
+using namespace std;
+using namespace tbb;
+
+
+bvh_node_arena_t::~bvh_node_arena_t() {
+	release();
+}
+
+bvh_node_t* bvh_node_arena_t::allocate(block_list_t &list) {
+	if (list.used == block_size) {
+		list.blocks.push_back(new bvh_node_t[block_size]);
+		list.used = 0;
+	}
+	return &list.blocks.back()[list.used++];
+}
+
+void bvh_node_arena_t::release() {
+	for (thread_blocks_t::iterator it = thread_blocks.begin(); it != thread_blocks.end(); ++it) {
+		for (size_t i = 0; i < it->blocks.size(); i++)
+			delete [] it->blocks[i];
+	}
+	thread_blocks.clear();
+}
+
+size_t bvh_node_arena_t::memory_size() const {
+	size_t blocks = 0;
+	for (thread_blocks_t::const_iterator it = thread_blocks.begin(); it != thread_blocks.end(); ++it)
+		blocks += it->blocks.size();
+	return blocks * block_size * sizeof(bvh_node_t);
+}
@@ -0,0 +1,47 @@
+#ifndef BVH_ARENA_HPP
+#define BVH_ARENA_HPP
+
+#include <vector>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/cache_aligned_allocator.h>
+
+
+struct bvh_node_t;
+
+// Bump allocator for the nodes of one build. Every thread carves nodes out of blocks of its own,
+// so parallel subtrees and concurrent builds never share an allocator lock or a cache line,
+// and the whole tree goes back in one release() instead of a walk over every node. A build task looks
+// up its thread's blocks once with local_blocks() and allocates from them for the whole of its subtree.
+struct bvh_node_arena_t {
+	static const size_t block_size = 1024;
+
+	struct block_list_t {
+		std::vector<bvh_node_t *> blocks;
+		size_t used;          // nodes taken from the last block
+
+		block_list_t() : used(block_size) { }
+
+	};
+
+	typedef tbb::enumerable_thread_specific< block_list_t, tbb::cache_aligned_allocator<block_list_t>, tbb::ets_no_key > thread_blocks_t;
+
+	thread_blocks_t thread_blocks;
+
+	bvh_node_arena_t() { }
+	~bvh_node_arena_t();
+
+	block_list_t& local_blocks() {
+		return thread_blocks.local();
+	}
+
+	static bvh_node_t* allocate(block_list_t &list);
+	void release();
+	size_t memory_size() const;
+
+private:
+	bvh_node_arena_t(const bvh_node_arena_t &);
+	bvh_node_arena_t& operator=(const bvh_node_arena_t &);
+
+};
+
+#endif
@@ -0,0 +1,271 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bvh_cache.hpp"
+
+using namespace std;
+using namespace glm;
+
+static const char BVH_CACHE_MAGIC[8] = { 'A', 'N', 'D', 'O', 'N', 'B', 'V', 'H' };
+static const uint32_t BVH_CACHE_VERSION = 1;
+static const uint64_t BVH_CACHE_ALIGNMENT = 64;
+static const uint64_t BVH_STACK_SIZE = 64;     // entries in the todo stacks of the traversals
+
+static const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ULL;
+static const uint64_t FNV_PRIME = 1099511628211ULL;
+
+
+static uint64_t fnv1a(const void *p, size_t n, uint64_t h) {
+	const unsigned char *bytes = (const unsigned char *)p;
+	for (size_t i = 0; i < n; i++) {
+		h ^= bytes[i];
+		h *= FNV_PRIME;
+	}
+	return h;
+}
+
+static uint64_t align_up(uint64_t offset) {
+	return ( offset + BVH_CACHE_ALIGNMENT - 1 ) & ~( BVH_CACHE_ALIGNMENT - 1 );
+}
+
+static bool write_at(FILE *fp, uint64_t offset, const void *p, size_t n) {
+	if (fseek(fp, (long)offset, SEEK_SET) != 0)
+		return false;
+	return ( n == 0 ) || ( fwrite(p, 1, n, fp) == n );
+}
+
+// a subtree still to check: its first node, one past its last, and the interior nodes above it
+struct node_range_t {
+	uint64_t node;
+	uint64_t end;
+	uint64_t depth;
+};
+
+
+bvh_cache_t::bvh_cache_t() : data(NULL), size(0), header(NULL) { }
+
+bvh_cache_t::~bvh_cache_t() {
+	close();
+}
+
+bool bvh_cache_t::model_key(const char *ctm_filepath, uint64_t *key) {
+	struct stat st;
+	if (stat(ctm_filepath, &st) != 0 || st.st_size == 0)
+		return false;
+
+	// writing the model, or replacing it, moves its size or modification time
+	uint64_t stamp[5] = { (uint64_t)st.st_dev, (uint64_t)st.st_ino, (uint64_t)st.st_size, (uint64_t)st.st_mtim.tv_sec, (uint64_t)st.st_mtim.tv_nsec };
+	*key = fnv1a(stamp, sizeof(stamp), FNV_OFFSET_BASIS);
+	return true;
+}
+
+uint64_t bvh_cache_t::make_key(uint64_t model_key, bvh_split_method_t method, size_t extra_shapes) {
+	// the model plus everything that changes the tree or its binary layout;
+	// extra_shapes counts the shapes appended after the mesh triangles
+	uint32_t settings[4] = { BVH_CACHE_VERSION, (uint32_t)method, (uint32_t)sizeof(bvh_linear_node_t), (uint32_t)extra_shapes };
+	return fnv1a(settings, sizeof(settings), model_key);
+}
+
+uint64_t bvh_cache_t::extend_key(uint64_t key, const void *p, size_t n) {
+	return fnv1a(p, n, key);
+}
+
+string bvh_cache_t::path_for(const char *ctm_filepath, uint64_t key) {
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".%016llx.bvh", (unsigned long long)key);
+	return string(ctm_filepath) + suffix;
+}
+
+bool bvh_cache_t::write(const char *path, uint64_t key, const triangle_mesh_t &mesh, const bvh_tree_t &tree) {
+	bvh_cache_header_t h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, BVH_CACHE_MAGIC, sizeof(h.magic));
+	h.version = BVH_CACHE_VERSION;
+	h.node_size = sizeof(bvh_linear_node_t);
+	h.key = key;
+	h.vertex_count = mesh.vertices.size();
+	h.index_count = mesh.indices.size();
+	h.shape_count = tree.shapes.size();
+	h.node_count = tree.total_node_count;
+
+	h.vertex_offset = align_up(sizeof(h));
+	h.normal_offset = align_up(h.vertex_offset + h.vertex_count * sizeof(vec3));
+	h.index_offset = align_up(h.normal_offset + h.vertex_count * sizeof(vec3));
+	h.shape_index_offset = align_up(h.index_offset + h.index_count * sizeof(unsigned int));
+	h.node_offset = align_up(h.shape_index_offset + h.shape_count * sizeof(unsigned int));
+
+	// write next to the final name and rename, so a concurrent reader never maps a partial file
+	string tmp_path;
+	FILE *fp = create_temp(path, tmp_path);
+	if (fp == NULL)
+		return false;
+
+	bool ok = write_at(fp, 0, &h, sizeof(h))
+		&& write_at(fp, h.vertex_offset, &mesh.vertices[0], h.vertex_count * sizeof(vec3))
+		&& write_at(fp, h.normal_offset, &mesh.normals[0], h.vertex_count * sizeof(vec3))
+		&& write_at(fp, h.index_offset, &mesh.indices[0], h.index_count * sizeof(unsigned int))
+		&& write_at(fp, h.shape_index_offset, &tree.shape_indices[0], h.shape_count * sizeof(unsigned int))
+		&& write_at(fp, h.node_offset, tree.nodes, h.node_count * sizeof(bvh_linear_node_t));
+
+	if (fclose(fp) != 0)
+		ok = false;
+	if (ok && rename(tmp_path.c_str(), path) != 0)
+		ok = false;
+	if (!ok)
+		unlink(tmp_path.c_str());
+	return ok;
+}
+
+FILE* bvh_cache_t::create_temp(const char *path, string &tmp_path) {
+	// a unique name, so that writers of the same file started together never share, or unlink, each other's
+	tmp_path = string(path) + ".XXXXXX";
+	vector<char> name(tmp_path.begin(), tmp_path.end());
+	name.push_back('\0');
+	int fd = mkstemp(&name[0]);
+	if (fd < 0)
+		return NULL;
+	tmp_path = &name[0];
+
+	// mkstemp makes the file private to us; the cache is as readable as any other file written here
+	mode_t mask = umask(0);
+	umask(mask);
+	fchmod(fd, 0666 & ~mask);
+
+	FILE *fp = fdopen(fd, "wb");
+	if (fp == NULL) {
+		::close(fd);
+		unlink(tmp_path.c_str());
+	}
+	return fp;
+}
+
+bool bvh_cache_t::fits(uint64_t offset, uint64_t count, uint64_t element_size, uint64_t size) {
+	// every writer aligns its arrays, and the nodes must be aligned to be read in place
+	return offset <= size && offset % sizeof(uint64_t) == 0 && count <= ( size - offset ) / element_size;
+}
+
+bool bvh_cache_t::valid_tree(const unsigned int *indices, uint64_t index_count, uint64_t vertex_count,
+	const unsigned int *order, uint64_t shape_count, const bvh_linear_node_t *nodes, uint64_t node_count) {
+	// the mesh triangles come first among the shapes
+	if (index_count % 3 != 0 || index_count / 3 > shape_count || node_count == 0)
+		return false;
+	for (uint64_t i = 0; i < index_count; i++) {
+		if (indices[i] >= vertex_count)
+			return false;
+	}
+
+	vector<bool> seen(shape_count, false);
+	for (uint64_t i = 0; i < shape_count; i++) {
+		if (order[i] >= shape_count || seen[order[i]])
+			return false;
+		seen[order[i]] = true;
+	}
+
+	// each subtree holds [node, end): the first child right after its parent, the second child at
+	// second_child_offset up to end; visiting them that way reaches every node exactly once
+	vector<node_range_t> todo;
+	node_range_t root = { 0, node_count, 0 };
+	todo.push_back(root);
+	while (!todo.empty()) {
+		node_range_t r = todo.back();
+		todo.pop_back();
+		const bvh_linear_node_t &node = nodes[r.node];
+		if (node.shape_num > 0) {
+			if (r.end != r.node + 1 || node.shape_num > shape_count || node.shape_offset > shape_count - node.shape_num)
+				return false;
+			continue;
+		}
+
+		uint64_t second = node.second_child_offset;
+		if (second <= r.node + 1 || second >= r.end || node.axis < 0 || node.axis > 2 || r.depth + 1 > BVH_STACK_SIZE)
+			return false;
+		node_range_t first_child = { r.node + 1, second, r.depth + 1 };
+		node_range_t second_child = { second, r.end, r.depth + 1 };
+		todo.push_back(second_child);
+		todo.push_back(first_child);
+	}
+	return true;
+}
+
+bool bvh_cache_t::open(const char *path, uint64_t key) {
+	close();
+
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(bvh_cache_header_t)) {
+		::close(fd);
+		return false;
+	}
+
+	// private writable mapping: pages are shared with the page cache until something refits a node
+	void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (p == MAP_FAILED)
+		return false;
+
+	data = p;
+	size = st.st_size;
+	header = (const bvh_cache_header_t *)data;
+
+	const bvh_cache_header_t &h = *header;
+	bool valid = memcmp(h.magic, BVH_CACHE_MAGIC, sizeof(h.magic)) == 0
+		&& h.version == BVH_CACHE_VERSION
+		&& h.node_size == sizeof(bvh_linear_node_t)
+		&& h.key == key
+		&& fits(h.vertex_offset, h.vertex_count, sizeof(vec3), size)
+		&& fits(h.normal_offset, h.vertex_count, sizeof(vec3), size)
+		&& fits(h.index_offset, h.index_count, sizeof(unsigned int), size)
+		&& fits(h.shape_index_offset, h.shape_count, sizeof(unsigned int), size)
+		&& fits(h.node_offset, h.node_count, sizeof(bvh_linear_node_t), size)
+		&& valid_tree((const unsigned int *)at(h.index_offset), h.index_count, h.vertex_count,
+			(const unsigned int *)at(h.shape_index_offset), h.shape_count, (const bvh_linear_node_t *)at(h.node_offset), h.node_count);
+	if (!valid) {
+		close();
+		return false;
+	}
+
+	madvise(data, size, MADV_WILLNEED);
+	return true;
+}
+
+void bvh_cache_t::close() {
+	if (data != NULL)
+		munmap(data, size);
+	data = NULL;
+	size = 0;
+	header = NULL;
+}
+
+void bvh_cache_t::load_mesh(triangle_mesh_t &mesh) const {
+	assert(header != NULL);
+
+	const vec3 *vertices = (const vec3 *)at(header->vertex_offset);
+	const vec3 *normals = (const vec3 *)at(header->normal_offset);
+	const unsigned int *indices = (const unsigned int *)at(header->index_offset);
+
+	mesh.vertices.assign(vertices, vertices + header->vertex_count);
+	mesh.normals.assign(normals, normals + header->vertex_count);
+	mesh.indices.assign(indices, indices + header->index_count);
+}
+
+bool bvh_cache_t::attach(bvh_tree_t &tree) const {
+	assert(header != NULL);
+
+	if (tree.shapes.size() != header->shape_count)
+		return false;
+
+	// open() checked the order and the nodes against the shape count
+	const unsigned int *order = (const unsigned int *)at(header->shape_index_offset);
+	bvh_linear_node_t *linear_nodes = (bvh_linear_node_t *)at(header->node_offset);
+	tree.attach(linear_nodes, header->node_count, order);
+	return true;
+}
@@ -0,0 +1,77 @@
+#ifndef BVH_CACHE_HPP
+#define BVH_CACHE_HPP
+
+#include <cstdio>
+#include <string>
+#include <stdint.h>
+
+#include "triangle_mesh.hpp"
+#include "bvh.hpp"
+
+
+// On-disk layout: the header, then each array at a 64-byte aligned offset from the start of the file.
+struct bvh_cache_header_t {
+	char magic[8];
+	uint32_t version;
+	uint32_t node_size;       // sizeof(bvh_linear_node_t) of the writer
+	uint64_t key;
+	uint64_t vertex_count;
+	uint64_t index_count;
+	uint64_t shape_count;
+	uint64_t node_count;
+	uint64_t vertex_offset;   // vertices and normals, vertex_count vec3 each
+	uint64_t normal_offset;
+	uint64_t index_offset;
+	uint64_t shape_index_offset;
+	uint64_t node_offset;
+
+};
+
+// A flattened BVH together with the mesh it was built over, mapped read/copy-on-write
+// so the nodes are traversed in place and a warm start neither parses the model nor builds.
+struct bvh_cache_t {
+	void *data;
+	size_t size;
+	const bvh_cache_header_t *header;
+
+	bvh_cache_t();
+	~bvh_cache_t();
+
+	// names the model file by its device, inode, size and modification time, so the model is never read to
+	// tell whether it changed; taken once per run and passed to everything keyed on the model
+	static bool model_key(const char *ctm_filepath, uint64_t *key);
+	static uint64_t make_key(uint64_t model_key, bvh_split_method_t method, size_t extra_shapes);
+	// folds n more bytes of settings into a key from make_key
+	static uint64_t extend_key(uint64_t key, const void *p, size_t n);
+	static std::string path_for(const char *ctm_filepath, uint64_t key);
+	static bool write(const char *path, uint64_t key, const triangle_mesh_t &mesh, const bvh_tree_t &tree);
+
+	// a file of its own next to path, to be renamed over path once it is complete
+	static FILE* create_temp(const char *path, std::string &tmp_path);
+
+	// Checks for arrays read from a mapped file, so a damaged or edited file is turned away when it is
+	// opened rather than read out of bounds while rendering. fits() tells whether count elements at offset
+	// lie inside size bytes; valid_tree() whether the triangles only index vertices there are, order is a
+	// permutation of the shapes, and the nodes form one depth-first flattened tree over those shapes that
+	// the traversal stacks can hold.
+	static bool fits(uint64_t offset, uint64_t count, uint64_t element_size, uint64_t size);
+	static bool valid_tree(const unsigned int *indices, uint64_t index_count, uint64_t vertex_count,
+		const unsigned int *order, uint64_t shape_count, const bvh_linear_node_t *nodes, uint64_t node_count);
+
+	bool open(const char *path, uint64_t key);
+	void close();
+
+	void load_mesh(triangle_mesh_t &mesh) const;
+	bool attach(bvh_tree_t &tree) const;
+
+private:
+	bvh_cache_t(const bvh_cache_t &);
+	bvh_cache_t& operator=(const bvh_cache_t &);
+
+	const char* at(uint64_t offset) const {
+		return (const char *)data + offset;
+	}
+
+};
+
+#endif
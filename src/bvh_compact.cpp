@@ -0,0 +1,132 @@
+#include "bvh.hpp"
+#include "bvh_compact.hpp"
+
+using namespace std;
+using namespace glm;
+
+
+bvh_compact_tree_t::bvh_compact_tree_t(const bvh_tree_t *t) : tree(t) { }
+
+void bvh_compact_tree_t::compact() {
+	nodes.clear();
+	#if BVH_DEBUG
+	node_ids.clear();
+	#endif
+	if (tree->total_node_count == 0)
+		return;
+
+	// slot 1 is padding, so every sibling pair starts on a 64-byte line
+	nodes.reserve(tree->total_node_count + 1);
+	nodes.resize(2);
+	nodes[1].offset = 0;
+	nodes[1].shape_num = 0;
+	nodes[1].axis = 0;
+
+	#if BVH_DEBUG
+	node_ids.resize(tree->total_node_count + 1, -1);
+	#endif
+
+	recursive_compact(0, 0);
+}
+
+void bvh_compact_tree_t::recursive_compact(size_t binary_offset, size_t compact_offset) {
+	const bvh_linear_node_t &linear_node = tree->nodes[binary_offset];
+
+	bvh_compact_node_t node;
+	node.bounds = linear_node.bounds;
+
+	#if BVH_DEBUG
+	node_ids[compact_offset] = (int)binary_offset;
+	#endif
+
+	if (linear_node.is_leaf()) {
+		node.offset = linear_node.shape_offset;
+		node.shape_num = linear_node.shape_num;
+		node.axis = 0;
+		nodes[compact_offset] = node;
+	} else {
+		size_t pair_offset = nodes.size();
+		nodes.resize(pair_offset + 2);
+
+		node.offset = pair_offset;
+		node.shape_num = 0;
+		node.axis = linear_node.axis;
+		nodes[compact_offset] = node;
+
+		recursive_compact(binary_offset + 1, pair_offset);
+		recursive_compact(linear_node.second_child_offset, pair_offset + 1);
+	}
+}
+
+bool bvh_compact_tree_t::intersect(const ray_t &ray, isect_t &isect) const {
+	bool hit = false;
+	vec3 inv_direction = 1.0f / ray.direction;
+	ivec3 sign = ivec3(inv_direction.x < 0.0f, inv_direction.y < 0.0f, inv_direction.z < 0.0f);
+
+	traversal_count_t count(TRAVERSAL_PRIMARY);
+	unsigned int node_num = 0;
+	size_t todo_offset = 0;
+	unsigned int todo[64];
+	while (true) {
+		const bvh_compact_node_t *node = &nodes[node_num];
+		count.visit(1);
+		if (node->bounds.intersect(ray, sign, inv_direction)) {
+			if (node->is_leaf()) {
+				count.leaf(node->shape_num);
+				if (tree->intersect_shapes(ray, node->offset, node->shape_num, isect))
+					hit = true;
+
+				if (todo_offset == 0)
+					break;
+				node_num = todo[--todo_offset];
+			} else {
+				unsigned int near = sign[node->axis];
+				todo[todo_offset++] = node->offset + (1 - near);
+				node_num = node->offset + near;
+				count.depth(todo_offset);
+			}
+		} else {
+			if (todo_offset == 0)
+				break;
+			node_num = todo[--todo_offset];
+		}
+	}
+
+	return hit;
+}
+
+bool bvh_compact_tree_t::occluded(const ray_t &ray) const {
+	vec3 inv_direction = 1.0f / ray.direction;
+	ivec3 sign = ivec3(inv_direction.x < 0.0f, inv_direction.y < 0.0f, inv_direction.z < 0.0f);
+
+	traversal_count_t count(TRAVERSAL_SHADOW);
+	unsigned int node_num = 0;
+	size_t todo_offset = 0;
+	unsigned int todo[64];
+	while (true) {
+		const bvh_compact_node_t *node = &nodes[node_num];
+		count.visit(1);
+		if (node->bounds.intersect(ray, sign, inv_direction)) {
+			if (node->is_leaf()) {
+				count.leaf(node->shape_num);
+				if (tree->occluded_shapes(ray, node->offset, node->shape_num))
+					return true;
+
+				if (todo_offset == 0)
+					break;
+				node_num = todo[--todo_offset];
+			} else {
+				unsigned int near = sign[node->axis];
+				todo[todo_offset++] = node->offset + (1 - near);
+				node_num = node->offset + near;
+				count.depth(todo_offset);
+			}
+		} else {
+			if (todo_offset == 0)
+				break;
+			node_num = todo[--todo_offset];
+		}
+	}
+
+	return false;
+}
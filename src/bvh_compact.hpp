@@ -0,0 +1,52 @@
+#ifndef BVH_COMPACT_HPP
+#define BVH_COMPACT_HPP
+
+#include <vector>
+#include <tbb/cache_aligned_allocator.h>
+
+#include "shape.hpp"
+
+
+struct bvh_tree_t;
+
+// 32 bytes, two per cache line; the children of a branch sit side by side at offset and offset + 1
+struct bvh_compact_node_t {
+	bbox_t bounds;
+	unsigned int offset;        // first child for a branch, first shape for a leaf
+	unsigned int shape_num : 30;
+	unsigned int axis : 2;
+
+	bool is_leaf() const {
+		return ( shape_num > 0 );
+	}
+
+};
+
+// a sibling pair fills one 64-byte line; the array size goes negative, and compiling fails, if a node is not 32 bytes
+typedef char bvh_compact_node_size_check_t[( sizeof(bvh_compact_node_t) == 32 ) ? 1 : -1];
+
+struct bvh_compact_tree_t {
+	typedef std::vector< bvh_compact_node_t, tbb::cache_aligned_allocator<bvh_compact_node_t> > node_list_t;
+
+	const bvh_tree_t *tree;
+	node_list_t nodes;
+
+	#if BVH_DEBUG
+	std::vector<int> node_ids;  // compact offset -> binary node id
+	#endif
+
+	bvh_compact_tree_t(const bvh_tree_t *t);
+
+	void compact();
+	void recursive_compact(size_t binary_offset, size_t compact_offset);
+
+	bool intersect(const ray_t &ray, isect_t &isect) const;
+	bool occluded(const ray_t &ray) const;
+
+	size_t memory_size() const {
+		return nodes.size() * sizeof(bvh_compact_node_t);
+	}
+
+};
+
+#endif
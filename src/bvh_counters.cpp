@@ -0,0 +1,92 @@
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/cache_aligned_allocator.h>
+
+#include "bvh_counters.hpp"
+
+using namespace tbb;
+
+
+typedef enumerable_thread_specific< traversal_counters_t, cache_aligned_allocator<traversal_counters_t>, ets_key_per_instance > thread_counters_t;
+
+static thread_counters_t thread_counters;
+
+
+traversal_counters_t::traversal_counters_t() : active(NULL) {
+	for (int i = 0; i < TRAVERSAL_TYPE_COUNT; i++) {
+		rays[i] = nodes[i] = boxes[i] = primitives[i] = max_depth[i] = 0;
+	}
+}
+
+void traversal_counters_t::merge(const traversal_counters_t &c) {
+	for (int i = 0; i < TRAVERSAL_TYPE_COUNT; i++) {
+		rays[i] += c.rays[i];
+		nodes[i] += c.nodes[i];
+		boxes[i] += c.boxes[i];
+		primitives[i] += c.primitives[i];
+		if (c.max_depth[i] > max_depth[i])
+			max_depth[i] = c.max_depth[i];
+	}
+}
+
+uint64_t traversal_counters_t::cost() const {
+	uint64_t n = 0;
+	for (int i = 0; i < TRAVERSAL_TYPE_COUNT; i++) {
+		n += nodes[i] + primitives[i];
+	}
+	return n;
+}
+
+const char* traversal_counters_t::type_name(int type) {
+	switch (type) {
+		case TRAVERSAL_PRIMARY: return "primary";
+		case TRAVERSAL_SHADOW: return "shadow";
+		case TRAVERSAL_PACKET: return "packet";
+		default: return "unknown";
+	}
+}
+
+traversal_count_t::traversal_count_t(traversal_type_t t) : type(t), nodes(0), boxes(0), primitives(0), max_depth(0) {
+	counters = &thread_counters.local();
+	outer = counters->active;
+	if (outer == NULL)
+		counters->active = this;
+}
+
+traversal_count_t::~traversal_count_t() {
+	if (outer != NULL) {
+		outer->nodes += nodes;
+		outer->boxes += boxes;
+		outer->primitives += primitives;
+		outer->depth(max_depth);
+		return;
+	}
+	counters->active = NULL;
+
+	traversal_counters_t &c = *counters;
+	c.rays[type]++;
+	c.nodes[type] += nodes;
+	c.boxes[type] += boxes;
+	c.primitives[type] += primitives;
+	if (max_depth > c.max_depth[type])
+		c.max_depth[type] = max_depth;
+}
+
+traversal_counters_t& local_traversal_counters() {
+	return thread_counters.local();
+}
+
+traversal_counters_t combined_traversal_counters() {
+	traversal_counters_t total;
+	for (thread_counters_t::const_iterator i = thread_counters.begin(); i != thread_counters.end(); ++i) {
+		total.merge(*i);
+	}
+	return total;
+}
+
+void reset_traversal_counters() {
+	for (thread_counters_t::iterator i = thread_counters.begin(); i != thread_counters.end(); ++i) {
+		traversal_count_t *active = i->active;
+		*i = traversal_counters_t();
+		i->active = active;
+	}
+}
@@ -0,0 +1,73 @@
+#ifndef BVH_COUNTERS_HPP
+#define BVH_COUNTERS_HPP
+
+#include <stdint.h>
+
+
+// Closest-hit single rays are the camera rays and occlusion queries are the shadow rays;
+// packets are counted once per packet. A traversal started inside another one, in an instance's
+// or a mesh chunk's own tree or for one lane of a packet, is part of the outer ray and not a ray of its own.
+enum traversal_type_t {
+	TRAVERSAL_PRIMARY,
+	TRAVERSAL_SHADOW,
+	TRAVERSAL_PACKET,
+	TRAVERSAL_TYPE_COUNT
+};
+
+struct traversal_count_t;
+
+struct traversal_counters_t {
+	uint64_t rays[TRAVERSAL_TYPE_COUNT];
+	uint64_t nodes[TRAVERSAL_TYPE_COUNT];       // nodes popped and visited
+	uint64_t boxes[TRAVERSAL_TYPE_COUNT];       // ray-box tests, one per child lane in wide nodes
+	uint64_t primitives[TRAVERSAL_TYPE_COUNT];  // shapes in the visited leaves
+	uint64_t max_depth[TRAVERSAL_TYPE_COUNT];   // deepest traversal stack seen
+	traversal_count_t *active;                  // the outermost traversal in progress on this thread
+
+	traversal_counters_t();
+
+	void merge(const traversal_counters_t &c);
+
+	// nodes plus primitives over every ray type, the unit of the heatmap
+	uint64_t cost() const;
+
+	static const char* type_name(int type);
+
+};
+
+// Counts one traversal on the stack and adds it to the calling thread's counters when it goes out of
+// scope, so a traversal pays for one thread-local lookup and never shares a cache line with another thread.
+// A nested traversal hands its nodes and tests to the outermost one instead, under that one's type.
+struct traversal_count_t {
+	int type;
+	uint32_t nodes;
+	uint32_t boxes;
+	uint32_t primitives;
+	uint32_t max_depth;
+	traversal_counters_t *counters;
+	traversal_count_t *outer;
+
+	traversal_count_t(traversal_type_t t);
+	~traversal_count_t();
+
+	void visit(uint32_t box_num) {
+		nodes++;
+		boxes += box_num;
+	}
+
+	void leaf(uint32_t shape_num) {
+		primitives += shape_num;
+	}
+
+	void depth(uint32_t d) {
+		if (d > max_depth)
+			max_depth = d;
+	}
+
+};
+
+traversal_counters_t& local_traversal_counters();
+traversal_counters_t combined_traversal_counters();
+void reset_traversal_counters();
+
+#endif
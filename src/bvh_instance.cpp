@@ -0,0 +1,63 @@
+#include "bvh.hpp"
+#include "bvh_instance.hpp"
+
+using namespace std;
+using namespace glm;
+
+
+instance_t::instance_t(const bvh_tree_t *tree, const mat4 &m) : object_tree(tree) {
+	set_transform(m);
+}
+
+void instance_t::set_transform(const mat4 &m) {
+	transform = m;
+	inverse_transform = inverse(m);
+	normal_matrix = transpose(mat3(inverse_transform));
+	
+	// world bounds of the eight corners of the object bounds; an empty object stays empty
+	__bbox = bbox_t();
+	if (object_tree->empty())
+		return;
+	const bbox_t &object_bound = object_tree->nodes[0].bounds;
+	for (int i = 0; i < 8; i++) {
+		vec3 corner(object_bound[i & 1].x, object_bound[(i >> 1) & 1].y, object_bound[(i >> 2) & 1].z);
+		__bbox.merge(vec3(transform * vec4(corner, 1.0f)));
+	}
+}
+
+ray_t instance_t::object_ray(const ray_t &ray) const {
+	// the direction is not renormalized, so t is the same in both spaces
+	ray_t r(vec3(inverse_transform * vec4(ray.origin, 1.0f)), mat3(inverse_transform) * ray.direction);
+	r.tmin = ray.tmin;
+	r.tmax = ray.tmax;
+	return r;
+}
+
+vec3 instance_t::normal(const vec3 &p) const {
+	// which shape was hit is only known per intersection, see shading_normal(); without one, the bound's outward direction
+	vec3 d = p - 0.5f * ( __bbox.min_point + __bbox.max_point );
+	float l = length(d);
+	return ( l > 0.0f ) ? d / l : vec3(0.0f, 1.0f, 0.0f);
+}
+
+vec3 instance_t::shading_normal(const vec3 &p, const isect_t &isect) const {
+	assert(isect.object_shape != NULL);
+	vec3 object_p = vec3(inverse_transform * vec4(p, 1.0f));
+	return normalize(normal_matrix * isect.object_shape->normal(object_p));
+}
+
+bool instance_t::intersect(const ray_t &ray, isect_t &isect) const {
+	isect_t object_isect;
+	object_isect.t = isect.t;
+	if (!object_tree->intersect(object_ray(ray), object_isect))
+		return false;
+	
+	isect.t = object_isect.t;
+	isect.shape = this;
+	isect.object_shape = object_isect.shape;
+	return true;
+}
+
+bool instance_t::occluded(const ray_t &ray) const {
+	return object_tree->occluded(object_ray(ray));
+}
@@ -0,0 +1,41 @@
+#ifndef BVH_INSTANCE_HPP
+#define BVH_INSTANCE_HPP
+
+#include <glm/glm.hpp>
+
+#include "shape.hpp"
+
+
+struct bvh_tree_t;
+
+// One placement of a shared bottom-level tree. A top-level bvh_tree_t is built over instances like
+// over any other shapes, so moving an instance only rebuilds that small tree.
+struct instance_t : public shape_t {
+	
+	instance_t(const bvh_tree_t *tree, const glm::mat4 &m);
+	
+	const bbox_t& bound() const {
+		return __bbox;
+	}
+	
+	glm::vec3 normal(const glm::vec3 &p) const;
+	glm::vec3 shading_normal(const glm::vec3 &p, const isect_t &isect) const;
+	
+	bool intersect(const ray_t &ray, isect_t &isect) const;
+	bool occluded(const ray_t &ray) const;
+	
+	void set_transform(const glm::mat4 &m);
+	
+	const bvh_tree_t *object_tree;
+	glm::mat4 transform;          // object to world
+	glm::mat4 inverse_transform;  // world to object
+	glm::mat3 normal_matrix;      // object normals to world, transpose of the inverse
+	
+private:
+	ray_t object_ray(const ray_t &ray) const;
+	
+	bbox_t __bbox;
+	
+};
+
+#endif
@@ -0,0 +1,412 @@
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/blocked_range.h>
+
+#include "bvh.hpp"
+#include "morton.hpp"
+
+using namespace std;
+using namespace glm;
+using namespace tbb;
+
+// Linear BVH (Lauterbach et al.), with the HLBVH variant (Pantaleoni and Luebke) building the top
+// levels with SAH. Primitives are sorted by the Morton code of their centroid; the runs sharing the
+// top MORTON_CLUSTER_BITS form clusters whose subtrees are split on Morton bits in parallel, and a
+// small tree over the clusters joins them. Everything is written straight into the flattened array.
+
+static const int MORTON_AXIS_BITS = 21;            // 63-bit codes
+static const int MORTON_CLUSTER_BITS = 15;
+static const size_t MORTON_MAX_SHAPES_IN_LEAF = 4;
+static const size_t RADIX_BUCKET_COUNT = 256;
+static const size_t RADIX_BLOCK_SIZE = 16384;
+
+
+struct morton_prim_t {
+	uint64_t code;
+	unsigned int index;
+};
+
+struct morton_cluster_t {
+	size_t start;
+	size_t end;
+	size_t base;                            // offset of the cluster's root in the flattened array
+	bbox_t bound;
+	vector<bvh_linear_node_t> nodes;        // the cluster's subtree, offsets relative to its root
+};
+
+inline uint64_t morton_key(const morton_prim_t &prim) {
+	return prim.code;
+}
+
+inline uint64_t morton_key(uint64_t code) {
+	return code;
+}
+
+// x takes the highest bit of each triple, so bit b of a code splits axis 2 - b % 3
+static inline int morton_axis(int bit) {
+	return 2 - bit % 3;
+}
+
+// Items in [start, end) are sorted; returns the first one with the highest differing bit set,
+// or start when every code in the range is the same.
+template <typename T>
+static size_t morton_split(const T *items, size_t start, size_t end, int *bit) {
+	uint64_t first = morton_key(items[start]);
+	uint64_t diff = first ^ morton_key(items[end - 1]);
+	if (diff == 0)
+		return start;
+
+	*bit = 63 - __builtin_clzll(diff);
+	size_t lo = start, hi = end - 1;
+	while (lo + 1 < hi) {
+		size_t mid = (lo + hi) / 2;
+		if ( (morton_key(items[mid]) >> *bit) & 1 ) {
+			hi = mid;
+		} else {
+			lo = mid;
+		}
+	}
+	return hi;
+}
+
+
+struct morton_bound_task_t {
+	const vector<shape_ref_t> *shapes;
+	bbox_t centroid_bound;
+
+	morton_bound_task_t(const vector<shape_ref_t> *s) : shapes(s) { }
+	morton_bound_task_t(morton_bound_task_t &other, split) : shapes(other.shapes) { }
+
+	void operator() (const blocked_range<size_t> &range) {
+		for (size_t i = range.begin(); i < range.end(); i++) {
+			const bbox_t &bound = (*shapes)[i]->bound();
+			centroid_bound.merge(0.5f * ( bound.max_point + bound.min_point ));
+		}
+	}
+
+	void join(const morton_bound_task_t &other) {
+		centroid_bound.merge(other.centroid_bound);
+	}
+
+};
+
+struct morton_code_task_t {
+	const vector<shape_ref_t> *shapes;
+	vec3 min_point;
+	vec3 scale;
+	morton_prim_t *prims;
+
+	morton_code_task_t(const vector<shape_ref_t> *s, const vec3 &m, const vec3 &sc, morton_prim_t *p) : shapes(s), min_point(m), scale(sc), prims(p) { }
+
+	void operator() (const blocked_range<size_t> &range) const {
+		for (size_t i = range.begin(); i < range.end(); i++) {
+			const bbox_t &bound = (*shapes)[i]->bound();
+			vec3 p = ( 0.5f * ( bound.max_point + bound.min_point ) - min_point ) * scale;
+			p = clamp(p, 0.0f, (float)( (1 << MORTON_AXIS_BITS) - 1 ));
+			prims[i].code = morton_3d((uint64_t)p.x, (uint64_t)p.y, (uint64_t)p.z);
+			prims[i].index = i;
+		}
+	}
+
+};
+
+// LSD radix sort, one byte per pass. Each block counts its digits, the counts are scanned digit-major,
+// and each block scatters into its own slots, which keeps every pass stable.
+struct radix_count_task_t {
+	const morton_prim_t *src;
+	size_t n;
+	int shift;
+	size_t *counts;
+
+	radix_count_task_t(const morton_prim_t *s, size_t c, int sh, size_t *cs) : src(s), n(c), shift(sh), counts(cs) { }
+
+	void operator() (const blocked_range<size_t> &range) const {
+		for (size_t b = range.begin(); b < range.end(); b++) {
+			size_t *block_counts = &counts[b * RADIX_BUCKET_COUNT];
+			for (size_t i = b * RADIX_BLOCK_SIZE; i < std::min(n, (b + 1) * RADIX_BLOCK_SIZE); i++)
+				block_counts[(src[i].code >> shift) & 0xff]++;
+		}
+	}
+
+};
+
+struct radix_scatter_task_t {
+	const morton_prim_t *src;
+	morton_prim_t *dst;
+	size_t n;
+	int shift;
+	size_t *offsets;
+
+	radix_scatter_task_t(const morton_prim_t *s, morton_prim_t *d, size_t c, int sh, size_t *o) : src(s), dst(d), n(c), shift(sh), offsets(o) { }
+
+	void operator() (const blocked_range<size_t> &range) const {
+		for (size_t b = range.begin(); b < range.end(); b++) {
+			size_t *block_offsets = &offsets[b * RADIX_BUCKET_COUNT];
+			for (size_t i = b * RADIX_BLOCK_SIZE; i < std::min(n, (b + 1) * RADIX_BLOCK_SIZE); i++)
+				dst[block_offsets[(src[i].code >> shift) & 0xff]++] = src[i];
+		}
+	}
+
+};
+
+static void radix_sort(vector<morton_prim_t> &prims) {
+	size_t n = prims.size();
+	size_t block_num = (n + RADIX_BLOCK_SIZE - 1) / RADIX_BLOCK_SIZE;
+	vector<morton_prim_t> buffer(n);
+	vector<size_t> counts(block_num * RADIX_BUCKET_COUNT);
+
+	morton_prim_t *src = &prims[0], *dst = &buffer[0];
+	for (int shift = 0; shift < 64; shift += 8) {
+		fill(counts.begin(), counts.end(), 0);
+		parallel_for(blocked_range<size_t>(0, block_num), radix_count_task_t(src, n, shift, &counts[0]));
+
+		size_t sum = 0;
+		bool uniform = false;
+		for (size_t d = 0; d < RADIX_BUCKET_COUNT; d++) {
+			size_t digit_sum = sum;
+			for (size_t b = 0; b < block_num; b++) {
+				size_t c = counts[b * RADIX_BUCKET_COUNT + d];
+				counts[b * RADIX_BUCKET_COUNT + d] = sum;
+				sum += c;
+			}
+			uniform = uniform || ( sum - digit_sum == n );
+		}
+		// every code has the same byte here, the pass would not move anything
+		if (uniform)
+			continue;
+
+		parallel_for(blocked_range<size_t>(0, block_num), radix_scatter_task_t(src, dst, n, shift, &counts[0]));
+		std::swap(src, dst);
+	}
+
+	if (src != &prims[0])
+		prims.swap(buffer);
+}
+
+struct morton_reorder_task_t {
+	const morton_prim_t *prims;
+	const vector<shape_ref_t> *shapes;
+	vector<shape_ref_t> *ordered_shapes;
+	unsigned int *shape_indices;
+
+	morton_reorder_task_t(const morton_prim_t *p, const vector<shape_ref_t> *s, vector<shape_ref_t> *o, unsigned int *si) :
+		prims(p), shapes(s), ordered_shapes(o), shape_indices(si) { }
+
+	void operator() (const blocked_range<size_t> &range) const {
+		for (size_t i = range.begin(); i < range.end(); i++) {
+			(*ordered_shapes)[i] = (*shapes)[prims[i].index];
+			shape_indices[i] = prims[i].index;
+		}
+	}
+
+};
+
+// Emits the subtree over sorted shapes [start, end) in depth-first order and returns its root offset.
+static size_t emit_morton_subtree(const vector<shape_ref_t> &shapes, const morton_prim_t *prims, size_t start, size_t end, vector<bvh_linear_node_t> &nodes) {
+	size_t offset = nodes.size();
+	nodes.push_back(bvh_linear_node_t());
+	size_t shape_num = end - start;
+
+	if (shape_num <= MORTON_MAX_SHAPES_IN_LEAF) {
+		bbox_t bound;
+		for (size_t i = start; i < end; i++)
+			bound.merge(shapes[i]->bound());
+
+		bvh_linear_node_t &node = nodes[offset];
+		node.bounds = bound;
+		node.shape_offset = start;
+		node.shape_num = shape_num;
+		node.axis = 0;
+		return offset;
+	}
+
+	// shapes with equal codes are halved, so leaves stay small on duplicated centroids
+	int bit = 0;
+	size_t mid = morton_split(prims, start, end, &bit);
+	int axis = morton_axis(bit);
+	if (mid == start) {
+		mid = start + shape_num / 2;
+		axis = 0;
+	}
+
+	emit_morton_subtree(shapes, prims, start, mid, nodes);
+	size_t second = emit_morton_subtree(shapes, prims, mid, end, nodes);
+
+	bvh_linear_node_t &node = nodes[offset];
+	node.bounds = nodes[offset + 1].bounds;
+	node.bounds.merge(nodes[second].bounds);
+	node.second_child_offset = second;
+	node.shape_num = 0;
+	node.axis = axis;
+	return offset;
+}
+
+struct morton_cluster_task_t {
+	const vector<shape_ref_t> *shapes;
+	const morton_prim_t *prims;
+	vector<morton_cluster_t> *clusters;
+
+	morton_cluster_task_t(const vector<shape_ref_t> *s, const morton_prim_t *p, vector<morton_cluster_t> *c) : shapes(s), prims(p), clusters(c) { }
+
+	void operator() (const blocked_range<size_t> &range) const {
+		for (size_t c = range.begin(); c < range.end(); c++) {
+			morton_cluster_t &cluster = (*clusters)[c];
+			cluster.nodes.reserve(2 * ( cluster.end - cluster.start ) / MORTON_MAX_SHAPES_IN_LEAF + 1);
+			emit_morton_subtree(*shapes, prims, cluster.start, cluster.end, cluster.nodes);
+			cluster.bound = cluster.nodes[0].bounds;
+		}
+	}
+
+};
+
+struct morton_copy_task_t {
+	const vector<morton_cluster_t> *clusters;
+	bvh_linear_node_t *nodes;
+
+	morton_copy_task_t(const vector<morton_cluster_t> *c, bvh_linear_node_t *n) : clusters(c), nodes(n) { }
+
+	void operator() (const blocked_range<size_t> &range) const {
+		for (size_t c = range.begin(); c < range.end(); c++) {
+			const morton_cluster_t &cluster = (*clusters)[c];
+			for (size_t k = 0; k < cluster.nodes.size(); k++) {
+				bvh_linear_node_t node = cluster.nodes[k];
+				if (!node.is_leaf())
+					node.second_child_offset += cluster.base;
+				nodes[cluster.base + k] = node;
+			}
+		}
+	}
+
+};
+
+// The tree over the clusters: each leaf is one cluster, whose subtree is placed at that offset later.
+struct morton_top_builder_t {
+	const bvh_tree_t *tree;
+	vector<morton_cluster_t> *clusters;
+	vector<bvh_node_info_t> cluster_info;   // shape_index is the cluster
+	vector<uint64_t> cluster_codes;         // per cluster_info entry, for the Morton split
+	bvh_linear_node_t *nodes;
+
+	bbox_t emit(size_t start, size_t end, size_t *offset) {
+		if (end - start == 1) {
+			morton_cluster_t &cluster = (*clusters)[cluster_info[start].shape_index];
+			cluster.base = *offset;
+			*offset += cluster.nodes.size();
+			return cluster.bound;
+		}
+
+		size_t mid = start;
+		int axis = 0;
+		if (tree->split_method == BVH_SPLIT_HLBVH) {
+			bbox_t bound, centroid_bound;
+			for (size_t i = start; i < end; i++) {
+				bound.merge(cluster_info[i].bound);
+				centroid_bound.merge(cluster_info[i].centroid);
+			}
+			axis = centroid_bound.maximum_extent();
+			if (centroid_bound.max_point[axis] > centroid_bound.min_point[axis])
+				mid = tree->sah_partition(cluster_info, start, end, bound, centroid_bound, axis);
+		} else {
+			int bit = 0;
+			mid = morton_split(&cluster_codes[0], start, end, &bit);
+			axis = morton_axis(bit);
+		}
+		// every cluster gets a leaf of its own, even where SAH would rather not split
+		if (mid == start || mid == end)
+			mid = start + (end - start) / 2;
+
+		size_t node_offset = (*offset)++;
+		bbox_t bound = emit(start, mid, offset);
+		nodes[node_offset].second_child_offset = *offset;
+		bound.merge(emit(mid, end, offset));
+
+		nodes[node_offset].bounds = bound;
+		nodes[node_offset].shape_num = 0;
+		nodes[node_offset].axis = axis;
+		return bound;
+	}
+
+};
+
+
+void bvh_tree_t::build_morton() {
+	size_t n = shapes.size();
+	if (n == 0) {
+		// no clusters and no top tree; flatten() leaves the tree empty, as it does for the other builders
+		shape_indices.clear();
+		total_node_count = 0;
+		build_scratch_bytes = 0;
+		root = NULL;
+		return;
+	}
+
+	morton_bound_task_t bound_task(&shapes);
+	parallel_reduce(blocked_range<size_t>(0, n), bound_task);
+	const bbox_t &centroid_bound = bound_task.centroid_bound;
+	vec3 extent = centroid_bound.max_point - centroid_bound.min_point;
+	float steps = (float)(1 << MORTON_AXIS_BITS);
+	vec3 scale(
+		(extent.x > 0.0f) ? steps / extent.x : 0.0f,
+		(extent.y > 0.0f) ? steps / extent.y : 0.0f,
+		(extent.z > 0.0f) ? steps / extent.z : 0.0f);
+
+	vector<morton_prim_t> prims(n);
+	parallel_for(blocked_range<size_t>(0, n), morton_code_task_t(&shapes, centroid_bound.min_point, scale, &prims[0]));
+	radix_sort(prims);
+
+	// a rebuild starts from the previous leaf order; keep shape_indices relative to the input
+	vector<unsigned int> input_order;
+	input_order.swap(shape_indices);
+	shape_indices.resize(n);
+	vector<shape_ref_t> ordered_shapes(n);
+	parallel_for(blocked_range<size_t>(0, n), morton_reorder_task_t(&prims[0], &shapes, &ordered_shapes, &shape_indices[0]));
+	shapes.swap(ordered_shapes);
+	if (!input_order.empty()) {
+		for (size_t i = 0; i < n; i++) {
+			shape_indices[i] = input_order[shape_indices[i]];
+		}
+	}
+
+	int cluster_shift = 3 * MORTON_AXIS_BITS - MORTON_CLUSTER_BITS;
+	vector<morton_cluster_t> clusters;
+	for (size_t start = 0; start < n; ) {
+		size_t end = start + 1;
+		while (end < n && ( prims[end].code >> cluster_shift ) == ( prims[start].code >> cluster_shift ))
+			end++;
+		clusters.push_back(morton_cluster_t());
+		clusters.back().start = start;
+		clusters.back().end = end;
+		start = end;
+	}
+	parallel_for(blocked_range<size_t>(0, clusters.size()), morton_cluster_task_t(&shapes, &prims[0], &clusters));
+
+	// every cluster root is a leaf of the top tree, which adds one branch less than there are clusters
+	total_node_count = clusters.size() - 1;
+	for (size_t c = 0; c < clusters.size(); c++)
+		total_node_count += clusters[c].nodes.size();
+	nodes = new bvh_linear_node_t[total_node_count];
+	nodes_owned = true;
+	root = NULL;
+
+	morton_top_builder_t top;
+	top.tree = this;
+	top.clusters = &clusters;
+	top.nodes = nodes;
+	top.cluster_info.reserve(clusters.size());
+	top.cluster_codes.reserve(clusters.size());
+	for (size_t c = 0; c < clusters.size(); c++) {
+		top.cluster_info.push_back(bvh_node_info_t(c, clusters[c].bound));
+		top.cluster_codes.push_back(prims[clusters[c].start].code >> cluster_shift);
+	}
+	size_t offset = 0;
+	top.emit(0, clusters.size(), &offset);
+	assert(offset == total_node_count);
+
+	parallel_for(blocked_range<size_t>(0, clusters.size()), morton_copy_task_t(&clusters, nodes));
+
+	// the primitives and radix_sort()'s buffer of them, the input order, the cluster subtrees and the top builder's node info
+	build_scratch_bytes = 2 * prims.capacity() * sizeof(morton_prim_t) + ordered_shapes.capacity() * sizeof(shape_ref_t)
+		+ clusters.capacity() * sizeof(morton_cluster_t) + top.cluster_info.capacity() * sizeof(bvh_node_info_t) + top.cluster_codes.capacity() * sizeof(uint64_t);
+	for (size_t c = 0; c < clusters.size(); c++)
+		build_scratch_bytes += clusters[c].nodes.capacity() * sizeof(bvh_linear_node_t);
+}
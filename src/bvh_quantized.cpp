@@ -0,0 +1,304 @@
+#include <cstring>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "bvh.hpp"
+#include "bvh_quantized.hpp"
+
+using namespace std;
+using namespace glm;
+
+
+static const int QUANTIZED_STEPS = 255;
+
+// 2^e built from its bits, e in the normal range
+static inline float exp2i(int e) {
+	uint32_t bits = (uint32_t)(e + 127) << 23;
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+// q * scale is exact for a power of two scale, so the one rounding is the add and
+// the builder and the traversal decode a bound to the same float
+static inline float decode(float origin, unsigned char q, float scale) {
+	return origin + q * scale;
+}
+
+#if defined(__SSE2__)
+// the four 8-bit steps widened to floats and decoded like decode() above
+static inline __m128 decode4(float origin, const unsigned char *q, int exponent) {
+	int bytes;
+	memcpy(&bytes, q, sizeof(bytes));
+	__m128i zero = _mm_setzero_si128();
+	__m128i q32 = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero);
+	return _mm_add_ps(_mm_set1_ps(origin), _mm_mul_ps(_mm_cvtepi32_ps(q32), _mm_set1_ps(exp2i(exponent))));
+}
+#endif
+
+bvh_quantized_node_t::bvh_quantized_node_t() : child_num(0) {
+	for (int k = 0; k < 3; k++) {
+		origin[k] = 0.0f;
+		exponent[k] = 0;
+	}
+	for (int i = 0; i < N; i++) {
+		lo_x[i] = lo_y[i] = lo_z[i] = 0;
+		hi_x[i] = hi_y[i] = hi_z[i] = 0;
+		offset[i] = 0;
+		shape_num[i] = 0;
+	}
+}
+
+void bvh_quantized_node_t::set_frame(const bbox_t &b) {
+	for (int k = 0; k < 3; k++) {
+		origin[k] = b.min_point[k];
+
+		// the smallest power of two step whose 255 steps reach the far side of the box
+		float extent = b.max_point[k] - b.min_point[k];
+		int e = -126;
+		if (extent > 0.0f) {
+			frexpf(extent / QUANTIZED_STEPS, &e);
+			e = std::max(e - 1, -126);
+		}
+		while (decode(origin[k], QUANTIZED_STEPS, exp2i(e)) < b.max_point[k])
+			e++;
+		exponent[k] = (signed char)e;
+	}
+}
+
+void bvh_quantized_node_t::set_bounds(int i, const bbox_t &b) {
+	unsigned char *lo[3] = { lo_x, lo_y, lo_z };
+	unsigned char *hi[3] = { hi_x, hi_y, hi_z };
+	for (int k = 0; k < 3; k++) {
+		float scale = exp2i(exponent[k]);
+		float l = floorf( (b.min_point[k] - origin[k]) / scale );
+		float h = ceilf( (b.max_point[k] - origin[k]) / scale );
+		int ql = (int)glm::clamp(l, 0.0f, (float)QUANTIZED_STEPS);
+		int qh = (int)glm::clamp(h, 0.0f, (float)QUANTIZED_STEPS);
+
+		// the division rounds; step outward until the decoded box really contains the child
+		while (ql > 0 && decode(origin[k], ql, scale) > b.min_point[k])
+			ql--;
+		while (qh < QUANTIZED_STEPS && decode(origin[k], qh, scale) < b.max_point[k])
+			qh++;
+		lo[k][i] = (unsigned char)ql;
+		hi[k][i] = (unsigned char)qh;
+	}
+}
+
+bvh_quantized_tree_t::bvh_quantized_tree_t(const bvh_tree_t *t) : tree(t) { }
+
+void bvh_quantized_tree_t::quantize() {
+	nodes.clear();
+	if (tree->total_node_count == 0)
+		return;
+	nodes.reserve(tree->total_node_count / 2 + 1);
+
+	const bvh_linear_node_t &root = tree->nodes[0];
+	if (root.is_leaf()) {
+		split_leaf(root.bounds, root.shape_offset, root.shape_num);
+	} else {
+		recursive_quantize(0);
+	}
+}
+
+size_t bvh_quantized_tree_t::recursive_quantize(size_t binary_offset) {
+	const int N = bvh_quantized_node_t::N;
+	size_t quantized_offset = nodes.size();
+	nodes.push_back(bvh_quantized_node_t());
+
+	// the same collapse as bvh_wide_tree_t: open the largest inner child until there are N
+	size_t children[N];
+	int child_num = 2;
+	children[0] = binary_offset + 1;
+	children[1] = tree->nodes[binary_offset].second_child_offset;
+	while (child_num < N) {
+		int largest = -1;
+		float largest_area = -INFINITY;
+		for (int i = 0; i < child_num; i++) {
+			const bvh_linear_node_t &child = tree->nodes[children[i]];
+			if (!child.is_leaf() && child.bounds.surface_area() > largest_area) {
+				largest = i;
+				largest_area = child.bounds.surface_area();
+			}
+		}
+		if (largest < 0)
+			break;
+
+		size_t opened = children[largest];
+		children[largest] = opened + 1;
+		children[child_num++] = tree->nodes[opened].second_child_offset;
+	}
+
+	bvh_quantized_node_t node;
+	node.set_frame(tree->nodes[binary_offset].bounds);
+	node.child_num = child_num;
+	for (int i = 0; i < child_num; i++) {
+		const bvh_linear_node_t &child = tree->nodes[children[i]];
+		node.set_bounds(i, child.bounds);
+		if (child.is_leaf() && child.shape_num <= QUANTIZED_STEPS) {
+			node.offset[i] = child.shape_offset;
+			node.shape_num[i] = child.shape_num;
+		} else if (child.is_leaf()) {
+			node.offset[i] = split_leaf(child.bounds, child.shape_offset, child.shape_num);
+			node.shape_num[i] = 0;
+		} else {
+			node.offset[i] = recursive_quantize(children[i]);
+			node.shape_num[i] = 0;
+		}
+	}
+	nodes[quantized_offset] = node;
+
+	return quantized_offset;
+}
+
+size_t bvh_quantized_tree_t::split_leaf(const bbox_t &bounds, size_t shape_offset, size_t shape_num) {
+	// a leaf holds at most 255 shapes; a bigger one is spread over the children of a node with the leaf's box
+	const int N = bvh_quantized_node_t::N;
+	size_t quantized_offset = nodes.size();
+	nodes.push_back(bvh_quantized_node_t());
+
+	bvh_quantized_node_t node;
+	node.set_frame(bounds);
+	size_t per_child = (shape_num + N - 1) / N;
+	for (int i = 0; i < N && i * per_child < shape_num; i++) {
+		size_t offset = shape_offset + i * per_child;
+		size_t n = std::min(per_child, shape_num - i * per_child);
+		node.set_bounds(i, bounds);
+		if (n <= (size_t)QUANTIZED_STEPS) {
+			node.offset[i] = offset;
+			node.shape_num[i] = n;
+		} else {
+			node.offset[i] = split_leaf(bounds, offset, n);
+			node.shape_num[i] = 0;
+		}
+		node.child_num = i + 1;
+	}
+	nodes[quantized_offset] = node;
+
+	return quantized_offset;
+}
+
+struct bvh_quantized_entry_t {
+	unsigned int offset;
+	unsigned int shape_num;
+	float tnear;
+};
+
+template <bool ANY_HIT>
+static bool quantized_traverse(const bvh_quantized_tree_t &quantized_tree, const ray_t &ray, isect_t &isect) {
+	typedef bvh_quantized_node_t node_t;
+	const int N = node_t::N;
+	const bvh_tree_t *tree = quantized_tree.tree;
+
+	vec3 inv_direction = 1.0f / ray.direction;
+	bool neg_x = inv_direction.x < 0.0f;
+	bool neg_y = inv_direction.y < 0.0f;
+	bool neg_z = inv_direction.z < 0.0f;
+
+	#if defined(__SSE2__)
+	__m128 ox = _mm_set1_ps(ray.origin.x), inv_dx = _mm_set1_ps(inv_direction.x);
+	__m128 oy = _mm_set1_ps(ray.origin.y), inv_dy = _mm_set1_ps(inv_direction.y);
+	__m128 oz = _mm_set1_ps(ray.origin.z), inv_dz = _mm_set1_ps(inv_direction.z);
+	__m128 tmin = _mm_set1_ps(ray.tmin);
+	#endif
+
+	if (ANY_HIT)
+		isect.t = ray.tmax;
+
+	traversal_count_t count(ANY_HIT ? TRAVERSAL_SHADOW : TRAVERSAL_PRIMARY);
+	bool hit = false;
+	size_t todo_offset = 0;
+	bvh_quantized_entry_t todo[64 * N];
+	todo[todo_offset].offset = 0;
+	todo[todo_offset].shape_num = 0;
+	todo[todo_offset++].tnear = ray.tmin;
+
+	while (todo_offset > 0) {
+		bvh_quantized_entry_t entry = todo[--todo_offset];
+		if (entry.tnear > isect.t)
+			continue;
+
+		if (entry.shape_num > 0) {
+			count.leaf(entry.shape_num);
+			if (ANY_HIT) {
+				if (tree->occluded_shapes(ray, entry.offset, entry.shape_num))
+					return true;
+			} else if (tree->intersect_shapes(ray, entry.offset, entry.shape_num, isect)) {
+				hit = true;
+			}
+			continue;
+		}
+
+		const node_t &node = quantized_tree.nodes[entry.offset];
+		count.visit(node.child_num);
+		float tmax = std::min(isect.t, ray.tmax);
+
+		// decode the child boxes in registers, straight into the slab test
+		float tnear[N] __attribute__((aligned(16)));
+		unsigned int mask = 0;
+		#if defined(__SSE2__)
+		__m128 lo_x = decode4(node.origin[0], node.lo_x, node.exponent[0]), hi_x = decode4(node.origin[0], node.hi_x, node.exponent[0]);
+		__m128 lo_y = decode4(node.origin[1], node.lo_y, node.exponent[1]), hi_y = decode4(node.origin[1], node.hi_y, node.exponent[1]);
+		__m128 lo_z = decode4(node.origin[2], node.lo_z, node.exponent[2]), hi_z = decode4(node.origin[2], node.hi_z, node.exponent[2]);
+
+		__m128 t0 = _mm_max_ps(
+			_mm_max_ps(_mm_mul_ps(_mm_sub_ps(neg_x ? hi_x : lo_x, ox), inv_dx), _mm_mul_ps(_mm_sub_ps(neg_y ? hi_y : lo_y, oy), inv_dy)),
+			_mm_max_ps(_mm_mul_ps(_mm_sub_ps(neg_z ? hi_z : lo_z, oz), inv_dz), tmin));
+		__m128 t1 = _mm_min_ps(
+			_mm_min_ps(_mm_mul_ps(_mm_sub_ps(neg_x ? lo_x : hi_x, ox), inv_dx), _mm_mul_ps(_mm_sub_ps(neg_y ? lo_y : hi_y, oy), inv_dy)),
+			_mm_min_ps(_mm_mul_ps(_mm_sub_ps(neg_z ? lo_z : hi_z, oz), inv_dz), _mm_set1_ps(tmax)));
+
+		_mm_store_ps(tnear, t0);
+		mask = _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+		#else
+		float sx = exp2i(node.exponent[0]), sy = exp2i(node.exponent[1]), sz = exp2i(node.exponent[2]);
+		for (int i = 0; i < N; i++) {
+			float lo_x = decode(node.origin[0], node.lo_x[i], sx), hi_x = decode(node.origin[0], node.hi_x[i], sx);
+			float lo_y = decode(node.origin[1], node.lo_y[i], sy), hi_y = decode(node.origin[1], node.hi_y[i], sy);
+			float lo_z = decode(node.origin[2], node.lo_z[i], sz), hi_z = decode(node.origin[2], node.hi_z[i], sz);
+
+			float t0 = std::max(
+				std::max(( (neg_x ? hi_x : lo_x) - ray.origin.x ) * inv_direction.x, ( (neg_y ? hi_y : lo_y) - ray.origin.y ) * inv_direction.y),
+				std::max(( (neg_z ? hi_z : lo_z) - ray.origin.z ) * inv_direction.z, ray.tmin));
+			float t1 = std::min(
+				std::min(( (neg_x ? lo_x : hi_x) - ray.origin.x ) * inv_direction.x, ( (neg_y ? lo_y : hi_y) - ray.origin.y ) * inv_direction.y),
+				std::min(( (neg_z ? lo_z : hi_z) - ray.origin.z ) * inv_direction.z, tmax));
+
+			tnear[i] = t0;
+			mask |= (unsigned int)(t0 <= t1) << i;
+		}
+		#endif
+		mask &= (1u << node.child_num) - 1;
+
+		// push hit children far to near, so the nearest one is popped first
+		int order[N];
+		int hit_num = 0;
+		for (int i = 0; i < node.child_num; i++) {
+			if ( (mask & (1u << i)) == 0 )
+				continue;
+			int k = hit_num++;
+			for (; k > 0 && tnear[order[k - 1]] < tnear[i]; k--)
+				order[k] = order[k - 1];
+			order[k] = i;
+		}
+		for (int k = 0; k < hit_num; k++) {
+			todo[todo_offset].offset = node.offset[order[k]];
+			todo[todo_offset].shape_num = node.shape_num[order[k]];
+			todo[todo_offset++].tnear = tnear[order[k]];
+		}
+		count.depth(todo_offset);
+	}
+
+	return hit;
+}
+
+bool bvh_quantized_tree_t::intersect(const ray_t &ray, isect_t &isect) const {
+	return quantized_traverse<false>(*this, ray, isect);
+}
+
+bool bvh_quantized_tree_t::occluded(const ray_t &ray) const {
+	isect_t isect;
+	return quantized_traverse<true>(*this, ray, isect);
+}
@@ -0,0 +1,62 @@
+#ifndef BVH_QUANTIZED_HPP
+#define BVH_QUANTIZED_HPP
+
+#include <vector>
+#include <tbb/cache_aligned_allocator.h>
+
+#include "shape.hpp"
+
+
+struct bvh_tree_t;
+
+// 4-ary node in one 64-byte line. Child bounds are 8-bit steps of 2^exponent from origin, the minimum
+// corner of the node's own box, rounded outward so a decoded child box always contains the real one.
+struct bvh_quantized_node_t {
+	static const int N = 4;
+
+	float origin[3] __attribute__((aligned(64)));
+	signed char exponent[3];
+	unsigned char child_num;
+
+	unsigned char lo_x[N];
+	unsigned char hi_x[N];
+	unsigned char lo_y[N];
+	unsigned char hi_y[N];
+	unsigned char lo_z[N];
+	unsigned char hi_z[N];
+
+	unsigned int offset[N];        // child node offset, or first shape offset for a leaf child
+	unsigned char shape_num[N];    // > 0 for a leaf child
+
+	bvh_quantized_node_t();
+
+	void set_frame(const bbox_t &b);
+	void set_bounds(int i, const bbox_t &b);
+
+};
+
+// one node per cache line; the array size goes negative, and compiling fails, if the node is not 64 bytes
+typedef char bvh_quantized_node_size_check_t[( sizeof(bvh_quantized_node_t) == 64 ) ? 1 : -1];
+
+struct bvh_quantized_tree_t {
+	typedef std::vector< bvh_quantized_node_t, tbb::cache_aligned_allocator<bvh_quantized_node_t> > node_list_t;
+
+	const bvh_tree_t *tree;
+	node_list_t nodes;
+
+	bvh_quantized_tree_t(const bvh_tree_t *t);
+
+	void quantize();
+	size_t recursive_quantize(size_t binary_offset);
+	size_t split_leaf(const bbox_t &bounds, size_t shape_offset, size_t shape_num);
+
+	bool intersect(const ray_t &ray, isect_t &isect) const;
+	bool occluded(const ray_t &ray) const;
+
+	size_t memory_size() const {
+		return nodes.size() * sizeof(bvh_quantized_node_t);
+	}
+
+};
+
+#endif
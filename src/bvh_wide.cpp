@@ -0,0 +1,209 @@
+#include "bvh.hpp"
+#include "bvh_wide.hpp"
+
+using namespace std;
+using namespace glm;
+
+
+template <int N>
+bvh_wide_node_t<N>::bvh_wide_node_t() : child_num(0) {
+	// empty lanes get inverted boxes, which the near/far plane test below never hits
+	for (int i = 0; i < lanes; i++) {
+		min_x[i] = min_y[i] = min_z[i] = INFINITY;
+		max_x[i] = max_y[i] = max_z[i] = -INFINITY;
+	}
+	for (int i = 0; i < N; i++) {
+		offset[i] = 0;
+		shape_num[i] = 0;
+	}
+}
+
+template <int N>
+void bvh_wide_node_t<N>::set_bounds(int i, const bbox_t &b) {
+	min_x[i] = b.min_point.x;
+	min_y[i] = b.min_point.y;
+	min_z[i] = b.min_point.z;
+	max_x[i] = b.max_point.x;
+	max_y[i] = b.max_point.y;
+	max_z[i] = b.max_point.z;
+}
+
+template <int N>
+bvh_wide_tree_t<N>::bvh_wide_tree_t(const bvh_tree_t *t) : tree(t) { }
+
+template <int N>
+void bvh_wide_tree_t<N>::collapse() {
+	nodes.clear();
+	if (tree->total_node_count == 0)
+		return;
+	nodes.reserve(tree->total_node_count / (N / 2) + 1);
+
+	const bvh_linear_node_t &root = tree->nodes[0];
+	if (root.is_leaf()) {
+		bvh_wide_node_t<N> node;
+		node.set_bounds(0, root.bounds);
+		node.offset[0] = root.shape_offset;
+		node.shape_num[0] = root.shape_num;
+		node.child_num = 1;
+		nodes.push_back(node);
+	} else {
+		recursive_collapse(0);
+	}
+}
+
+template <int N>
+size_t bvh_wide_tree_t<N>::recursive_collapse(size_t binary_offset) {
+	size_t wide_offset = nodes.size();
+	nodes.push_back(bvh_wide_node_t<N>());
+
+	// pull grandchildren up into this node, always opening the largest inner child first
+	size_t children[N];
+	int child_num = 2;
+	children[0] = binary_offset + 1;
+	children[1] = tree->nodes[binary_offset].second_child_offset;
+	while (child_num < N) {
+		int largest = -1;
+		float largest_area = -INFINITY;
+		for (int i = 0; i < child_num; i++) {
+			const bvh_linear_node_t &child = tree->nodes[children[i]];
+			if (!child.is_leaf() && child.bounds.surface_area() > largest_area) {
+				largest = i;
+				largest_area = child.bounds.surface_area();
+			}
+		}
+		if (largest < 0)
+			break;
+
+		size_t opened = children[largest];
+		children[largest] = opened + 1;
+		children[child_num++] = tree->nodes[opened].second_child_offset;
+	}
+
+	bvh_wide_node_t<N> node;
+	node.child_num = child_num;
+	for (int i = 0; i < child_num; i++) {
+		const bvh_linear_node_t &child = tree->nodes[children[i]];
+		node.set_bounds(i, child.bounds);
+		if (child.is_leaf()) {
+			node.offset[i] = child.shape_offset;
+			node.shape_num[i] = child.shape_num;
+		} else {
+			node.offset[i] = recursive_collapse(children[i]);
+			node.shape_num[i] = 0;
+		}
+	}
+	nodes[wide_offset] = node;
+
+	return wide_offset;
+}
+
+struct bvh_wide_entry_t {
+	unsigned int offset;
+	unsigned int shape_num;
+	float tnear;
+};
+
+template <int N, bool ANY_HIT>
+static bool wide_traverse(const bvh_wide_tree_t<N> &wide_tree, const ray_t &ray, isect_t &isect) {
+	typedef bvh_wide_node_t<N> node_t;
+	const bvh_tree_t *tree = wide_tree.tree;
+
+	vec3 inv_direction = 1.0f / ray.direction;
+	bool neg_x = inv_direction.x < 0.0f;
+	bool neg_y = inv_direction.y < 0.0f;
+	bool neg_z = inv_direction.z < 0.0f;
+
+	simd_float_t ox = simd_set1(ray.origin.x), inv_dx = simd_set1(inv_direction.x);
+	simd_float_t oy = simd_set1(ray.origin.y), inv_dy = simd_set1(inv_direction.y);
+	simd_float_t oz = simd_set1(ray.origin.z), inv_dz = simd_set1(inv_direction.z);
+	simd_float_t tmin = simd_set1(ray.tmin);
+
+	if (ANY_HIT)
+		isect.t = ray.tmax;
+
+	traversal_count_t count(ANY_HIT ? TRAVERSAL_SHADOW : TRAVERSAL_PRIMARY);
+	bool hit = false;
+	size_t todo_offset = 0;
+	bvh_wide_entry_t todo[64 * N];
+	todo[todo_offset].offset = 0;
+	todo[todo_offset].shape_num = 0;
+	todo[todo_offset++].tnear = ray.tmin;
+
+	while (todo_offset > 0) {
+		bvh_wide_entry_t entry = todo[--todo_offset];
+		if (entry.tnear > isect.t)
+			continue;
+
+		if (entry.shape_num > 0) {
+			count.leaf(entry.shape_num);
+			if (ANY_HIT) {
+				if (tree->occluded_shapes(ray, entry.offset, entry.shape_num))
+					return true;
+			} else if (tree->intersect_shapes(ray, entry.offset, entry.shape_num, isect)) {
+				hit = true;
+			}
+			continue;
+		}
+
+		const node_t &node = wide_tree.nodes[entry.offset];
+		count.visit(node.child_num);
+		simd_float_t tmax = simd_set1(std::min(isect.t, ray.tmax));
+
+		float tnear[node_t::lanes] __attribute__((aligned(32)));
+		unsigned int mask = 0;
+		for (int c = 0; c < node_t::lanes; c += SIMD_WIDTH) {
+			simd_float_t near_x = simd_load(neg_x ? &node.max_x[c] : &node.min_x[c]);
+			simd_float_t far_x = simd_load(neg_x ? &node.min_x[c] : &node.max_x[c]);
+			simd_float_t near_y = simd_load(neg_y ? &node.max_y[c] : &node.min_y[c]);
+			simd_float_t far_y = simd_load(neg_y ? &node.min_y[c] : &node.max_y[c]);
+			simd_float_t near_z = simd_load(neg_z ? &node.max_z[c] : &node.min_z[c]);
+			simd_float_t far_z = simd_load(neg_z ? &node.min_z[c] : &node.max_z[c]);
+
+			simd_float_t t0 = simd_max(
+				simd_max(simd_mul(simd_sub(near_x, ox), inv_dx), simd_mul(simd_sub(near_y, oy), inv_dy)),
+				simd_max(simd_mul(simd_sub(near_z, oz), inv_dz), tmin));
+			simd_float_t t1 = simd_min(
+				simd_min(simd_mul(simd_sub(far_x, ox), inv_dx), simd_mul(simd_sub(far_y, oy), inv_dy)),
+				simd_min(simd_mul(simd_sub(far_z, oz), inv_dz), tmax));
+
+			simd_store(&tnear[c], t0);
+			mask |= simd_movemask(simd_le(t0, t1)) << c;
+		}
+
+		// push hit children far to near, so the nearest one is popped first
+		int order[N];
+		int hit_num = 0;
+		for (int i = 0; i < node.child_num; i++) {
+			if ( (mask & (1u << i)) == 0 )
+				continue;
+			int k = hit_num++;
+			for (; k > 0 && tnear[order[k - 1]] < tnear[i]; k--)
+				order[k] = order[k - 1];
+			order[k] = i;
+		}
+		for (int k = 0; k < hit_num; k++) {
+			todo[todo_offset].offset = node.offset[order[k]];
+			todo[todo_offset].shape_num = node.shape_num[order[k]];
+			todo[todo_offset++].tnear = tnear[order[k]];
+		}
+		count.depth(todo_offset);
+	}
+
+	return hit;
+}
+
+template <int N>
+bool bvh_wide_tree_t<N>::intersect(const ray_t &ray, isect_t &isect) const {
+	return wide_traverse<N, false>(*this, ray, isect);
+}
+
+template <int N>
+bool bvh_wide_tree_t<N>::occluded(const ray_t &ray) const {
+	isect_t isect;
+	return wide_traverse<N, true>(*this, ray, isect);
+}
+
+template struct bvh_wide_node_t<4>;
+template struct bvh_wide_node_t<8>;
+template struct bvh_wide_tree_t<4>;
+template struct bvh_wide_tree_t<8>;
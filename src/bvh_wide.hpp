@@ -0,0 +1,56 @@
+#ifndef BVH_WIDE_HPP
+#define BVH_WIDE_HPP
+
+#include <vector>
+#include <tbb/cache_aligned_allocator.h>
+
+#include "ray_packet.hpp"
+#include "shape.hpp"
+
+
+struct bvh_tree_t;
+
+// N-ary node; child bounds are stored per axis so one SIMD op tests a ray against several children
+template <int N>
+struct bvh_wide_node_t {
+	static const int lanes = (N < SIMD_WIDTH) ? SIMD_WIDTH : N;
+
+	float min_x[lanes] __attribute__((aligned(32)));
+	float max_x[lanes];
+	float min_y[lanes];
+	float max_y[lanes];
+	float min_z[lanes];
+	float max_z[lanes];
+
+	unsigned int offset[N];     // child node offset, or first shape offset for a leaf child
+	unsigned int shape_num[N];  // > 0 for a leaf child
+	int child_num;
+
+	bvh_wide_node_t();
+
+	void set_bounds(int i, const bbox_t &b);
+
+};
+
+template <int N>
+struct bvh_wide_tree_t {
+	typedef std::vector< bvh_wide_node_t<N>, tbb::cache_aligned_allocator< bvh_wide_node_t<N> > > node_list_t;
+
+	const bvh_tree_t *tree;
+	node_list_t nodes;
+
+	bvh_wide_tree_t(const bvh_tree_t *t);
+
+	void collapse();
+	size_t recursive_collapse(size_t binary_offset);
+
+	bool intersect(const ray_t &ray, isect_t &isect) const;
+	bool occluded(const ray_t &ray) const;
+
+	size_t memory_size() const {
+		return nodes.size() * sizeof(bvh_wide_node_t<N>);
+	}
+
+};
+
+#endif
@@ -0,0 +1,80 @@
+#include <cstdio>
+#include <algorithm>
+
+#include "camera_path.hpp"
+
+using namespace std;
+using namespace glm;
+
+
+static vec3 rotate_y(const vec3 &p, float a) {
+	return vec3(p.x * cosf(a) - p.z * sinf(a), p.y, p.x * sinf(a) + p.z * cosf(a));
+}
+
+// the same bases camera_ray expects: right, up and forward at the image center
+static grkt::camera_t look_at(const vec3 &eye, const vec3 &center) {
+	vec3 forward = normalize(center - eye);
+	vec3 up = vec3(0.0, 1.0, 0.0);
+	if (length(cross(forward, up)) < 1e-6f)
+		up = vec3(0.0, 0.0, -1.0);   // looking straight up or down
+	vec3 right = normalize(cross(forward, up));
+
+	grkt::camera_t camera;
+	camera.origin = eye;
+	camera.bases[0] = right;
+	camera.bases[1] = cross(right, forward);
+	camera.bases[2] = forward;
+	return camera;
+}
+
+
+bool camera_path_t::load(const char *filepath) {
+	FILE *fp = fopen(filepath, "r");
+	if (fp == NULL)
+		return false;
+
+	keyframes.clear();
+	bool ok = true;
+	char line[256];
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char *p = line;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0')
+			continue;
+
+		camera_keyframe_t keyframe;
+		if (sscanf(p, "%f %f %f %f %f %f", &keyframe.eye.x, &keyframe.eye.y, &keyframe.eye.z,
+			&keyframe.center.x, &keyframe.center.y, &keyframe.center.z) != 6 || keyframe.eye == keyframe.center) {
+			ok = false;
+			break;
+		}
+		keyframes.push_back(keyframe);
+	}
+	fclose(fp);
+
+	return ok && !keyframes.empty();
+}
+
+grkt::camera_t camera_path_t::camera_at(size_t frame, size_t frame_count) const {
+	if (keyframes.empty()) {
+		// frame 0 is the starting camera itself, and the last frame stops one step short of it
+		float a = 2.0f * M_PI * frame / frame_count;
+		grkt::camera_t camera;
+		camera.origin = pivot + rotate_y(start.origin - pivot, a);
+		for (int k = 0; k < 3; k++)
+			camera.bases[k] = rotate_y(start.bases[k], a);
+		return camera;
+	}
+
+	if (keyframes.size() == 1 || frame_count == 1)
+		return look_at(pivot + keyframes[0].eye, pivot + keyframes[0].center);
+
+	// the first frame sits on the first keyframe and the last frame on the last
+	float t = (float)frame * ( keyframes.size() - 1 ) / ( frame_count - 1 );
+	size_t k = std::min((size_t)t, keyframes.size() - 2);
+	float f = t - k;
+	vec3 eye = mix(keyframes[k].eye, keyframes[k + 1].eye, f);
+	vec3 center = mix(keyframes[k].center, keyframes[k + 1].center, f);
+	return look_at(pivot + eye, pivot + center);
+}
@@ -0,0 +1,32 @@
+#ifndef CAMERA_PATH_HPP
+#define CAMERA_PATH_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "grkt.hpp"
+
+
+struct camera_keyframe_t {
+	glm::vec3 eye;
+	glm::vec3 center;         // the point looked at
+};
+
+// Where the camera is in every frame of a sequence. Either the starting camera swung about a vertical
+// axis through pivot, one full turn over the sequence, or a polyline through keyframes, walked at an even
+// pace in keyframe steps. Keyframe positions are taken relative to pivot.
+struct camera_path_t {
+	grkt::camera_t start;
+	glm::vec3 pivot;
+	std::vector<camera_keyframe_t> keyframes;   // empty for an orbit
+
+	camera_path_t(const grkt::camera_t &camera, const glm::vec3 &p) : start(camera), pivot(p) { }
+
+	// one keyframe per line, "eye_x eye_y eye_z center_x center_y center_z"; '#' starts a comment
+	bool load(const char *filepath);
+
+	grkt::camera_t camera_at(size_t frame, size_t frame_count) const;
+
+};
+
+#endif
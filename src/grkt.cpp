@@ -1,4 +1,8 @@
+#include <algorithm>
+
 #include "grkt.hpp"
+#include "image_output.hpp"
+#include "morton.hpp"
 
 using namespace std;
 using namespace glm;
@@ -6,10 +10,10 @@ using namespace tbb;
 using namespace grkt;
 
 
-vec3 uniform_sphere_sample(const sphere_t &sphere, const vec3 &point, rng_t &rng) {
-	float cos_t = 2.0 * rng() - 1.0;
+vec3 uniform_sphere_sample(const sphere_t &sphere, const vec3 &point, float u1, float u2) {
+	float cos_t = 2.0 * u1 - 1.0;
 	float sin_t = sqrtf(1.0 - cos_t * cos_t);
-	float phi = 2.0 * M_PI * rng();
+	float phi = 2.0 * M_PI * u2;
 	
 	float x = sphere.radius * sin_t * cos(phi);
   float y = sphere.radius * sin_t * sin(phi);
@@ -22,67 +26,248 @@ vec3 uniform_sphere_sample(const sphere_t &sphere, const vec3 &point, rng_t &rng
 	return P + sphere.center;
 }
 
-void renderer_t::operator() (const blocked_range<size_t>& range) const {
+ray_t renderer_t::camera_ray(size_t i, size_t j, sampler_t &sampler) const {
 	size_t width = context->screen.width;
 	size_t height = context->screen.height;
 	
-	const vec3 &origin = context->camera.origin;
-	const vec3 &u = context->camera.bases[0];
-	const vec3 &v = context->camera.bases[1];
-	const vec3 &w = context->camera.bases[2];
+	float r1 = 2.0f * sampler();
+	float r2 = 2.0f * sampler();
+	float dx = (r1 < 1.0f) ? sqrtf(r1) - 1.0f : 1.0f - sqrtf(2.0f - r1);
+	float dy = (r2 < 1.0f) ? sqrtf(r2) - 1.0f : 1.0f - sqrtf(2.0f - r2);
+
+	float a = ( (i - dx) - width/2.0 ) / (width/2.0);
+	float b = ( height/2.0 - (j - dy) ) / (height/2.0) * context->screen.aspect_ratio;
+
+	const camera_t &camera = context->camera;
+	vec3 direction = normalize(a*camera.bases[0] + b*camera.bases[1] + camera.bases[2]);
+	return ray_t(camera.origin, direction);
+}
+
+float renderer_t::light_sample(const ray_t &ray, const isect_t &isect, sampler_t &sampler, ray_t &shadow_ray) const {
+	const shape_t *shape = isect.shape;
+	vec3 P = ray.point_at(isect.t);
+	vec3 N = shape->shading_normal(P, isect);
 	
-	boost::random::mt19937 gen(static_cast<unsigned long>(time(0)));
-	boost::random::uniform_01<float> distro;
-	rng_t rng(gen, distro);
+	// the point on the light comes first, so its two numbers stay a pair of a low-discrepancy sequence
+	float u1 = sampler();
+	float u2 = sampler();
 	
-	for (size_t j = range.begin(); j < range.end(); j++) {
-		for (size_t i = 0; i < width; i++) {
-			int k = 3 * (i + width * j);
-			
-			vec3 lr = vec3(0.0);
-			for (int n = 0; n < context->sample_size; n++) {
+	const sphere_t *light = context->scene_light;
+	float weight = 1.0f;
+	if (context->light_tree != NULL) {
+		float pdf;
+		const light_t *sampled = context->light_tree->sample(P, N, sampler(), &pdf);
+		if (sampled == NULL) {
+			// nothing reaches P; an empty shadow ray keeps the wavefront stages in step
+			shadow_ray = ray_t(P, N);
+			shadow_ray.tmax = 0.0f;
+			return 0.0f;
+		}
+		light = &sampled->sphere;
+		weight = sampled->power / pdf;
+	}
+	
+	vec3 Q = uniform_sphere_sample(*light, P, u1, u2);			
+	vec3 L = normalize(Q - P);
+
+	float kd = clamp(dot(L, N), 0.0f, 1.0f);
+	float ks = 0.0f;
+	if (dot(L, N) > 0.0f) {
+		vec3 H = normalize(L - P); // -P + L
+		ks = glm::pow(glm::max(dot(H, N), 0.0f), 50.0f);
+	}
+
+	shadow_ray = ray_t(P + 0.01f * L, L);
+	shadow_ray.tmax = length(Q - shadow_ray.origin);
+	if (context->light_tree != NULL) {
+		// each of many lights falls off with distance; the single scene light lights everything alike
+		float d2 = dot(Q - P, Q - P);
+		return ( kd + ks ) * weight / d2;
+	}
+	return kd + ks;
+}
 
-				float r1 = 2.0f * rng();
-				float r2 = 2.0f * rng();
-				float dx = (r1 < 1.0f) ? sqrtf(r1) - 1.0f : 1.0f - sqrtf(2.0f - r1);
-				float dy = (r2 < 1.0f) ? sqrtf(r2) - 1.0f : 1.0f - sqrtf(2.0f - r2);
+vec3 renderer_t::radiance(float intensity, bool occluded) const {
+	float shadow = occluded ? 0.6f : 1.0f;
+	return glm::max(shadow * context->material_color * intensity, 0.0);
+}
 
-				float a = ( (i - dx) - width/2.0 ) / (width/2.0);
-				float b = ( height/2.0 - (j - dy) ) / (height/2.0) * context->screen.aspect_ratio;
+vec3 renderer_t::shade(const ray_t &ray, const isect_t &isect, sampler_t &sampler) const {
+	ray_t shadow_ray;
+	float intensity = light_sample(ray, isect, sampler, shadow_ray);
+	return radiance(intensity, context->bvh_tree->occluded(shadow_ray));
+}
 
-				vec3 direction = normalize(a*u + b*v + w);
-				ray_t ray(origin, direction);
+bool renderer_t::converged(const pixel_estimator_t &estimator) const {
+	if (estimator.n >= context->sample_size)
+		return true;
+	if (!context->adaptive || estimator.n < context->min_sample_size)
+		return false;
+	return estimator.standard_error() <= context->error_threshold;
+}
 
-				isect_t isect;
-				if (!context->bvh_tree->intersect(ray, isect))
-					continue;
-
-				const shape_t *shape = isect.shape;
-				vec3 P = ray.point_at(isect.t);
-				vec3 Q = uniform_sphere_sample(*context->scene_light, P, rng);			
-				vec3 L = normalize(Q - P);
-
-				vec3 N = shape->normal(P);
-				float kd = clamp(dot(L, N), 0.0f, 1.0f);
-				float ks = 0.0f;
-				if (dot(L, N) > 0.0f) {
-					vec3 H = normalize(L - P); // -P + L
-					ks = glm::pow(glm::max(dot(H, N), 0.0f), 50.0f);
-				}
+void renderer_t::write_pixel(size_t i, size_t j, const pixel_estimator_t &estimator, const tile_t &tile, vec3 *tile_radiance) const {
+	size_t pixel = i + context->screen.width * j;
+	if (samples != NULL)
+		samples[pixel] = estimator.n;
+	
+	vec3 radiance = estimator.sum / (float)estimator.n;
+	if (tile_radiance != NULL)
+		tile_radiance[(i - tile.x0) + (tile.x1 - tile.x0) * (j - tile.y0)] = radiance;
+	if (rgb == NULL)
+		return;
 
-				ray_t shadow_ray(P + 0.01f * L, L);
-				float shadow = context->bvh_tree->intersect(shadow_ray) ? 0.6f : 1.0f;
+	int k = 3 * pixel;
+	rgb[k] = radiance_to_byte(radiance.r);
+	rgb[k + 1] = radiance_to_byte(radiance.g);
+	rgb[k + 2] = radiance_to_byte(radiance.b);			
+}
 
-				lr += glm::max(shadow * context->material_color * (kd + ks), 0.0);
-			}
-			vec3 radiance = clamp(lr * context->sample_size_inv, 0.0, 1.0);
+struct tile_morton_less_t {
+	size_t size;
+	
+	tile_morton_less_t(size_t s) : size(s) { }
+	
+	bool operator()(const tile_t &a, const tile_t &b) const {
+		return morton_2d(a.x0 / size, a.y0 / size) < morton_2d(b.x0 / size, b.y0 / size);
+	}
+	
+};
 
-			rgb[k] = glm::floor(255.0 * radiance.r);
-			rgb[k + 1] = glm::floor(255.0 * radiance.g);
-			rgb[k + 2] = glm::floor(255.0 * radiance.b);			
-						
+void context_t::make_tiles(size_t size) {
+	tile_size = size;
+	tiles.clear();
+	for (size_t y = 0; y < screen.height; y += size) {
+		for (size_t x = 0; x < screen.width; x += size) {
+			tile_t tile;
+			tile.x0 = x;
+			tile.y0 = y;
+			tile.x1 = std::min(x + size, screen.width);
+			tile.y1 = std::min(y + size, screen.height);
+			tiles.push_back(tile);
 		}
 	}
 	
+	// neighbouring tiles in Morton order also touch neighbouring parts of the BVH
+	std::sort(tiles.begin(), tiles.end(), tile_morton_less_t(size));
+}
+
+sampler_t renderer_t::pixel_sampler(size_t i, size_t j) const {
+	// depends only on the pixel and the frame seed, never on which thread renders it
+	return sampler_t(context->sampler, (uint32_t)i, (uint32_t)j, (uint32_t)context->screen.width, context->seed, (uint32_t)context->sample_size);
+}
+
+void renderer_t::operator() (const blocked_range<size_t>& range) const {
+	vector<vec3> tile_radiance;
+	for (size_t t = range.begin(); t < range.end(); t++) {
+		const tile_t &tile = context->tiles[t];
+		if (output != NULL)
+			tile_radiance.resize( (tile.x1 - tile.x0) * (tile.y1 - tile.y0) );
+		vec3 *radiance = (output != NULL) ? &tile_radiance[0] : NULL;
+		
+		if (context->packet_size > 1) {
+			render_tile_packets(tile, radiance);
+		} else {
+			render_tile(tile, radiance);
+		}
+		
+		// the tile is written by the thread that rendered it while the other threads carry on
+		if (output != NULL)
+			output->write_tile(tile, radiance);
+	}
+}
+
+void renderer_t::render_tile(const tile_t &tile, vec3 *tile_radiance) const {
+	for (size_t j = tile.y0; j < tile.y1; j++) {
+		for (size_t i = tile.x0; i < tile.x1; i++) {
+			sampler_t sampler = pixel_sampler(i, j);
+			uint64_t cost_start = (costs != NULL) ? local_traversal_counters().cost() : 0;
+			
+			pixel_estimator_t estimator;
+			while (!converged(estimator)) {
+				sampler.start_sample(estimator.n);
+				ray_t ray = camera_ray(i, j, sampler);
+
+				isect_t isect;
+				if (context->bvh_tree->intersect(ray, isect)) {
+					estimator.add(shade(ray, isect, sampler));
+				} else {
+					estimator.add(vec3(0.0));
+				}
+			}
+			write_pixel(i, j, estimator, tile, tile_radiance);
+			if (costs != NULL)
+				costs[i + context->screen.width * j] = (uint32_t)(local_traversal_counters().cost() - cost_start);
+		}
+	}
 }
 
+void renderer_t::render_tile_packets(const tile_t &tile, vec3 *tile_radiance) const {
+	size_t packet_size = context->packet_size;
+	
+	// packets are runs of adjacent pixels in a tile row; each sample index is traced as one packet
+	for (size_t j = tile.y0; j < tile.y1; j++) {
+		for (size_t i0 = tile.x0; i0 < tile.x1; i0 += packet_size) {
+			size_t n_rays = std::min(packet_size, tile.x1 - i0);
+			pixel_estimator_t estimators[ray_packet_t::max_size];
+			sampler_t samplers[ray_packet_t::max_size];
+			uint64_t pixel_costs[ray_packet_t::max_size];
+			for (size_t l = 0; l < n_rays; l++) {
+				samplers[l] = pixel_sampler(i0 + l, j);
+				pixel_costs[l] = 0;
+			}
+			
+			while (true) {
+				// pixels that have converged drop out; the rest form this round's packet
+				size_t lanes[ray_packet_t::max_size];
+				size_t n_active = 0;
+				for (size_t l = 0; l < n_rays; l++) {
+					if (!converged(estimators[l]))
+						lanes[n_active++] = l;
+				}
+				if (n_active == 0)
+					break;
+				
+				ray_packet_t packet(n_active);
+				for (size_t a = 0; a < n_active; a++) {
+					sampler_t &sampler = samplers[lanes[a]];
+					sampler.start_sample(estimators[lanes[a]].n);
+					packet.set(a, camera_ray(i0 + lanes[a], j, sampler));
+				}
+				
+				uint64_t cost_start = (costs != NULL) ? local_traversal_counters().cost() : 0;
+				unsigned int hit = context->bvh_tree->intersect(packet);
+				if (costs != NULL) {
+					// the packet's traversal is shared evenly by its rays
+					uint64_t share = (local_traversal_counters().cost() - cost_start) / n_active;
+					for (size_t a = 0; a < n_active; a++) 
+						pixel_costs[lanes[a]] += share;
+				}
+				
+				for (size_t a = 0; a < n_active; a++) {
+					size_t l = lanes[a];
+					if ( (hit & (1u << a)) == 0 ) {
+						estimators[l].add(vec3(0.0));
+						continue;
+					}
+					
+					isect_t isect;
+					isect.t = packet.t[a];
+					isect.shape = packet.shape[a];
+					isect.object_shape = packet.object_shape[a];
+					isect.object_index = packet.object_index[a];
+					uint64_t shade_start = (costs != NULL) ? local_traversal_counters().cost() : 0;
+					estimators[l].add(shade(packet.ray(a), isect, samplers[l]));
+					if (costs != NULL)
+						pixel_costs[l] += local_traversal_counters().cost() - shade_start;
+				}
+			}
+			
+			for (size_t l = 0; l < n_rays; l++) {
+				write_pixel(i0 + l, j, estimators[l], tile, tile_radiance);
+				if (costs != NULL)
+					costs[i0 + l + context->screen.width * j] = (uint32_t)pixel_costs[l];
+			}
+		}
+	}
+}
@@ -1,16 +1,30 @@
 #ifndef GRKT_RENDERER_HPP
 #define GRKT_RENDERER_HPP
 
-#include <boost/random/mersenne_twister.hpp>
-#include <boost/random/uniform_01.hpp>>
-#include <boost/random/variate_generator.hpp>
+#include <vector>
+#include <stdint.h>
 #include <glm/glm.hpp>
 #include <tbb/parallel_for.h>
 #include <tbb/blocked_range.h>
 
 #include "bvh.hpp"
+#include "light_tree.hpp"
+#include "sampler.hpp"
 
 
+// the 8-bit value written for a radiance channel
+inline unsigned char radiance_to_byte(float v) {
+	return (unsigned char)glm::floor(255.0 * glm::clamp(v, 0.0f, 1.0f));
+}
+
+glm::vec3 uniform_sphere_sample(const sphere_t &sphere, const glm::vec3 &point, float u1, float u2);
+
+inline glm::vec3 uniform_sphere_sample(const sphere_t &sphere, const glm::vec3 &point, rng_t &rng) {
+	float u1 = rng();
+	float u2 = rng();
+	return uniform_sphere_sample(sphere, point, u1, u2);
+}
+
 namespace grkt {
 
 	struct screen_t {
@@ -23,41 +37,106 @@ namespace grkt {
 		glm::vec3 origin;
 		glm::vec3 bases[3];
 	};
+	
+	struct tile_t {
+		size_t x0, y0;
+		size_t x1, y1;
+	};
+	
+	// running mean and variance (Welford) of the luminance of one pixel's samples
+	struct pixel_estimator_t {
+		int n;
+		glm::vec3 sum;
+		float mean;
+		float m2;
+		
+		pixel_estimator_t() : n(0), sum(0.0f), mean(0.0f), m2(0.0f) { }
+		
+		void add(const glm::vec3 &l) {
+			n++;
+			sum += l;
+			float y = (l.r + l.g + l.b) * (1.0f / 3.0f);
+			float d = y - mean;
+			mean += d / n;
+			m2 += d * (y - mean);
+		}
+		
+		float standard_error() const {
+			return (n > 1) ? sqrtf(m2 / (n - 1) / n) : INFINITY;
+		}
+		
+	};
 
 	struct context_t {
 		
 		screen_t screen;
 		camera_t camera;	
-		int sample_size;
-		float sample_size_inv;
+		int sample_size;          // samples per pixel, or the per-pixel maximum when adaptive
+		size_t packet_size;
+		
+		bool adaptive;
+		int min_sample_size;
+		float error_threshold;    // standard error of the pixel mean at which sampling stops
+		
+		uint32_t seed;
+		sampler_type_t sampler;
+		
+		size_t tile_size;
+		std::vector<tile_t> tiles;
 		
 		const bvh_tree_t *bvh_tree;
 		const sphere_t *scene_light;
+		const light_tree_t *light_tree;   // optional, many lights sampled by importance instead of scene_light
 		glm::vec3 material_color;
 				
-		context_t(const bvh_tree_t *tree, size_t width = 800, size_t height = 600) : bvh_tree(tree) {
+		context_t(const bvh_tree_t *tree, size_t width = 800, size_t height = 600) : bvh_tree(tree), light_tree(NULL) {
 			screen.width = width;
 			screen.height = height;
 			screen.aspect_ratio = (float)screen.height / (float)screen.width;	
 
 			sample_size = 4;
-			sample_size_inv = 1.0f / (float)sample_size;
+			packet_size = 1;
+			
+			adaptive = false;
+			min_sample_size = 8;
+			error_threshold = 0.01f;
+			
+			seed = 0;
+			sampler = SAMPLER_RANDOM;
+			
+			make_tiles(16);
 		}
 		
+		void make_tiles(size_t size);
+		
 	};
 	
+	struct image_output_t;
+	
 	struct renderer_t {
 	
 		const context_t *context;
-		unsigned char *rgb;
+		unsigned char *rgb;       // optional, the whole frame
+		unsigned short *samples;  // optional, samples taken per pixel
+		uint32_t *costs;          // optional, traversal cost per pixel (nodes visited + primitives tested)
+		image_output_t *output;   // optional, finished tiles are written here as they complete
 	
-		renderer_t(const context_t *ctx, unsigned char *rgb_buf) : context(ctx), rgb(rgb_buf) { }	
+		renderer_t(const context_t *ctx, unsigned char *rgb_buf, unsigned short *sample_buf = NULL, uint32_t *cost_buf = NULL, image_output_t *out = NULL) :
+			context(ctx), rgb(rgb_buf), samples(sample_buf), costs(cost_buf), output(out) { }	
 		void operator() (const tbb::blocked_range<size_t>& range) const;
+		void render_tile(const tile_t &tile, glm::vec3 *tile_radiance) const;
+		void render_tile_packets(const tile_t &tile, glm::vec3 *tile_radiance) const;
+		
+		sampler_t pixel_sampler(size_t i, size_t j) const;
+		ray_t camera_ray(size_t i, size_t j, sampler_t &sampler) const;
+		glm::vec3 shade(const ray_t &ray, const isect_t &isect, sampler_t &sampler) const;
+		float light_sample(const ray_t &ray, const isect_t &isect, sampler_t &sampler, ray_t &shadow_ray) const;
+		glm::vec3 radiance(float intensity, bool occluded) const;
+		bool converged(const pixel_estimator_t &estimator) const;
+		void write_pixel(size_t i, size_t j, const pixel_estimator_t &estimator, const tile_t &tile, glm::vec3 *tile_radiance) const;
 	
 	};
 	
 }
 
-typedef boost::variate_generator< boost::random::mt19937, boost::random::uniform_01<float> > rng_t;
-
 #endif
@@ -0,0 +1,96 @@
+#include <cstdio>
+#include <cstring>
+#include <strings.h>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "image_output.hpp"
+
+using namespace std;
+using namespace glm;
+using namespace grkt;
+
+
+image_output_t::image_output_t() : fd(-1), format(IMAGE_FORMAT_PPM), width(0), height(0), header_size(0), bytes_written(0), failed(0) { }
+
+image_output_t::~image_output_t() {
+	close();
+}
+
+image_format_t image_output_t::format_for(const char *filepath) {
+	size_t n = strlen(filepath);
+	if (n >= 4 && strcasecmp(filepath + n - 4, ".pfm") == 0)
+		return IMAGE_FORMAT_PFM;
+	return IMAGE_FORMAT_PPM;
+}
+
+bool image_output_t::open(const char *filepath, image_format_t f, size_t w, size_t h) {
+	close();
+
+	format = f;
+	width = w;
+	height = h;
+	bytes_written = 0;
+	failed = 0;
+
+	char header[64];
+	if (format == IMAGE_FORMAT_PFM) {
+		// a negative scale marks little-endian floats
+		snprintf(header, sizeof(header), "PF\n%ld %ld\n-1.0\n", width, height);
+	} else {
+		snprintf(header, sizeof(header), "P6\n%ld %ld\n%d\n", width, height, 255);
+	}
+	header_size = strlen(header);
+
+	fd = ::open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+
+	// size the file once, so every tile lands at a fixed offset whatever order tiles finish in
+	off_t size = header_size + width * height * pixel_size();
+	if (pwrite(fd, header, header_size, 0) != (ssize_t)header_size || ftruncate(fd, size) != 0) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+bool image_output_t::close() {
+	if (fd < 0)
+		return true;
+	bool ok = ( ::close(fd) == 0 ) && !failed;
+	fd = -1;
+	return ok;
+}
+
+void image_output_t::write_tile(const tile_t &tile, const vec3 *radiance) {
+	size_t tile_width = tile.x1 - tile.x0;
+	size_t row_bytes = tile_width * pixel_size();
+	vector<unsigned char> row(row_bytes);
+
+	for (size_t j = tile.y0; j < tile.y1; j++) {
+		const vec3 *src = radiance + (j - tile.y0) * tile_width;
+		size_t file_row = j;
+		if (format == IMAGE_FORMAT_PFM) {
+			file_row = height - 1 - j;
+			for (size_t i = 0; i < tile_width; i++) {
+				float rgb[3] = { src[i].r, src[i].g, src[i].b };
+				memcpy(&row[i * sizeof(rgb)], rgb, sizeof(rgb));
+			}
+		} else {
+			for (size_t i = 0; i < tile_width; i++) {
+				row[3 * i] = radiance_to_byte(src[i].r);
+				row[3 * i + 1] = radiance_to_byte(src[i].g);
+				row[3 * i + 2] = radiance_to_byte(src[i].b);
+			}
+		}
+
+		off_t offset = header_size + ( file_row * width + tile.x0 ) * pixel_size();
+		if (pwrite(fd, &row[0], row_bytes, offset) != (ssize_t)row_bytes) {
+			__sync_lock_test_and_set(&failed, 1);
+			return;
+		}
+		__sync_fetch_and_add(&bytes_written, (uint64_t)row_bytes);
+	}
+}
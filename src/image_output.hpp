@@ -0,0 +1,53 @@
+#ifndef GRKT_IMAGE_OUTPUT_HPP
+#define GRKT_IMAGE_OUTPUT_HPP
+
+#include <string>
+#include <stdint.h>
+#include <glm/glm.hpp>
+
+#include "grkt.hpp"
+
+
+namespace grkt {
+
+	enum image_format_t {
+		IMAGE_FORMAT_PPM,     // 8-bit clamped, like out.ppm
+		IMAGE_FORMAT_PFM      // 32-bit float radiance, rows bottom to top
+	};
+
+	// An image file that is sized up front and filled a tile at a time with positioned writes.
+	// Tiles never overlap in the file, so workers write the tiles they finish concurrently
+	// while the others keep rendering, and no full frame is ever held in memory.
+	struct image_output_t {
+		int fd;
+		image_format_t format;
+		size_t width;
+		size_t height;
+		size_t header_size;
+		uint64_t bytes_written;
+		int failed;
+
+		image_output_t();
+		~image_output_t();
+
+		static image_format_t format_for(const char *filepath);
+
+		bool open(const char *filepath, image_format_t f, size_t w, size_t h);
+		bool close();
+
+		// radiance holds the tile's pixels row by row
+		void write_tile(const tile_t &tile, const glm::vec3 *radiance);
+
+	private:
+		image_output_t(const image_output_t &);
+		image_output_t& operator=(const image_output_t &);
+
+		size_t pixel_size() const {
+			return (format == IMAGE_FORMAT_PFM) ? 3 * sizeof(float) : 3;
+		}
+
+	};
+
+}
+
+#endif
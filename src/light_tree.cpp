@@ -0,0 +1,209 @@
+#include <algorithm>
+
+#include "light_tree.hpp"
+
+using namespace std;
+using namespace glm;
+
+static const float ONE_MINUS_EPSILON = 0.99999994f;
+
+
+static float safe_sqrt(float x) {
+	return sqrtf(std::max(x, 0.0f));
+}
+
+// cos(max(0, a - b)) from the sines and cosines of a and b
+static float cos_sub_clamped(float sin_a, float cos_a, float sin_b, float cos_b) {
+	if (cos_a > cos_b)
+		return 1.0f;
+	return cos_a * cos_b + sin_a * sin_b;
+}
+
+static float sin_sub_clamped(float sin_a, float cos_a, float sin_b, float cos_b) {
+	if (cos_a > cos_b)
+		return 0.0f;
+	return sin_a * cos_b - cos_a * sin_b;
+}
+
+struct light_centroid_comparator_t {
+	const vector<light_t> *lights;
+	int dim;
+
+	light_centroid_comparator_t(const vector<light_t> *l, int d) : lights(l), dim(d) { }
+
+	bool operator()(size_t a, size_t b) const {
+		return (*lights)[a].sphere.center[dim] < (*lights)[b].sphere.center[dim];
+	}
+
+};
+
+
+light_bound_t& light_bound_t::merge(const light_bound_t &b) {
+	if (b.power == 0.0f)
+		return *this;
+	if (power == 0.0f) {
+		*this = b;
+		return *this;
+	}
+
+	bounds.merge(b.bounds);
+	power += b.power;
+	cos_theta_e = std::min(cos_theta_e, b.cos_theta_e);
+
+	// the smallest cone around both cones of emission
+	float theta_a = acosf(clamp(cos_theta_o, -1.0f, 1.0f));
+	float theta_b = acosf(clamp(b.cos_theta_o, -1.0f, 1.0f));
+	float theta_d = acosf(clamp(dot(axis, b.axis), -1.0f, 1.0f));
+	if (std::min(theta_d + theta_b, (float)M_PI) <= theta_a)
+		return *this;
+	if (std::min(theta_d + theta_a, (float)M_PI) <= theta_b) {
+		axis = b.axis;
+		cos_theta_o = b.cos_theta_o;
+		return *this;
+	}
+
+	float theta_o = 0.5f * ( theta_a + theta_d + theta_b );
+	vec3 w = cross(cross(axis, b.axis), axis);
+	if (theta_o >= M_PI || dot(w, w) == 0.0f) {
+		cos_theta_o = -1.0f;
+		return *this;
+	}
+
+	// turn axis toward b.axis until the cone just covers both
+	float theta_r = theta_o - theta_a;
+	axis = normalize(cosf(theta_r) * axis + sinf(theta_r) * normalize(w));
+	cos_theta_o = cosf(theta_o);
+	return *this;
+}
+
+float light_bound_t::importance(const vec3 &p, const vec3 &n) const {
+	vec3 center = 0.5f * ( bounds.min_point + bounds.max_point );
+	vec3 to_p = p - center;
+	float d2 = dot(to_p, to_p);
+	float r2 = 0.25f * dot(bounds.max_point - bounds.min_point, bounds.max_point - bounds.min_point);
+
+	// the angle the bounds subtend from p; inside the bounding sphere every direction is possible
+	float cos_theta_b = (d2 > r2) ? safe_sqrt(1.0f - r2 / d2) : -1.0f;
+	float sin_theta_b = safe_sqrt(1.0f - cos_theta_b * cos_theta_b);
+	vec3 wi = (d2 > 0.0f) ? to_p / sqrtf(d2) : vec3(0.0f, 0.0f, 1.0f);
+
+	// the smallest angle between an emission direction and a direction toward p
+	float cos_theta_w = dot(axis, wi);
+	float sin_theta_w = safe_sqrt(1.0f - cos_theta_w * cos_theta_w);
+	float sin_theta_o = safe_sqrt(1.0f - cos_theta_o * cos_theta_o);
+	float cos_theta_x = cos_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+	float sin_theta_x = sin_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+	float cos_theta_p = cos_sub_clamped(sin_theta_x, cos_theta_x, sin_theta_b, cos_theta_b);
+	if (cos_theta_p <= cos_theta_e)
+		return 0.0f;
+
+	// the most favourable incidence at the receiver, with the light anywhere in its bounds
+	float cos_theta_i = fabsf(dot(wi, n));
+	float sin_theta_i = safe_sqrt(1.0f - cos_theta_i * cos_theta_i);
+	float cos_theta_ip = cos_sub_clamped(sin_theta_i, cos_theta_i, sin_theta_b, cos_theta_b);
+
+	return std::max(power * cos_theta_p * cos_theta_ip / std::max(d2, r2), 0.0f);
+}
+
+light_bound_t light_t::bound() const {
+	// a sphere emits in every direction
+	light_bound_t b;
+	b.bounds = sphere.bound();
+	b.power = power;
+	b.cos_theta_o = -1.0f;
+	b.cos_theta_e = 0.0f;
+	return b;
+}
+
+
+light_tree_t::light_tree_t(const vector<light_t> &input_lights) : lights(input_lights), depth(0) { }
+
+void light_tree_t::build() {
+	nodes.clear();
+	depth = 0;
+	if (lights.empty())
+		return;
+
+	vector<size_t> order(lights.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+
+	nodes.reserve(2 * lights.size() - 1);
+	recursive_build(order, 0, order.size(), 1);
+
+	// leaves were numbered by input index; store the lights in leaf order
+	vector<light_t> ordered_lights;
+	ordered_lights.reserve(lights.size());
+	for (size_t i = 0; i < nodes.size(); i++) {
+		if (nodes[i].is_leaf()) {
+			ordered_lights.push_back(lights[nodes[i].light_offset]);
+			nodes[i].light_offset = ordered_lights.size() - 1;
+		}
+	}
+	lights.swap(ordered_lights);
+}
+
+// median splits along the longest axis of the light centers keep the tree balanced, so it is log2(N) deep
+size_t light_tree_t::recursive_build(vector<size_t> &order, size_t start, size_t end, size_t level) {
+	size_t offset = nodes.size();
+	nodes.push_back(light_tree_node_t());
+	depth = std::max(depth, level);
+
+	if (end - start == 1) {
+		light_tree_node_t &leaf = nodes[offset];
+		leaf.bound = lights[order[start]].bound();
+		leaf.light_offset = order[start];
+		leaf.light_num = 1;
+		return offset;
+	}
+
+	bbox_t centroid_bound;
+	for (size_t i = start; i < end; i++)
+		centroid_bound.merge(lights[order[i]].sphere.center);
+	int dim = centroid_bound.maximum_extent();
+
+	size_t mid = ( start + end ) / 2;
+	nth_element(order.begin() + start, order.begin() + mid, order.begin() + end, light_centroid_comparator_t(&lights, dim));
+
+	size_t first = recursive_build(order, start, mid, level + 1);
+	size_t second = recursive_build(order, mid, end, level + 1);
+
+	light_tree_node_t &node = nodes[offset];
+	node.bound = nodes[first].bound;
+	node.bound.merge(nodes[second].bound);
+	node.second_child_offset = second;
+	node.light_num = 0;
+	return offset;
+}
+
+const light_t* light_tree_t::sample(const vec3 &p, const vec3 &n, float u, float *pdf) const {
+	if (nodes.empty())
+		return NULL;
+
+	float probability = 1.0f;
+	size_t offset = 0;
+	while (true) {
+		const light_tree_node_t &node = nodes[offset];
+		if (node.is_leaf()) {
+			*pdf = probability;
+			return &lights[node.light_offset];
+		}
+
+		size_t children[2] = { offset + 1, node.second_child_offset };
+		float importance[2] = { nodes[children[0]].bound.importance(p, n), nodes[children[1]].bound.importance(p, n) };
+		if (importance[0] == 0.0f && importance[1] == 0.0f)
+			return NULL;
+
+		// pick a child and stretch u back over [0, 1) for the choices below it
+		float p0 = importance[0] / ( importance[0] + importance[1] );
+		if (u < p0) {
+			offset = children[0];
+			u = std::min(u / p0, ONE_MINUS_EPSILON);
+			probability *= p0;
+		} else {
+			offset = children[1];
+			u = std::min(( u - p0 ) / ( 1.0f - p0 ), ONE_MINUS_EPSILON);
+			probability *= 1.0f - p0;
+		}
+	}
+}
@@ -0,0 +1,77 @@
+#ifndef LIGHT_TREE_HPP
+#define LIGHT_TREE_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "bbox.hpp"
+#include "shape.hpp"
+
+
+// What a subtree of lights can deliver: where the emitters are, how much they emit and in which
+// directions. Emission leaves every point within theta_o of axis and falls off to nothing at theta_e beyond that.
+struct light_bound_t {
+	bbox_t bounds;
+	float power;
+	glm::vec3 axis;
+	float cos_theta_o;
+	float cos_theta_e;
+
+	light_bound_t() : power(0.0f), axis(0.0f, 0.0f, 1.0f), cos_theta_o(1.0f), cos_theta_e(1.0f) { }
+
+	light_bound_t& merge(const light_bound_t &b);
+
+	// an upper bound on what the lights send to a receiver at p facing n, up to a common factor
+	float importance(const glm::vec3 &p, const glm::vec3 &n) const;
+
+};
+
+// A sphere emitter. Mesh emitters would bound their normals with a narrower cone.
+struct light_t {
+	sphere_t sphere;
+	float power;              // radiance scale at unit distance
+
+	light_t(const glm::vec3 &center, float radius, float p) : sphere(center, radius), power(p) { }
+
+	light_bound_t bound() const;
+
+};
+
+struct light_tree_node_t {
+	light_bound_t bound;
+
+	union {
+		size_t light_offset;
+		size_t second_child_offset;
+	};
+
+	size_t light_num;
+
+	bool is_leaf() const {
+		return ( light_num > 0 );
+	}
+
+};
+
+// A binary tree over the lights, flattened depth first like bvh_linear_node_t. A light is chosen by walking
+// down from the root and taking each child in proportion to its importance at the shading point, so
+// the cost is the tree depth rather than the number of lights, and the probability of the choice is
+// the product of the branch probabilities.
+struct light_tree_t {
+	std::vector<light_t> lights;      // in leaf order
+	std::vector<light_tree_node_t> nodes;
+	size_t depth;
+
+	light_tree_t(const std::vector<light_t> &input_lights);
+
+	void build();
+
+	// NULL when no light can reach p; u is uniform in [0, 1)
+	const light_t* sample(const glm::vec3 &p, const glm::vec3 &n, float u, float *pdf) const;
+
+private:
+	size_t recursive_build(std::vector<size_t> &order, size_t start, size_t end, size_t level);
+
+};
+
+#endif
@@ -1,14 +1,30 @@
 
 #include <iostream>
 #include <vector>
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <tbb/parallel_invoke.h>
+#include <tbb/tick_count.h>
 
 #include "triangle_mesh.hpp"
 #include "bvh.hpp"
+#include "bvh_cache.hpp"
+#include "bvh_instance.hpp"
 #include "grkt.hpp"
+#include "wavefront.hpp"
+#include "image_output.hpp"
+#include "mesh_store.hpp"
+#include "light_tree.hpp"
+#include "camera_path.hpp"
+#include "render_farm.hpp"
+#include "render_placement.hpp"
 
 
 using namespace std;
@@ -18,42 +34,421 @@ using namespace tbb;
 
 #define INSPECT(arg)  string_cast::to_string(arg)
 
+static const size_t MESH_STORE_CHUNK_TRIANGLES = 16384;
 
-bool write_image(const vector<unsigned char> &rgb, size_t width, size_t height) {
-	FILE *fp = fopen("out.ppm", "wb"); 
+
+bool write_image(const char *filepath, const unsigned char *rgb, size_t width, size_t height) {
+	FILE *fp = fopen(filepath, "wb"); 
 	if (fp == NULL) {
 		return false;
 	}
 	fprintf(fp, "P6\n%ld %ld\n%d\n", width, height, 255);
-	fwrite((void *)&rgb[0], sizeof(unsigned char), rgb.size(), fp);
+	fwrite((void *)rgb, sizeof(unsigned char), width * height * 3, fp);
 	fclose(fp);     
 	return true;
 }
 
-void render(const char *ctm_filepath) {
-	triangle_mesh_t mesh;
-	if (!triangle_mesh_t::load(ctm_filepath, mesh)) {
-		cerr << "Loading .ctm file failed: " << ctm_filepath << endl;
+bool write_heatmap(const char *filepath, const vector<uint32_t> &costs, size_t width, size_t height) {
+	// scale to the 99th percentile so a few expensive pixels do not flatten the rest
+	vector<uint32_t> sorted(costs);
+	size_t k = sorted.size() * 99 / 100;
+	nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+	float scale = 1.0f / std::max(sorted[k], 1u);
+	
+	// black, blue, cyan, green, yellow, red
+	static const float ramp[6][3] = { {0, 0, 0}, {0, 0, 1}, {0, 1, 1}, {0, 1, 0}, {1, 1, 0}, {1, 0, 0} };
+	vector<unsigned char> rgb(costs.size() * 3);
+	for (size_t i = 0; i < costs.size(); i++) {
+		float x = std::min(costs[i] * scale, 1.0f) * 5.0f;
+		int a = std::min((int)x, 4);
+		float f = x - a;
+		for (int c = 0; c < 3; c++) {
+			rgb[3 * i + c] = (unsigned char)(255.0f * ( ramp[a][c] + f * ( ramp[a + 1][c] - ramp[a][c] ) ));
+		}
+	}
+	
+	printf("heatmap: %s, full scale %u (99th percentile)\n", filepath, sorted[k]);
+	return write_image(filepath, &rgb[0], width, height);
+}
+
+void print_traversal_counters(const traversal_counters_t &c) {
+	for (int t = 0; t < TRAVERSAL_TYPE_COUNT; t++) {
+		if (c.rays[t] == 0)
+			continue;
+		double n = (double)c.rays[t];
+		printf("traversal: %-7s %ld traversals, %.1f nodes, %.1f boxes, %.1f primitives per traversal, max stack depth %ld\n",
+			traversal_counters_t::type_name(t), (size_t)c.rays[t], c.nodes[t] / n, c.boxes[t] / n, c.primitives[t] / n, (size_t)c.max_depth[t]);
+	}
+}
+
+struct options_t {
+	const char *ctm_filepath;
+	uint64_t model_key;       // bvh_cache_t::model_key() of ctm_filepath, the start of every cache, store and farm key
+	bvh_split_method_t split_method;
+	bool shadow_benchmark;
+	size_t packet_size;
+	bvh_layout_t layout;
+	bool pack_triangles;
+	size_t tile_size;
+	int sample_size;
+	float error_threshold;    // > 0 turns on adaptive sampling
+	bool compare_fixed;
+	bool use_cache;
+	const char *heatmap_filepath;
+	size_t instance_count;    // > 0 renders copies of the mesh through a two-level BVH
+	int frame_count;          // > 0 deforms the mesh over this many frames before rendering the last one
+	size_t wavefront_batch;   // > 0 renders in stages over batches of this many pixels
+	const char *output_filepath;  // streams tiles to this file instead of writing out.ppm at the end
+	size_t memory_budget;     // > 0 renders from an out-of-core mesh store, with at most this many bytes of chunks resident
+	size_t light_count;       // > 0 lights the scene with this many sphere lights sampled through a light tree
+	sampler_type_t sampler;
+	size_t sequence_length;   // > 0 renders this many frames along a camera path into frame_NNNN.ppm
+	const char *camera_path_filepath;  // keyframes for the sequence; without them the camera orbits the scene
+	size_t worker_count;      // > 0 renders the frame's tiles in this many worker processes
+	const char *farm_socket;  // renders tiles for the coordinator listening here instead of a frame
+	vector<string> command;   // how this process was started, which workers repeat
+	size_t thread_count;      // > 0 renders in a task_arena of this many threads
+	bool pin_threads;         // binds the render threads to cores node by node, each node rendering its own tiles
+	bool replicate_bvh;       // with pin_threads, gives every NUMA node its own copy of the scene's BVH
+	bool scaling_report;
+	
+	options_t() : ctm_filepath(NULL), model_key(0), split_method(BVH_SPLIT_MIDDLE), shadow_benchmark(false), packet_size(1), layout(BVH_LAYOUT_BINARY), pack_triangles(true), tile_size(16),
+		sample_size(4), error_threshold(0.0f), compare_fixed(false), use_cache(true), heatmap_filepath(NULL), instance_count(0), frame_count(0), wavefront_batch(0), output_filepath(NULL), memory_budget(0), light_count(0), sampler(SAMPLER_RANDOM),
+		sequence_length(0), camera_path_filepath(NULL), worker_count(0), farm_socket(NULL),
+		thread_count(0), pin_threads(false), replicate_bvh(false), scaling_report(false) { }
+	
+};
+
+const char* sampler_name(sampler_type_t sampler) {
+	switch (sampler) {
+		case SAMPLER_PCG_HASH: return "pcg";
+		case SAMPLER_SOBOL: return "sobol";
+		case SAMPLER_BLUE_NOISE: return "bluenoise";
+		default: return "random";
+	}
+}
+
+void benchmark_rays(const grkt::context_t &ctx) {
+	size_t width = ctx.screen.width;
+	size_t height = ctx.screen.height;
+	const grkt::camera_t &camera = ctx.camera;
+	
+	rng_t rng(5489u);
+	
+	// one primary ray per pixel center
+	vector<ray_t> primary_rays;
+	primary_rays.reserve(width * height);
+	for (size_t j = 0; j < height; j++) {
+		for (size_t i = 0; i < width; i++) {
+			float a = ( i - width/2.0 ) / (width/2.0);
+			float b = ( height/2.0 - j ) / (height/2.0) * ctx.screen.aspect_ratio;
+			primary_rays.push_back(ray_t(camera.origin, normalize(a*camera.bases[0] + b*camera.bases[1] + camera.bases[2])));
+		}
+	}
+	
+	// one shadow ray per primary hit, toward a sample on the light
+	vector<ray_t> shadow_rays;
+	shadow_rays.reserve(width * height);
+	size_t primary_hits = 0;
+	tick_count primary_start = tick_count::now();
+	for (size_t i = 0; i < primary_rays.size(); i++) {
+		const ray_t &ray = primary_rays[i];
+		isect_t isect;
+		if (!ctx.bvh_tree->intersect(ray, isect))
+			continue;
+		
+		primary_hits++;
+		vec3 P = ray.point_at(isect.t);
+		vec3 Q = uniform_sphere_sample(*ctx.scene_light, P, rng);
+		vec3 L = normalize(Q - P);
+		ray_t shadow_ray(P + 0.01f * L, L);
+		shadow_ray.tmax = length(Q - shadow_ray.origin);
+		shadow_rays.push_back(shadow_ray);
+	}
+	double primary_sec = (tick_count::now() - primary_start).seconds();
+	
+	size_t closest_blocked = 0;
+	tick_count closest_start = tick_count::now();
+	for (size_t i = 0; i < shadow_rays.size(); i++) {
+		ray_t ray(shadow_rays[i].origin, shadow_rays[i].direction);
+		isect_t isect;
+		if (ctx.bvh_tree->intersect(ray, isect, NULL))
+			closest_blocked++;
+	}
+	double closest_sec = (tick_count::now() - closest_start).seconds();
+	
+	size_t occluded_blocked = 0;
+	tick_count occluded_start = tick_count::now();
+	for (size_t i = 0; i < shadow_rays.size(); i++) {
+		if (ctx.bvh_tree->occluded(shadow_rays[i]))
+			occluded_blocked++;
+	}
+	double occluded_sec = (tick_count::now() - occluded_start).seconds();
+	
+	printf("primary rays: %ld, %s layout\n", primary_rays.size(), layout_name(ctx.bvh_tree->layout));
+	printf("  closest-hit:            %.3f sec, %.2f Mrays/s, %ld hits (includes light sampling)\n", primary_sec, primary_rays.size() / primary_sec * 1e-6, primary_hits);
+	printf("shadow rays: %ld\n", shadow_rays.size());
+	printf("  binary closest-hit, unbounded: %.3f sec, %.2f Mrays/s, %ld blocked\n", closest_sec, shadow_rays.size() / closest_sec * 1e-6, closest_blocked);
+	printf("  occluded, bounded:             %.3f sec, %.2f Mrays/s, %ld blocked\n", occluded_sec, shadow_rays.size() / occluded_sec * 1e-6, occluded_blocked);
+}
+
+void make_instances(const bvh_tree_t *object_tree, size_t count, vector<shape_ref_t> &instances) {
+	// rows of seven beside and behind the original, each turned a little further around the vertical axis
+	static const int lateral[7] = { 0, 1, -1, 2, -2, 3, -3 };
+	if (object_tree->empty())
 		return;
+	const bbox_t &bound = object_tree->nodes[0].bounds;
+	vec3 center = 0.5f * ( bound.max_point + bound.min_point );
+	float spacing = 1.2f * std::max(bound.max_point.x - bound.min_point.x, bound.max_point.z - bound.min_point.z);
+	
+	for (size_t k = 0; k < count; k++) {
+		vec3 offset = vec3(spacing * lateral[k % 7], 0.0f, -spacing * (k / 7));
+		mat4 M = translate(mat4(1.0f), offset + center);
+		M = rotate(M, 37.0f * k, vec3(0.0f, 1.0f, 0.0f));
+		M = translate(M, -center);
+		instances.push_back(shape_ref_t(new instance_t(object_tree, M)));
 	}
+}
+
+void make_light_rig(const bbox_t &view_bound, size_t count, vector<light_t> &lights) {
+	// a jittered grid of small lights of uneven power above the scene, together as bright at its center as the single light
+	vec3 extent = view_bound.max_point - view_bound.min_point;
+	vec3 center = 0.5f * ( view_bound.max_point + view_bound.min_point );
+	size_t columns = (size_t)ceil(sqrt((double)count));
+	float spacing_x = extent.x / columns;
+	float spacing_z = extent.z / columns;
+	float height = view_bound.max_point.y + 0.25f * std::max(extent.x, extent.z);
+	float radius = 0.1f * std::min(spacing_x, spacing_z);
 	
-	vector<shape_ref_t> shapes;
-	mesh.refine(shapes);
+	rng_t rng(5489u);
+	vector<vec3> positions(count);
+	vector<float> weights(count);
+	float weight_sum = 0.0f;
+	for (size_t k = 0; k < count; k++) {
+		float x = view_bound.min_point.x + ( (k % columns) + 0.25f + 0.5f * rng() ) * spacing_x;
+		float z = view_bound.min_point.z + ( (k / columns) + 0.25f + 0.5f * rng() ) * spacing_z;
+		positions[k] = vec3(x, height, z);
+		weights[k] = 0.25f + 1.5f * rng();
+		weight_sum += weights[k];
+	}
+	
+	for (size_t k = 0; k < count; k++) {
+		vec3 d = positions[k] - center;
+		lights.push_back(light_t(positions[k], radius, weights[k] / weight_sum * dot(d, d)));
+	}
+}
 
-	shape_ref_t plane(new plane_t(vec3(0.0, 0.05, 0.0), vec3(0.0, 1.0, 0.0)));
-	shapes.push_back(plane);
+void animate(int frame_count, triangle_mesh_t &mesh, bvh_tree_t &bvh_tree) {
+	bbox_t bound = bvh_tree.bound();
+	vec3 center = 0.5f * ( bound.max_point + bound.min_point );
+	float height = bound.max_point.y - bound.min_point.y;
+	vector<vec3> rest_vertices(mesh.vertices);
+	
+	// twist about the vertical axis, a little more every frame; the topology never changes
+	for (int f = 1; f <= frame_count; f++) {
+		float twist = 0.15f * f / height;
+		for (size_t i = 0; i < mesh.vertices.size(); i++) {
+			vec3 p = rest_vertices[i] - center;
+			float a = twist * p.y;
+			mesh.vertices[i] = center + vec3(p.x * cosf(a) - p.z * sinf(a), p.y, p.x * sinf(a) + p.z * cosf(a));
+		}
+		mesh.compute_vertex_normals();
+		
+		float built_cost = bvh_tree.built_sah_cost;
+		tick_count update_start = tick_count::now();
+		bool rebuilt = bvh_tree.update();
+		tick_count update_end = tick_count::now();
+		
+		printf("frame %d: %s %.3f sec, SAH cost %.3f (last build %.3f)\n",
+			f, rebuilt ? "refit + rebuild" : "refit", (update_end - update_start).seconds(), bvh_tree.sah_cost(), built_cost);
+	}
+}
+
+// one frame with the context's camera into whichever buffers are given
+void render_frame(const options_t &options, const grkt::context_t &ctx, const grkt::render_placement_t &placement,
+	unsigned char *rgb_buf, unsigned short *sample_buf, uint32_t *cost_buf, grkt::image_output_t *output_buf) {
+	if (placement.active()) {
+		placement.render(&ctx, rgb_buf, sample_buf, cost_buf, output_buf, options.wavefront_batch);
+	} else if (options.wavefront_batch > 0) {
+		grkt::wavefront_renderer_t wavefront(&ctx, rgb_buf, sample_buf, cost_buf, output_buf, options.wavefront_batch);
+		wavefront.render();
+		printf("wavefront: %ld batches of up to %ld pixels, %ld rounds, %ld camera rays, %ld shadow rays\n",
+			wavefront.batch_count, wavefront.batch_size, wavefront.round_count, wavefront.ray_count, wavefront.shadow_ray_count);
+	} else {
+		grkt::renderer_t renderer(&ctx, rgb_buf, sample_buf, cost_buf, output_buf);
+		parallel_for(blocked_range<size_t>(0, ctx.tiles.size()), renderer);
+	}
+}
+
+struct frame_render_task_t {
+	const options_t *options;
+	const grkt::context_t *ctx;
+	const grkt::render_placement_t *placement;
+	unsigned char *rgb;
+	double *seconds;
+	
+	frame_render_task_t(const options_t *o, const grkt::context_t *c, const grkt::render_placement_t *p, unsigned char *rgb_buf, double *sec) :
+		options(o), ctx(c), placement(p), rgb(rgb_buf), seconds(sec) { }
+	
+	void operator()() const {
+		tick_count start = tick_count::now();
+		render_frame(*options, *ctx, *placement, rgb, NULL, NULL, NULL);
+		*seconds = (tick_count::now() - start).seconds();
+	}
+	
+};
+
+struct frame_write_task_t {
+	const unsigned char *rgb;
+	size_t frame;
+	size_t width, height;
+	double *seconds;
+	
+	frame_write_task_t(const unsigned char *rgb_buf, size_t f, size_t w, size_t h, double *sec) : rgb(rgb_buf), frame(f), width(w), height(h), seconds(sec) { }
+	
+	void operator()() const {
+		tick_count start = tick_count::now();
+		char filepath[32];
+		snprintf(filepath, sizeof(filepath), "frame_%04ld.ppm", frame);
+		if (!write_image(filepath, rgb, width, height))
+			cerr << "Writing " << filepath << " failed." << endl;
+		*seconds = (tick_count::now() - start).seconds();
+	}
+	
+};
+
+// Renders every frame of the path against the one scene. Frame k is written from one buffer while
+// frame k + 1 renders into the other, so the writer takes a single worker and the tiles get the rest.
+void render_sequence(const options_t &options, grkt::context_t &ctx, const grkt::render_placement_t &placement, const camera_path_t &path, size_t frame_count) {
+	size_t width = ctx.screen.width;
+	size_t height = ctx.screen.height;
+	grkt::first_touch_array_t<unsigned char> rgb[2];
+	if (!rgb[0].allocate(width * height * 3) || !rgb[1].allocate(width * height * 3)) {
+		cerr << "Can not allocate frame buffers" << endl;
+		return;
+	}
+	
+	double render_sec = 0.0;
+	double write_sec = 0.0;
+	double frame_render_sec = 0.0;
+	double frame_write_sec = 0.0;
+	
+	reset_traversal_counters();
+	tick_count sequence_start = tick_count::now();
+	for (size_t frame = 0; frame < frame_count; frame++) {
+		// a new seed every frame keeps the noise from standing still on screen
+		ctx.camera = path.camera_at(frame, frame_count);
+		ctx.seed = frame;
+		
+		frame_render_task_t render_task(&options, &ctx, &placement, rgb[frame % 2].data, &frame_render_sec);
+		if (frame == 0) {
+			render_task();
+			printf("frame %ld: render %.3f sec\n", frame, frame_render_sec);
+		} else {
+			parallel_invoke(render_task, frame_write_task_t(rgb[(frame - 1) % 2].data, frame - 1, width, height, &frame_write_sec));
+			write_sec += frame_write_sec;
+			printf("frame %ld: render %.3f sec, frame %ld written %.3f sec\n", frame, frame_render_sec, frame - 1, frame_write_sec);
+		}
+		render_sec += frame_render_sec;
+	}
+	frame_write_task_t(rgb[(frame_count - 1) % 2].data, frame_count - 1, width, height, &frame_write_sec)();
+	write_sec += frame_write_sec;
+	double sequence_sec = (tick_count::now() - sequence_start).seconds();
+	
+	printf("sequence: %ld frames of %ldx%ld along %s, %.3f sec, %.2f frames/sec (render %.3f sec, write %.3f sec, %.3f sec of writing overlapped)\n",
+		frame_count, width, height, path.keyframes.empty() ? "an orbit" : options.camera_path_filepath, sequence_sec, frame_count / sequence_sec,
+		render_sec, write_sec, std::max(render_sec + write_sec - sequence_sec, 0.0));
+	print_traversal_counters(combined_traversal_counters());
+}
+
+void print_placement(const grkt::render_placement_t &placement, double seconds) {
+	printf("placement: %ld threads", placement.thread_count);
+	if (placement.pinned) {
+		printf(", pinned on %ld NUMA node%s (", placement.nodes.size(), (placement.nodes.size() > 1) ? "s" : "");
+		for (size_t i = 0; i < placement.nodes.size(); i++) {
+			const grkt::numa_node_t &node = placement.nodes[i];
+			printf("%snode %d: cpus %d-%d", (i > 0) ? ", " : "", node.id, node.cpus.front(), node.cpus.back());
+		}
+		printf(")");
+	}
+	if (!placement.replicas.empty())
+		printf(", %ld BVH replicas of %ld bytes", placement.replicas.size(), placement.replicas[0]->memory_size());
+	printf(", %.3f sec\n", seconds);
+}
 
-	bvh_tree_t bvh_tree(shapes);
-	bvh_tree.build();
-	bvh_tree.flatten();
+// renders the frame again and again from 1 thread up to every core, each time into freshly mapped buffers
+void report_scaling(const options_t &options, const grkt::context_t &ctx) {
+	size_t cpus = grkt::render_placement_t::cpu_count(grkt::render_placement_t::detect_nodes());
+	size_t pixel_count = ctx.screen.width * ctx.screen.height;
+	double base_sec = 0.0;
 	
-	grkt::context_t ctx(&bvh_tree);
+	for (size_t threads = 1; ; threads = std::min(threads * 2, cpus)) {
+		grkt::render_placement_t placement;
+		placement.setup(threads, options.pin_threads, options.replicate_bvh, ctx.bvh_tree);
+		grkt::first_touch_array_t<unsigned char> rgb;
+		grkt::first_touch_array_t<unsigned short> samples;
+		if (!rgb.allocate(pixel_count * 3) || !samples.allocate(pixel_count))
+			return;
+		
+		tick_count start = tick_count::now();
+		placement.render(&ctx, rgb.data, samples.data, NULL, NULL, options.wavefront_batch);
+		double sec = (tick_count::now() - start).seconds();
+		if (threads == 1)
+			base_sec = sec;
+		
+		printf("scaling: %3ld threads on %ld node%s, %.3f sec, %.2fx speedup, %.0f%% efficiency\n",
+			threads, std::max(placement.nodes.size(), (size_t)1), (placement.nodes.size() > 1) ? "s" : "", sec,
+			base_sec / sec, 100.0 * base_sec / sec / threads);
+		if (threads >= cpus)
+			break;
+	}
+}
+
+// the model and every option that changes a pixel, so a farm worker started differently is turned away
+uint64_t farm_key(const options_t &options, const grkt::context_t &ctx) {
+	uint64_t key = bvh_cache_t::make_key(options.model_key, options.split_method, 0);
+	
+	uint32_t settings[] = { (uint32_t)options.packet_size, (uint32_t)options.layout, options.pack_triangles, (uint32_t)options.tile_size,
+		(uint32_t)options.sample_size, (uint32_t)options.sampler, (uint32_t)options.instance_count, (uint32_t)options.frame_count,
+		options.memory_budget > 0, (uint32_t)options.light_count };
+	key = bvh_cache_t::extend_key(key, settings, sizeof(settings));
+	key = bvh_cache_t::extend_key(key, &options.error_threshold, sizeof(options.error_threshold));
+	key = bvh_cache_t::extend_key(key, &ctx.camera, sizeof(ctx.camera));
+	key = bvh_cache_t::extend_key(key, &ctx.material_color, sizeof(ctx.material_color));
+	return key;
+}
+
+// renders the frame with the camera framing view_bound, whatever tree the scene is held in
+void render_scene(const options_t &options, const bvh_tree_t *scene_tree, const bbox_t &view_bound) {
+	grkt::context_t ctx(scene_tree);
+	ctx.packet_size = options.packet_size;
+	ctx.make_tiles(options.tile_size);
+	ctx.sample_size = options.sample_size;
+	ctx.adaptive = (options.error_threshold > 0.0f);
+	ctx.error_threshold = options.error_threshold;
+	ctx.min_sample_size = std::min(ctx.min_sample_size, ctx.sample_size);
+	ctx.sampler = options.sampler;
 	
 	sphere_t sphere_light(vec3(-1.0, 3.0, 1.0), 0.8);
 	ctx.scene_light = &sphere_light;
 	ctx.material_color = vec3(0.6, 0.6, 0.6);
 	
-	vec3 centroid = 0.5f * ( ctx.bvh_tree->nodes[0].bounds.max_point + ctx.bvh_tree->nodes[0].bounds.min_point );
+	boost::scoped_ptr<light_tree_t> light_tree;
+	if (options.light_count > 0) {
+		vector<light_t> lights;
+		make_light_rig(view_bound, options.light_count, lights);
+		
+		light_tree.reset(new light_tree_t(lights));
+		tick_count light_start = tick_count::now();
+		light_tree->build();
+		tick_count light_end = tick_count::now();
+		ctx.light_tree = light_tree.get();
+		
+		printf("lights: %ld sphere lights, light tree %ld nodes, depth %ld, %.3f sec\n",
+			light_tree->lights.size(), light_tree->nodes.size(), light_tree->depth, (light_end - light_start).seconds());
+	}
+	
+	vec3 centroid = 0.5f * ( view_bound.max_point + view_bound.min_point );
 	mat4 O = translate(mat4(1.0f), centroid); // origin of camera coordinate 
 	
 	vec3 eye = vec3(0.1, 0.05, 0.2);
@@ -68,24 +463,643 @@ void render(const char *ctm_filepath) {
 	ctx.camera.bases[1] = normalize(M * vec3(0.0, 1.0, 0.0));
 	ctx.camera.bases[2] = normalize(M * vec3(0.0, 0.0, -1.0));
 	
-	vector<unsigned char> rgb;
-	rgb.resize(ctx.screen.width * ctx.screen.height * 3);
+	if (options.shadow_benchmark) {
+		benchmark_rays(ctx);
+		return;
+	}
+	
+	grkt::render_placement_t placement;
+	if (options.thread_count > 0 || options.pin_threads) {
+		size_t threads = (options.thread_count > 0) ? options.thread_count : grkt::render_placement_t::cpu_count(grkt::render_placement_t::detect_nodes());
+		tick_count placement_start = tick_count::now();
+		placement.setup(threads, options.pin_threads, options.replicate_bvh, scene_tree);
+		tick_count placement_end = tick_count::now();
+		print_placement(placement, (placement_end - placement_start).seconds());
+	}
+	
+	if (options.sequence_length > 0 || options.camera_path_filepath != NULL) {
+		camera_path_t path(ctx.camera, centroid);
+		if (options.camera_path_filepath != NULL && !path.load(options.camera_path_filepath)) {
+			cerr << "Loading camera path failed: " << options.camera_path_filepath << endl;
+			return;
+		}
+		// keyframes alone give one frame each
+		size_t frame_count = (options.sequence_length > 0) ? options.sequence_length : path.keyframes.size();
+		render_sequence(options, ctx, placement, path, frame_count);
+		return;
+	}
+	
+	if (options.farm_socket != NULL) {
+		if (!grkt::farm_work(&ctx, farm_key(options, ctx), options.farm_socket))
+			cerr << "Worker lost the coordinator at " << options.farm_socket << endl;
+		return;
+	}
+	
+	size_t pixel_count = ctx.screen.width * ctx.screen.height;
+	bool streaming = (options.output_filepath != NULL);
 	
-	grkt::renderer_t renderer(&ctx, &rgb[0]);
-	parallel_for(blocked_range<size_t>(0, ctx.screen.height), renderer);
+	// streamed frames only ever hold the tiles in flight; the pages of a whole one go where they are first written
+	grkt::first_touch_array_t<unsigned char> rgb;
+	grkt::first_touch_array_t<unsigned short> samples;
+	if (!streaming && ( !rgb.allocate(pixel_count * 3) || !samples.allocate(pixel_count) )) {
+		cerr << "Can not allocate frame buffers" << endl;
+		return;
+	}
+	
+	grkt::image_output_t output;
+	if (streaming) {
+		grkt::image_format_t format = grkt::image_output_t::format_for(options.output_filepath);
+		if (!output.open(options.output_filepath, format, ctx.screen.width, ctx.screen.height)) {
+			cerr << "Can not open " << options.output_filepath << endl;
+			return;
+		}
+	}
+	
+	vector<uint32_t> costs;
+	if (options.heatmap_filepath != NULL)
+		costs.resize(pixel_count);
+	
+	unsigned char *rgb_buf = streaming ? NULL : rgb.data;
+	unsigned short *sample_buf = streaming ? NULL : samples.data;
+	uint32_t *cost_buf = costs.empty() ? NULL : &costs[0];
+	grkt::image_output_t *output_buf = streaming ? &output : NULL;
+	
+	if (options.scaling_report)
+		report_scaling(options, ctx);
+	
+	reset_traversal_counters();
+	tick_count render_start = tick_count::now();
+	if (options.worker_count > 0) {
+		// the socket goes in a directory only this user can enter, so nobody else can take its name or connect to it
+		char socket_dir[] = "/tmp/andon.XXXXXX";
+		if (mkdtemp(socket_dir) == NULL) {
+			cerr << "Can not create a directory for the farm socket" << endl;
+			return;
+		}
+		string socket_path = string(socket_dir) + "/farm.sock";
+		
+		// the workers parse the same options, load the same scene and wait on the socket for tiles
+		vector<string> worker_command(options.command.begin(), options.command.end() - 1);
+		worker_command.push_back("-J");
+		worker_command.push_back(socket_path);
+		worker_command.push_back(options.command.back());
+		
+		grkt::farm_coordinator_t farm(&ctx, farm_key(options, ctx), rgb_buf, sample_buf);
+		bool listened = farm.render(socket_path.c_str(), worker_command, options.worker_count);
+		unlink(socket_path.c_str());
+		rmdir(socket_dir);
+		if (!listened) {
+			cerr << "Can not listen on " << socket_path << endl;
+			return;
+		}
+		
+		const grkt::farm_stat_t &stat = farm.stat;
+		printf("farm: %ld of %ld workers connected, %ld lost (%ld timed out), %ld batches of up to %ld tiles, %ld requeued, %ld rendered locally, %ld bytes received\n",
+			stat.workers_connected, stat.workers_started, stat.workers_lost, stat.workers_timed_out, stat.batch_count, stat.batch_size,
+			stat.requeued_batches, stat.local_batches, (size_t)stat.bytes_received);
+	} else {
+		render_frame(options, ctx, placement, rgb_buf, sample_buf, cost_buf, output_buf);
+	}
+	tick_count render_end = tick_count::now();
+	double render_sec = (render_end - render_start).seconds();
+	
+	printf("render: %ldx%ld, %d spp%s, %s sampler, packet size %ld, %ld tiles of %ldx%ld, %.3f sec\n",
+		ctx.screen.width, ctx.screen.height, ctx.sample_size, ctx.adaptive ? " max" : "", sampler_name(ctx.sampler), ctx.packet_size,
+		ctx.tiles.size(), ctx.tile_size, ctx.tile_size, render_sec);
+	print_traversal_counters(combined_traversal_counters());
+	
+	if (ctx.adaptive && !streaming) {
+		size_t total_samples = 0;
+		for (size_t i = 0; i < pixel_count; i++) 
+			total_samples += samples[i];
+		size_t fixed_samples = pixel_count * ctx.sample_size;
+		printf("adaptive: threshold %g, %ld samples (%.2f spp), fixed sampling would take %ld (%.1f%% saved)\n",
+			ctx.error_threshold, total_samples, (double)total_samples / pixel_count, fixed_samples,
+			100.0 * (1.0 - (double)total_samples / fixed_samples));
+		
+		if (options.compare_fixed) {
+			// render the same frame at the full budget, through the same path and placement, and measure how far the adaptive image is from it
+			grkt::context_t fixed_ctx = ctx;
+			fixed_ctx.adaptive = false;
+			vector<unsigned char> fixed_rgb(pixel_count * 3);
+			
+			tick_count fixed_start = tick_count::now();
+			render_frame(options, fixed_ctx, placement, &fixed_rgb[0], NULL, NULL, NULL);
+			double fixed_sec = (tick_count::now() - fixed_start).seconds();
+			
+			double squared_error = 0.0;
+			for (size_t i = 0; i < rgb.size(); i++) {
+				double d = ( (double)rgb[i] - (double)fixed_rgb[i] ) / 255.0;
+				squared_error += d * d;
+			}
+			printf("adaptive: fixed %d spp took %.3f sec, adaptive %.3f sec (%.3f sec saved), RMSE against fixed %.5f\n",
+				fixed_ctx.sample_size, fixed_sec, render_sec, fixed_sec - render_sec, sqrt(squared_error / rgb.size()));
+		}
+	}
+
+	if (streaming) {
+		if (!output.close())
+			cerr << "Writing " << options.output_filepath << " failed." << endl;
+		printf("output: %s, %s, %ld bytes streamed by tile\n", options.output_filepath,
+			(output.format == grkt::IMAGE_FORMAT_PFM) ? "pfm" : "ppm", (size_t)output.bytes_written);
+	} else {
+		write_image("out.ppm", rgb.data, ctx.screen.width, ctx.screen.height);
+	}
+	if (options.heatmap_filepath != NULL)
+		write_heatmap(options.heatmap_filepath, costs, ctx.screen.width, ctx.screen.height);
+}
+
+void render(const options_t &options) {
+	const char *ctm_filepath = options.ctm_filepath;
+
+	uint64_t cache_key = 0;
+	string cache_path;
+	bvh_cache_t cache;
+	bool cached = false;
+	bool instanced = (options.instance_count > 0);
+	if (options.use_cache) {
+		cache_key = bvh_cache_t::make_key(options.model_key, options.split_method, instanced ? 0 : 1);
+		cache_path = bvh_cache_t::path_for(ctm_filepath, cache_key);
+		cached = cache.open(cache_path.c_str(), cache_key);
+	}
+	
+	tick_count load_start = tick_count::now();
+	triangle_mesh_t mesh;
+	if (cached) {
+		cache.load_mesh(mesh);
+	} else if (!triangle_mesh_t::load(ctm_filepath, mesh)) {
+		cerr << "Loading .ctm file failed: " << ctm_filepath << endl;
+		return;
+	}
+	
+	tick_count refine_start = tick_count::now();
+	vector<shape_ref_t> shapes;
+	mesh.refine_to_triangles(shapes);
+	tick_count normals_start = tick_count::now();
+	if (!cached) {
+		// vertex normals come from the cache on a warm start
+		mesh.compute_vertex_normals();
+	}
+	tick_count normals_end = tick_count::now();
+	
+	printf("mesh: %ld vertices, %ld triangles, %s %.3f sec, refine %.3f sec, normals %.3f sec\n",
+		mesh.vertices.size(), mesh.indices.size() / 3, cached ? "cache" : "load", (refine_start - load_start).seconds(),
+		(normals_start - refine_start).seconds(), (normals_end - normals_start).seconds());
+
+	// with instancing the plane goes into the top level and this tree holds the mesh alone
+	shape_ref_t plane(new plane_t(vec3(0.0, 0.05, 0.0), vec3(0.0, 1.0, 0.0)));
+	if (!instanced)
+		shapes.push_back(plane);
+
+	bvh_tree_t bvh_tree(shapes, options.split_method);
+	if (cached && !cache.attach(bvh_tree)) {
+		cache.close();
+		cached = false;
+	}
+	
+	if (cached) {
+		tick_count load_end = tick_count::now();
+		printf("bvh: loaded %s, %ld shapes, %ld nodes, %.3f sec, SAH cost %.3f\n",
+			cache_path.c_str(), bvh_tree.shapes.size(), bvh_tree.total_node_count, (load_end - load_start).seconds(), bvh_tree.sah_cost());
+	} else {
+		tick_count build_start = tick_count::now();
+		bvh_tree.build();
+		size_t arena_bytes = bvh_tree.node_arena.memory_size();
+		bvh_tree.flatten();
+		tick_count build_end = tick_count::now();
+		
+		printf("bvh: %s build, %ld shapes, %ld nodes, %.3f sec, SAH cost %.3f, %ld arena bytes released after flattening\n",
+			split_name(options.split_method),
+			bvh_tree.shapes.size(), bvh_tree.total_node_count, (build_end - build_start).seconds(), bvh_tree.sah_cost(), arena_bytes);
+		
+		if (!cache_path.empty() && !bvh_cache_t::write(cache_path.c_str(), cache_key, mesh, bvh_tree)) {
+			cerr << "Writing BVH cache failed: " << cache_path << endl;
+		}
+	}
+	
+	size_t binary_bytes = bvh_tree.memory_size();
+	tick_count layout_start = tick_count::now();
+	bvh_tree.set_layout(options.layout);
+	tick_count layout_end = tick_count::now();
+	
+	size_t layout_bytes = bvh_tree.memory_size();
+	printf("bvh: %s layout, %ld bytes, %.1f bytes/shape (binary %ld bytes, %.1f bytes/shape), %.3f sec\n",
+		layout_name(options.layout), layout_bytes, (double)layout_bytes / bvh_tree.shapes.size(),
+		binary_bytes, (double)binary_bytes / bvh_tree.shapes.size(), (layout_end - layout_start).seconds());
+	
+	if (options.pack_triangles) {
+		tick_count pack_start = tick_count::now();
+		bvh_tree.pack_triangles();
+		tick_count pack_end = tick_count::now();
+		printf("bvh: packed triangle store, %ld bytes, %.3f sec\n", bvh_tree.triangle_store->memory_size(), (pack_end - pack_start).seconds());
+	}
+	
+	if (options.frame_count > 0)
+		animate(options.frame_count, mesh, bvh_tree);
+	
+	// view the mesh and the plane, wherever the other instances are
+	bbox_t view_bound = bvh_tree.bound();
+	view_bound.merge(plane->bound());
+	
+	const bvh_tree_t *scene_tree = &bvh_tree;
+	boost::scoped_ptr<bvh_tree_t> top_tree;
+	if (instanced) {
+		vector<shape_ref_t> instances;
+		make_instances(&bvh_tree, options.instance_count, instances);
+		instances.push_back(plane);
+		
+		top_tree.reset(new bvh_tree_t(instances, BVH_SPLIT_SAH));
+		tick_count top_start = tick_count::now();
+		top_tree->build();
+		top_tree->flatten();
+		tick_count top_end = tick_count::now();
+		scene_tree = top_tree.get();
+		
+		size_t object_bytes = bvh_tree.memory_size() + mesh.vertices.size() * 2 * sizeof(vec3) + mesh.indices.size() * sizeof(unsigned int)
+			+ ( (bvh_tree.triangle_store != NULL) ? bvh_tree.triangle_store->memory_size() : 0 );
+		size_t top_bytes = top_tree->memory_size() + options.instance_count * sizeof(instance_t);
+		printf("instances: %ld of %ld triangles, top level %ld nodes, %.3f sec, %ld bytes + %ld shared bytes (copying the mesh would take %ld bytes)\n",
+			options.instance_count, mesh.indices.size() / 3, top_tree->total_node_count, (top_end - top_start).seconds(),
+			top_bytes, object_bytes, object_bytes * options.instance_count);
+	}
+	
+	render_scene(options, scene_tree, view_bound);
+}
 
-	write_image(rgb, ctx.screen.width, ctx.screen.height);
+void render_out_of_core(const options_t &options) {
+	const char *ctm_filepath = options.ctm_filepath;
+	
+	uint64_t store_key = bvh_cache_t::make_key(options.model_key, options.split_method, 0);
+	string store_path = mesh_store_t::path_for(ctm_filepath, store_key);
+	
+	mesh_store_t store;
+	store.layout = options.layout;
+	store.pack_triangles = options.pack_triangles;
+	
+	tick_count load_start = tick_count::now();
+	bool stored = options.use_cache && store.open(store_path.c_str(), store_key, options.memory_budget);
+	if (!stored) {
+		// the mesh is only held while the store is written; rendering reads the chunks back on demand
+		triangle_mesh_t mesh;
+		if (!triangle_mesh_t::load(ctm_filepath, mesh)) {
+			cerr << "Loading .ctm file failed: " << ctm_filepath << endl;
+			return;
+		}
+		mesh.compute_vertex_normals();
+		
+		tick_count write_start = tick_count::now();
+		if (!mesh_store_t::write(store_path.c_str(), store_key, mesh, options.split_method, MESH_STORE_CHUNK_TRIANGLES)
+			|| !store.open(store_path.c_str(), store_key, options.memory_budget)) {
+			cerr << "Writing mesh store failed: " << store_path << endl;
+			return;
+		}
+		printf("mesh: %ld vertices, %ld triangles, load %.3f sec, %s build and write %.3f sec\n",
+			mesh.vertices.size(), mesh.indices.size() / 3, (write_start - load_start).seconds(),
+			split_name(options.split_method), (tick_count::now() - write_start).seconds());
+	}
+	tick_count load_end = tick_count::now();
+	
+	vector<shape_ref_t> chunk_shapes;
+	store.make_shapes(chunk_shapes);
+	
+	bbox_t view_bound;
+	for (size_t i = 0; i < chunk_shapes.size(); i++)
+		view_bound.merge(chunk_shapes[i]->bound());
+	
+	shape_ref_t plane(new plane_t(vec3(0.0, 0.05, 0.0), vec3(0.0, 1.0, 0.0)));
+	view_bound.merge(plane->bound());
+	chunk_shapes.push_back(plane);
+	
+	bvh_tree_t top_tree(chunk_shapes, BVH_SPLIT_SAH);
+	top_tree.build();
+	top_tree.flatten();
+	
+	printf("out-of-core: %s, %ld triangles in %ld chunks of up to %ld, %ld file bytes, %s %.3f sec, top level %ld nodes, budget %ld bytes\n",
+		store_path.c_str(), (size_t)store.header->triangle_count, store.chunk_count(), MESH_STORE_CHUNK_TRIANGLES, store.size,
+		stored ? "opened" : "written", (load_end - load_start).seconds(), top_tree.total_node_count, store.budget);
+	
+	render_scene(options, &top_tree, view_bound);
+	
+	const mesh_store_stat_t &stat = store.stat;
+	printf("out-of-core: %ld page faults (%ld bytes read), %ld hits, %ld evictions, %ld of %ld chunks resident in %ld bytes, peak %ld bytes\n",
+		(size_t)stat.faults, (size_t)stat.paged_bytes, (size_t)stat.hits, (size_t)stat.evictions,
+		(size_t)stat.resident_chunks, store.chunk_count(), (size_t)stat.resident_bytes, (size_t)stat.peak_resident_bytes);
+}
+
+void usage() {
+	cerr << "usage: main [-b middle|sah|lbvh|hlbvh] [-l binary|compact|bvh4|bvh8|qbvh4] [-p 1|4|8|16] [-t tile_size] [-n spp] [-s random|pcg|sobol|bluenoise] [-a threshold [-C]] [-i instances | -A frames] [-W batch] [-o out.ppm|out.pfm] [-M megabytes] [-L lights] [-F frames] [-K keyframes.txt] [-P workers | -J socket] [-T threads] [-N pin|replicate] [-G] [-H heatmap.ppm] [-S] [-V] [-R] file.ctm" << endl;
+	cerr << "  -b  BVH split method; lbvh sorts by Morton code, hlbvh adds SAH over the top levels" << endl;
+	cerr << "  -l  BVH node layout used for traversal; qbvh4 stores 4 child boxes as 8-bit offsets in one cache line" << endl;
+	cerr << "  -p  trace primary rays in packets of adjacent pixels" << endl;
+	cerr << "  -t  edge length of the square tiles handed to worker threads (default 16)" << endl;
+	cerr << "  -n  samples per pixel, the per-pixel maximum with -a (default 4)" << endl;
+	cerr << "  -s  sample numbers: a PCG32 stream per pixel (default), a counter hash, scrambled Sobol, or Sobol spread as blue noise" << endl;
+	cerr << "  -a  adaptive sampling; stop a pixel once the standard error of its mean is below threshold" << endl;
+	cerr << "  -C  with -a, also render with fixed sampling and report time saved and RMSE" << endl;
+	cerr << "  -i  render this many copies of the mesh as instances of one shared BVH" << endl;
+	cerr << "  -A  deform the mesh over this many frames, refitting the BVH, and render the last one" << endl;
+	cerr << "  -W  render in stages (generate, sort, intersect, shade, shadow) over batches of this many pixels" << endl;
+	cerr << "  -o  stream finished tiles to this file (.pfm for float radiance) instead of writing out.ppm at the end" << endl;
+	cerr << "  -M  keep the mesh out of core in chunks (file.ctm.<key>.ooc), paging chunk BVHs in under this memory budget; the run that writes the store still loads the whole mesh" << endl;
+	cerr << "  -L  light the scene with this many small sphere lights, one picked per sample by a light tree" << endl;
+	cerr << "  -F  render a sequence of this many frames to frame_NNNN.ppm, orbiting the scene unless -K is given" << endl;
+	cerr << "  -K  move the camera through keyframes, lines of \"eye_x eye_y eye_z center_x center_y center_z\" about the scene center" << endl;
+	cerr << "  -P  hand the tiles out to this many worker processes over a Unix-domain socket, requeueing those of a lost worker" << endl;
+	cerr << "  -J  work for the coordinator listening on socket, rendering the tiles it sends; -P starts these itself" << endl;
+	cerr << "  -T  render in a task_arena of this many threads instead of the default scheduler" << endl;
+	cerr << "  -N  bind threads to cores node by node, each NUMA node rendering and first touching its own share of the tiles; replicate also copies the BVH to every node" << endl;
+	cerr << "  -G  before rendering, report render time from 1 thread up to every core" << endl;
+	cerr << "  -H  also write the per-pixel traversal cost (nodes visited + primitives tested) as an image" << endl;
+	cerr << "  -S  run the primary/shadow ray benchmark instead of rendering" << endl;
+	cerr << "  -V  intersect leaves through virtual shape calls instead of the packed triangle store" << endl;
+	cerr << "  -R  do not read or write the BVH cache (file.ctm.<key>.bvh); with -M, write the mesh store again" << endl;
 }
 
 int main(int argc, char** argv) {
-	if (argc != 2) {
+	options_t options;
+	
+	int c;
+	while ((c = getopt(argc, argv, "a:b:i:l:n:o:p:s:t:A:CF:GH:J:K:L:M:N:P:RST:VW:")) != -1) {
+		switch (c) {
+			case 'b': {
+				if (strcmp(optarg, "sah") == 0) {
+					options.split_method = BVH_SPLIT_SAH;
+				} else if (strcmp(optarg, "middle") == 0) {
+					options.split_method = BVH_SPLIT_MIDDLE;
+				} else if (strcmp(optarg, "lbvh") == 0) {
+					options.split_method = BVH_SPLIT_LBVH;
+				} else if (strcmp(optarg, "hlbvh") == 0) {
+					options.split_method = BVH_SPLIT_HLBVH;
+				} else {
+					usage();
+					return -1;
+				}
+				break;
+			}
+			case 'i': {
+				int n = atoi(optarg);
+				if (n < 1) {
+					usage();
+					return -1;
+				}
+				options.instance_count = n;
+				break;
+			}
+			case 'l': {
+				if (strcmp(optarg, "binary") == 0) {
+					options.layout = BVH_LAYOUT_BINARY;
+				} else if (strcmp(optarg, "compact") == 0) {
+					options.layout = BVH_LAYOUT_COMPACT;
+				} else if (strcmp(optarg, "bvh4") == 0) {
+					options.layout = BVH_LAYOUT_WIDE4;
+				} else if (strcmp(optarg, "bvh8") == 0) {
+					options.layout = BVH_LAYOUT_WIDE8;
+				} else if (strcmp(optarg, "qbvh4") == 0) {
+					options.layout = BVH_LAYOUT_QUANTIZED;
+				} else {
+					usage();
+					return -1;
+				}
+				break;
+			}
+			case 'o': {
+				options.output_filepath = optarg;
+				break;
+			}
+			case 'p': {
+				int n = atoi(optarg);
+				if (n != 1 && n != 4 && n != 8 && n != 16) {
+					usage();
+					return -1;
+				}
+				options.packet_size = n;
+				break;
+			}
+			case 's': {
+				if (strcmp(optarg, "random") == 0) {
+					options.sampler = SAMPLER_RANDOM;
+				} else if (strcmp(optarg, "pcg") == 0) {
+					options.sampler = SAMPLER_PCG_HASH;
+				} else if (strcmp(optarg, "sobol") == 0) {
+					options.sampler = SAMPLER_SOBOL;
+				} else if (strcmp(optarg, "bluenoise") == 0) {
+					options.sampler = SAMPLER_BLUE_NOISE;
+				} else {
+					usage();
+					return -1;
+				}
+				break;
+			}
+			case 't': {
+				int n = atoi(optarg);
+				if (n < 1) {
+					usage();
+					return -1;
+				}
+				options.tile_size = n;
+				break;
+			}
+			case 'n': {
+				int n = atoi(optarg);
+				if (n < 1 || n > 65535) {
+					usage();
+					return -1;
+				}
+				options.sample_size = n;
+				break;
+			}
+			case 'a': {
+				options.error_threshold = atof(optarg);
+				if (options.error_threshold <= 0.0f) {
+					usage();
+					return -1;
+				}
+				break;
+			}
+			case 'A': {
+				options.frame_count = atoi(optarg);
+				if (options.frame_count < 1) {
+					usage();
+					return -1;
+				}
+				break;
+			}
+			case 'C': {
+				options.compare_fixed = true;
+				break;
+			}
+			case 'F': {
+				int n = atoi(optarg);
+				if (n < 1) {
+					usage();
+					return -1;
+				}
+				options.sequence_length = n;
+				break;
+			}
+			case 'G': {
+				options.scaling_report = true;
+				break;
+			}
+			case 'H': {
+				options.heatmap_filepath = optarg;
+				break;
+			}
+			case 'J': {
+				options.farm_socket = optarg;
+				break;
+			}
+			case 'K': {
+				options.camera_path_filepath = optarg;
+				break;
+			}
+			case 'L': {
+				int n = atoi(optarg);
+				if (n < 1) {
+					usage();
+					return -1;
+				}
+				options.light_count = n;
+				break;
+			}
+			case 'M': {
+				int n = atoi(optarg);
+				if (n < 1) {
+					usage();
+					return -1;
+				}
+				options.memory_budget = (size_t)n << 20;
+				break;
+			}
+			case 'N': {
+				if (strcmp(optarg, "pin") == 0) {
+					options.pin_threads = true;
+				} else if (strcmp(optarg, "replicate") == 0) {
+					options.pin_threads = true;
+					options.replicate_bvh = true;
+				} else {
+					usage();
+					return -1;
+				}
+				break;
+			}
+			case 'P': {
+				int n = atoi(optarg);
+				if (n < 1) {
+					usage();
+					return -1;
+				}
+				options.worker_count = n;
+				break;
+			}
+			case 'R': {
+				options.use_cache = false;
+				break;
+			}
+			case 'S': {
+				options.shadow_benchmark = true;
+				break;
+			}
+			case 'T': {
+				int n = atoi(optarg);
+				if (n < 1) {
+					usage();
+					return -1;
+				}
+				options.thread_count = n;
+				break;
+			}
+			case 'V': {
+				options.pack_triangles = false;
+				break;
+			}
+			case 'W': {
+				int n = atoi(optarg);
+				if (n < 1) {
+					usage();
+					return -1;
+				}
+				options.wavefront_batch = n;
+				break;
+			}
+			default: {
+				usage();
+				return -1;
+			}
+		}
+	}
+	
+	if (optind + 1 != argc) {
 		cerr << "CTM file required." << endl;
+		usage();
+		return -1;
+	}
+	
+	if (options.instance_count > 0 && options.frame_count > 0) {
+		// instance bounds are taken when the top level is built
+		cerr << "-i and -A can not be combined." << endl;
+		usage();
 		return -1;
 	}
 	
-	const char *ctm_filepath = argv[1];
+	if (options.wavefront_batch > 0 && options.packet_size > 1) {
+		// a wavefront stage traces its sorted rays one at a time
+		cerr << "-W and -p can not be combined." << endl;
+		usage();
+		return -1;
+	}
+	
+	if (options.output_filepath != NULL && options.compare_fixed) {
+		// the comparison needs the whole adaptive frame in memory
+		cerr << "-o and -C can not be combined." << endl;
+		usage();
+		return -1;
+	}
+	
+	if (options.memory_budget > 0 && ( options.instance_count > 0 || options.frame_count > 0 )) {
+		// chunks are read-only and the top level holds the chunks themselves
+		cerr << "-M can not be combined with -i or -A." << endl;
+		usage();
+		return -1;
+	}
+	
+	bool sequence = (options.sequence_length > 0 || options.camera_path_filepath != NULL);
+	if (sequence && ( options.output_filepath != NULL || options.compare_fixed || options.heatmap_filepath != NULL || options.shadow_benchmark )) {
+		// every frame goes to its own frame_NNNN.ppm
+		cerr << "-F and -K can not be combined with -o, -C, -H or -S." << endl;
+		usage();
+		return -1;
+	}
 	
-	render(ctm_filepath);
+	bool farm = (options.worker_count > 0 || options.farm_socket != NULL);
+	bool placed = (options.thread_count > 0 || options.pin_threads || options.scaling_report);
+	if (farm && ( sequence || placed || options.output_filepath != NULL || options.compare_fixed || options.heatmap_filepath != NULL
+		|| options.shadow_benchmark || options.wavefront_batch > 0 )) {
+		// workers render whole tiles of one frame and send back only their pixels, on the default scheduler
+		cerr << "-P and -J can not be combined with -F, -K, -T, -N, -G, -o, -C, -H, -S or -W." << endl;
+		usage();
+		return -1;
+	}
+	
+	if (options.scaling_report && sequence) {
+		cerr << "-G and -F or -K can not be combined." << endl;
+		usage();
+		return -1;
+	}
+	
+	options.ctm_filepath = argv[optind];
+	// getopt has moved the file name to the end
+	options.command.assign(argv, argv + argc);
+	if (!bvh_cache_t::model_key(options.ctm_filepath, &options.model_key)) {
+		cerr << "Can not read " << options.ctm_filepath << endl;
+		return -1;
+	}
+	
+	if (options.memory_budget > 0) {
+		render_out_of_core(options);
+	} else {
+		render(options);
+	}
 	
 	return 0;
 }
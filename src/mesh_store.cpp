@@ -0,0 +1,458 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mesh_store.hpp"
+#include "bvh_cache.hpp"
+
+using namespace std;
+using namespace glm;
+using namespace tbb;
+
+static const char MESH_STORE_MAGIC[8] = { 'A', 'N', 'D', 'O', 'N', 'O', 'O', 'C' };
+static const uint32_t MESH_STORE_VERSION = 1;
+static const uint64_t MESH_STORE_ALIGNMENT = 64;
+static const uint64_t MESH_STORE_PAGE_SIZE = 4096;
+
+
+static uint64_t align_up(uint64_t offset, uint64_t alignment) {
+	return ( offset + alignment - 1 ) & ~( alignment - 1 );
+}
+
+static bool write_at(FILE *fp, uint64_t offset, const void *p, size_t n) {
+	if (fseek(fp, (long)offset, SEEK_SET) != 0)
+		return false;
+	return ( n == 0 ) || ( fwrite(p, 1, n, fp) == n );
+}
+
+struct chunk_range_t {
+	size_t start;
+	size_t end;
+
+	chunk_range_t(size_t s, size_t e) : start(s), end(e) { }
+
+};
+
+struct centroid_comparator_t {
+	const vector<vec3> *centroids;
+	int dim;
+
+	centroid_comparator_t(const vector<vec3> *c, int d) : centroids(c), dim(d) { }
+
+	bool operator()(unsigned int a, unsigned int b) const {
+		return (*centroids)[a][dim] < (*centroids)[b][dim];
+	}
+
+};
+
+// median splits along the longest axis of the centroid bounds, so chunks are compact and about equally full
+static void partition_chunks(const vector<vec3> &centroids, vector<unsigned int> &order, size_t chunk_triangles, vector<chunk_range_t> &ranges) {
+	vector<chunk_range_t> todo;
+	todo.push_back(chunk_range_t(0, order.size()));
+	while (!todo.empty()) {
+		chunk_range_t range = todo.back();
+		todo.pop_back();
+		if (range.end - range.start <= chunk_triangles) {
+			ranges.push_back(range);
+			continue;
+		}
+
+		bbox_t centroid_bound;
+		for (size_t i = range.start; i < range.end; i++)
+			centroid_bound.merge(centroids[order[i]]);
+		int dim = centroid_bound.maximum_extent();
+
+		size_t mid = ( range.start + range.end ) / 2;
+		nth_element(order.begin() + range.start, order.begin() + mid, order.begin() + range.end, centroid_comparator_t(&centroids, dim));
+
+		// the lower half is taken first, so chunks are written in a depth-first spatial order
+		todo.push_back(chunk_range_t(mid, range.end));
+		todo.push_back(chunk_range_t(range.start, mid));
+	}
+}
+
+
+mesh_chunk_shape_t::mesh_chunk_shape_t(mesh_store_t *s, size_t i) : store(s), chunk(i) {
+	__bbox = store->records[chunk].bound;
+}
+
+vec3 mesh_chunk_shape_t::normal(const vec3 &p) const {
+	// which triangle was hit is only known per intersection, see shading_normal(); without one, the bound's outward direction
+	vec3 d = p - 0.5f * ( __bbox.min_point + __bbox.max_point );
+	float l = length(d);
+	return ( l > 0.0f ) ? d / l : vec3(0.0f, 1.0f, 0.0f);
+}
+
+vec3 mesh_chunk_shape_t::shading_normal(const vec3 &p, const isect_t &isect) const {
+	const mesh_chunk_t &c = store->acquire(chunk);
+	vec3 n = triangle_t(c.mesh, isect.object_index).normal(p);
+	store->release(chunk);
+	return n;
+}
+
+bool mesh_chunk_shape_t::intersect(const ray_t &ray, isect_t &isect) const {
+	// the binary top level culls only against ray.tmax, so a chunk behind the nearest hit is skipped here, before it is paged in
+	ray_t clipped = ray;
+	clipped.tmax = std::min(ray.tmax, isect.t);
+	vec3 inv_direction = 1.0f / ray.direction;
+	ivec3 sign = ivec3(inv_direction.x < 0.0f, inv_direction.y < 0.0f, inv_direction.z < 0.0f);
+	if (!__bbox.intersect(clipped, sign, inv_direction))
+		return false;
+
+	const mesh_chunk_t &c = store->acquire(chunk);
+	isect_t chunk_isect;
+	chunk_isect.t = isect.t;
+	bool hit = c.tree->intersect(ray, chunk_isect);
+	if (hit) {
+		const triangle_t *triangle = static_cast<const triangle_t *>(chunk_isect.shape);
+		isect.t = chunk_isect.t;
+		isect.shape = this;
+		isect.object_shape = NULL;
+		isect.object_index = ( triangle->indices - &c.mesh->indices[0] ) / 3;
+	}
+	store->release(chunk);
+	return hit;
+}
+
+bool mesh_chunk_shape_t::occluded(const ray_t &ray) const {
+	const mesh_chunk_t &c = store->acquire(chunk);
+	bool blocked = c.tree->occluded(ray);
+	store->release(chunk);
+	return blocked;
+}
+
+
+mesh_store_t::mesh_store_t() : data(NULL), size(0), header(NULL), records(NULL), chunks(NULL), budget(0), layout(BVH_LAYOUT_BINARY), pack_triangles(true), clock(0) { }
+
+mesh_store_t::~mesh_store_t() {
+	close();
+}
+
+string mesh_store_t::path_for(const char *ctm_filepath, uint64_t key) {
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".%016llx.ooc", (unsigned long long)key);
+	return string(ctm_filepath) + suffix;
+}
+
+bool mesh_store_t::write(const char *path, uint64_t key, const triangle_mesh_t &mesh, bvh_split_method_t method, size_t chunk_triangles) {
+	size_t triangle_count = mesh.indices.size() / 3;
+	if (triangle_count == 0 || chunk_triangles == 0)
+		return false;
+
+	vector<vec3> centroids(triangle_count);
+	vector<unsigned int> order(triangle_count);
+	for (size_t i = 0; i < triangle_count; i++) {
+		const unsigned int *indices = &mesh.indices[3 * i];
+		centroids[i] = ( mesh.vertices[indices[0]] + mesh.vertices[indices[1]] + mesh.vertices[indices[2]] ) / 3.0f;
+		order[i] = i;
+	}
+	vector<chunk_range_t> ranges;
+	partition_chunks(centroids, order, chunk_triangles, ranges);
+
+	mesh_store_header_t h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MESH_STORE_MAGIC, sizeof(h.magic));
+	h.version = MESH_STORE_VERSION;
+	h.node_size = sizeof(bvh_linear_node_t);
+	h.key = key;
+	h.triangle_count = triangle_count;
+	h.chunk_count = ranges.size();
+	h.chunk_offset = align_up(sizeof(h), MESH_STORE_ALIGNMENT);
+
+	// write next to the final name and rename, so a concurrent reader never maps a partial file
+	string tmp_path;
+	FILE *fp = bvh_cache_t::create_temp(path, tmp_path);
+	if (fp == NULL)
+		return false;
+
+	// one chunk at a time: only the chunk being built is held besides the input mesh, which is loaded whole
+	vector<mesh_chunk_record_t> records(ranges.size());
+	uint64_t offset = align_up(h.chunk_offset + records.size() * sizeof(mesh_chunk_record_t), MESH_STORE_PAGE_SIZE);
+	bool ok = true;
+	for (size_t k = 0; k < ranges.size() && ok; k++) {
+		// the chunk's vertices in mesh order; looking them up keeps the map the size of the chunk, not of the mesh
+		triangle_mesh_t chunk_mesh;
+		vector<unsigned int> global_index;
+		global_index.reserve(3 * ( ranges[k].end - ranges[k].start ));
+		for (size_t i = ranges[k].start; i < ranges[k].end; i++) {
+			const unsigned int *indices = &mesh.indices[3 * order[i]];
+			global_index.insert(global_index.end(), indices, indices + 3);
+		}
+		sort(global_index.begin(), global_index.end());
+		global_index.erase(unique(global_index.begin(), global_index.end()), global_index.end());
+		chunk_mesh.vertices.reserve(global_index.size());
+		chunk_mesh.normals.reserve(global_index.size());
+		for (size_t i = 0; i < global_index.size(); i++) {
+			chunk_mesh.vertices.push_back(mesh.vertices[global_index[i]]);
+			chunk_mesh.normals.push_back(mesh.normals[global_index[i]]);
+		}
+		chunk_mesh.indices.reserve(3 * ( ranges[k].end - ranges[k].start ));
+		for (size_t i = ranges[k].start; i < ranges[k].end; i++) {
+			const unsigned int *indices = &mesh.indices[3 * order[i]];
+			for (int c = 0; c < 3; c++)
+				chunk_mesh.indices.push_back(lower_bound(global_index.begin(), global_index.end(), indices[c]) - global_index.begin());
+		}
+
+		// vertex normals come from the whole mesh, so shading is seamless across chunk borders
+		vector<shape_ref_t> shapes;
+		chunk_mesh.refine_to_triangles(shapes);
+		bvh_tree_t tree(shapes, method);
+		tree.build();
+		tree.flatten();
+
+		mesh_chunk_record_t &r = records[k];
+		r.bound = tree.nodes[0].bounds;
+		r.vertex_count = chunk_mesh.vertices.size();
+		r.index_count = chunk_mesh.indices.size();
+		r.node_count = tree.total_node_count;
+		r.offset = offset;
+		r.node_offset = offset;
+		r.vertex_offset = align_up(r.node_offset + r.node_count * sizeof(bvh_linear_node_t), MESH_STORE_PAGE_SIZE);
+		r.normal_offset = align_up(r.vertex_offset + r.vertex_count * sizeof(vec3), MESH_STORE_ALIGNMENT);
+		r.index_offset = align_up(r.normal_offset + r.vertex_count * sizeof(vec3), MESH_STORE_ALIGNMENT);
+		r.shape_index_offset = align_up(r.index_offset + r.index_count * sizeof(unsigned int), MESH_STORE_ALIGNMENT);
+		offset = align_up(r.shape_index_offset + tree.shapes.size() * sizeof(unsigned int), MESH_STORE_PAGE_SIZE);
+		r.size = offset - r.offset;
+
+		ok = write_at(fp, r.node_offset, tree.nodes, r.node_count * sizeof(bvh_linear_node_t))
+			&& write_at(fp, r.vertex_offset, &chunk_mesh.vertices[0], r.vertex_count * sizeof(vec3))
+			&& write_at(fp, r.normal_offset, &chunk_mesh.normals[0], r.vertex_count * sizeof(vec3))
+			&& write_at(fp, r.index_offset, &chunk_mesh.indices[0], r.index_count * sizeof(unsigned int))
+			&& write_at(fp, r.shape_index_offset, &tree.shape_indices[0], tree.shapes.size() * sizeof(unsigned int));
+	}
+
+	ok = ok && write_at(fp, h.chunk_offset, &records[0], records.size() * sizeof(mesh_chunk_record_t))
+		&& write_at(fp, 0, &h, sizeof(h));
+
+	// the last chunk is padded to a whole page as well
+	if (ok && ftruncate(fileno(fp), offset) != 0)
+		ok = false;
+	if (fclose(fp) != 0)
+		ok = false;
+	if (ok && rename(tmp_path.c_str(), path) != 0)
+		ok = false;
+	if (!ok)
+		unlink(tmp_path.c_str());
+	return ok;
+}
+
+bool mesh_store_t::open(const char *path, uint64_t key, size_t budget_bytes) {
+	close();
+
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(mesh_store_header_t)) {
+		::close(fd);
+		return false;
+	}
+
+	void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (p == MAP_FAILED)
+		return false;
+
+	data = p;
+	size = st.st_size;
+	header = (const mesh_store_header_t *)data;
+
+	const mesh_store_header_t &h = *header;
+	bool valid = memcmp(h.magic, MESH_STORE_MAGIC, sizeof(h.magic)) == 0
+		&& h.version == MESH_STORE_VERSION
+		&& h.node_size == sizeof(bvh_linear_node_t)
+		&& h.key == key
+		&& h.chunk_count > 0
+		&& bvh_cache_t::fits(h.chunk_offset, h.chunk_count, sizeof(mesh_chunk_record_t), size);
+	if (!valid) {
+		close();
+		return false;
+	}
+
+	// every chunk is checked once here, since a chunk is paged in, and its nodes traversed in place, in the middle of a frame;
+	// the pages read for it are dropped again, so opening leaves nothing resident
+	madvise(data, size, MADV_SEQUENTIAL);
+	records = (const mesh_chunk_record_t *)at(h.chunk_offset);
+	for (size_t i = 0; i < h.chunk_count; i++) {
+		const mesh_chunk_record_t &r = records[i];
+		valid = bvh_cache_t::fits(r.offset, r.size, 1, size)
+			&& r.index_count > 0
+			&& bvh_cache_t::fits(r.node_offset, r.node_count, sizeof(bvh_linear_node_t), size)
+			&& bvh_cache_t::fits(r.vertex_offset, r.vertex_count, sizeof(vec3), size)
+			&& bvh_cache_t::fits(r.normal_offset, r.vertex_count, sizeof(vec3), size)
+			&& bvh_cache_t::fits(r.index_offset, r.index_count, sizeof(unsigned int), size)
+			&& bvh_cache_t::fits(r.shape_index_offset, r.index_count / 3, sizeof(unsigned int), size)
+			&& bvh_cache_t::valid_tree((const unsigned int *)at(r.index_offset), r.index_count, r.vertex_count,
+				(const unsigned int *)at(r.shape_index_offset), r.index_count / 3, (const bvh_linear_node_t *)at(r.node_offset), r.node_count);
+		if (!valid) {
+			close();
+			return false;
+		}
+		madvise((char *)data + r.offset, r.size, MADV_DONTNEED);
+	}
+
+	// chunks are read where rays go, not front to back
+	madvise(data, size, MADV_RANDOM);
+
+	chunks = new mesh_chunk_t[h.chunk_count];
+	budget = budget_bytes;
+	stat = mesh_store_stat_t();
+	clock = 0;
+	return true;
+}
+
+void mesh_store_t::close() {
+	if (chunks != NULL) {
+		for (size_t i = 0; i < header->chunk_count; i++) {
+			delete chunks[i].tree;
+			delete chunks[i].mesh;
+		}
+		delete [] chunks;
+	}
+	chunks = NULL;
+
+	if (data != NULL)
+		munmap(data, size);
+	data = NULL;
+	size = 0;
+	header = NULL;
+	records = NULL;
+}
+
+void mesh_store_t::make_shapes(vector<shape_ref_t> &shapes) {
+	for (size_t i = 0; i < chunk_count(); i++) {
+		shapes.push_back(shape_ref_t(new mesh_chunk_shape_t(this, i)));
+	}
+}
+
+void mesh_store_t::load(size_t i, mesh_chunk_t &chunk) const {
+	const mesh_chunk_record_t &r = records[i];
+
+	const vec3 *vertices = (const vec3 *)at(r.vertex_offset);
+	const vec3 *normals = (const vec3 *)at(r.normal_offset);
+	const unsigned int *indices = (const unsigned int *)at(r.index_offset);
+	const unsigned int *order = (const unsigned int *)at(r.shape_index_offset);
+
+	triangle_mesh_t *mesh = new triangle_mesh_t();
+	mesh->vertices.assign(vertices, vertices + r.vertex_count);
+	mesh->normals.assign(normals, normals + r.vertex_count);
+	mesh->indices.assign(indices, indices + r.index_count);
+
+	vector<shape_ref_t> shapes;
+	mesh->refine_to_triangles(shapes);
+	bvh_tree_t *tree = new bvh_tree_t(shapes);
+	tree->attach((bvh_linear_node_t *)at(r.node_offset), r.node_count, order);
+	tree->set_layout(layout);
+	if (pack_triangles)
+		tree->pack_triangles();
+
+	// the mesh was copied out of the mapping; only the nodes are read from it from now on
+	madvise((void *)at(r.vertex_offset), r.offset + r.size - r.vertex_offset, MADV_DONTNEED);
+
+	size_t triangle_count = r.index_count / 3;
+	chunk.mesh = mesh;
+	chunk.tree = tree;
+	chunk.resident_bytes = 2 * r.vertex_count * sizeof(vec3) + r.index_count * sizeof(unsigned int)
+		+ triangle_count * ( sizeof(triangle_t) + sizeof(shape_ref_t) + sizeof(unsigned int) )
+		+ r.node_count * sizeof(bvh_linear_node_t)
+		+ ( (layout != BVH_LAYOUT_BINARY) ? tree->memory_size() : 0 )
+		+ ( (tree->triangle_store != NULL) ? tree->triangle_store->memory_size() : 0 );
+}
+
+const mesh_chunk_t& mesh_store_t::acquire(size_t i) {
+	mesh_chunk_t &c = chunks[i];
+	{
+		spin_mutex::scoped_lock lock(c.mutex);
+		if (c.tree != NULL) {
+			__sync_fetch_and_add(&c.pins, 1);
+			c.last_used = __sync_add_and_fetch(&clock, 1);
+			__sync_fetch_and_add(&stat.hits, 1);
+			return c;
+		}
+	}
+
+	// paged in without the lock: building the chunk runs parallel loops, and a thread waiting
+	// in one may pick up a tile that needs this very chunk
+	mesh_chunk_t loaded;
+	load(i, loaded);
+
+	bool published = false;
+	{
+		spin_mutex::scoped_lock lock(c.mutex);
+		if (c.tree == NULL) {
+			c.mesh = loaded.mesh;
+			c.tree = loaded.tree;
+			c.resident_bytes = loaded.resident_bytes;
+			published = true;
+		}
+		__sync_fetch_and_add(&c.pins, 1);
+		c.last_used = __sync_add_and_fetch(&clock, 1);
+	}
+
+	if (!published) {
+		// another thread paged the chunk in first
+		delete loaded.tree;
+		delete loaded.mesh;
+		__sync_fetch_and_add(&stat.hits, 1);
+		return c;
+	}
+
+	__sync_fetch_and_add(&stat.faults, 1);
+	__sync_fetch_and_add(&stat.paged_bytes, records[i].size);
+	__sync_fetch_and_add(&stat.resident_chunks, 1);
+	uint64_t resident = __sync_add_and_fetch(&stat.resident_bytes, (uint64_t)c.resident_bytes);
+	uint64_t peak = stat.peak_resident_bytes;
+	while (resident > peak && !__sync_bool_compare_and_swap(&stat.peak_resident_bytes, peak, resident))
+		peak = stat.peak_resident_bytes;
+
+	if (resident > budget)
+		evict();
+	return c;
+}
+
+void mesh_store_t::release(size_t i) {
+	__sync_fetch_and_sub(&chunks[i].pins, 1);
+}
+
+void mesh_store_t::evict() {
+	spin_mutex::scoped_lock lock(eviction_mutex);
+	while (stat.resident_bytes > budget) {
+		// least recently used first; the timestamps are read unlocked and checked again under the chunk lock
+		size_t victim = chunk_count();
+		uint64_t oldest = ~(uint64_t)0;
+		for (size_t i = 0; i < chunk_count(); i++) {
+			const mesh_chunk_t &c = chunks[i];
+			if (c.tree != NULL && c.pins == 0 && c.last_used < oldest) {
+				oldest = c.last_used;
+				victim = i;
+			}
+		}
+		if (victim == chunk_count()) {
+			// every resident chunk is being traversed; stay over budget until one is released
+			break;
+		}
+
+		mesh_chunk_t &c = chunks[victim];
+		spin_mutex::scoped_lock chunk_lock(c.mutex);
+		if (c.tree == NULL || c.pins != 0)
+			continue;
+
+		delete c.tree;
+		delete c.mesh;
+		c.tree = NULL;
+		c.mesh = NULL;
+
+		const mesh_chunk_record_t &r = records[victim];
+		madvise((void *)at(r.offset), r.size, MADV_DONTNEED);
+
+		__sync_fetch_and_sub(&stat.resident_bytes, (uint64_t)c.resident_bytes);
+		__sync_fetch_and_sub(&stat.resident_chunks, 1);
+		__sync_fetch_and_add(&stat.evictions, 1);
+		c.resident_bytes = 0;
+	}
+}
@@ -0,0 +1,140 @@
+#ifndef MESH_STORE_HPP
+#define MESH_STORE_HPP
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <tbb/spin_mutex.h>
+
+#include "triangle_mesh.hpp"
+#include "bvh.hpp"
+
+
+// On-disk layout: the header, the chunk table, then each chunk's arrays. Every chunk starts
+// on a page boundary, so dropping one chunk's pages never touches its neighbours.
+struct mesh_store_header_t {
+	char magic[8];
+	uint32_t version;
+	uint32_t node_size;       // sizeof(bvh_linear_node_t) of the writer
+	uint64_t key;
+	uint64_t triangle_count;
+	uint64_t chunk_count;
+	uint64_t chunk_offset;    // chunk_count mesh_chunk_record_t
+
+};
+
+struct mesh_chunk_record_t {
+	bbox_t bound;
+	uint64_t vertex_count;
+	uint64_t index_count;
+	uint64_t node_count;
+	uint64_t offset;          // first byte of the chunk, page aligned
+	uint64_t size;            // bytes up to the next chunk
+	uint64_t vertex_offset;   // vertices and normals, vertex_count vec3 each
+	uint64_t normal_offset;
+	uint64_t index_offset;
+	uint64_t shape_index_offset;
+	uint64_t node_offset;
+
+};
+
+// A chunk as it is held in memory: its own small mesh, triangles and BVH, the nodes traversed in place in the mapping.
+struct mesh_chunk_t {
+	tbb::spin_mutex mutex;    // held while the chunk is paged in or evicted
+	triangle_mesh_t *mesh;
+	bvh_tree_t *tree;
+	size_t resident_bytes;
+	int pins;                 // traversals in flight; a pinned chunk is never evicted
+	uint64_t last_used;
+
+	mesh_chunk_t() : mesh(NULL), tree(NULL), resident_bytes(0), pins(0), last_used(0) { }
+
+};
+
+struct mesh_store_stat_t {
+	uint64_t faults;          // chunks paged in
+	uint64_t hits;            // chunk accesses that found the chunk resident
+	uint64_t evictions;
+	uint64_t paged_bytes;     // file bytes of the chunks paged in
+	uint64_t resident_bytes;
+	uint64_t peak_resident_bytes;
+	uint64_t resident_chunks;
+
+	mesh_store_stat_t() : faults(0), hits(0), evictions(0), paged_bytes(0), resident_bytes(0), peak_resident_bytes(0), resident_chunks(0) { }
+
+};
+
+// A mesh split into spatially compact chunks, each with its own BVH, in a memory-mapped file.
+// Only the chunk table stays in memory; a chunk is paged in the first time a ray reaches its bound
+// and the least recently used chunks are evicted once the resident ones exceed the budget.
+struct mesh_store_t {
+	void *data;
+	size_t size;
+	const mesh_store_header_t *header;
+	const mesh_chunk_record_t *records;
+	mesh_chunk_t *chunks;
+	size_t budget;            // bytes of resident chunks
+	bvh_layout_t layout;      // applied to each chunk tree as it is paged in
+	bool pack_triangles;
+	mesh_store_stat_t stat;
+	uint64_t clock;
+	tbb::spin_mutex eviction_mutex;
+
+	mesh_store_t();
+	~mesh_store_t();
+
+	static std::string path_for(const char *ctm_filepath, uint64_t key);
+	static bool write(const char *path, uint64_t key, const triangle_mesh_t &mesh, bvh_split_method_t method, size_t chunk_triangles);
+
+	bool open(const char *path, uint64_t key, size_t budget_bytes);
+	void close();
+
+	size_t chunk_count() const {
+		return (header != NULL) ? header->chunk_count : 0;
+	}
+
+	// one shape per chunk, for a top-level bvh_tree_t over the chunk bounds
+	void make_shapes(std::vector<shape_ref_t> &shapes);
+
+	// pins the chunk, paging it in if needed; every acquire() is paired with a release()
+	const mesh_chunk_t& acquire(size_t i);
+	void release(size_t i);
+
+private:
+	mesh_store_t(const mesh_store_t &);
+	mesh_store_t& operator=(const mesh_store_t &);
+
+	void load(size_t i, mesh_chunk_t &chunk) const;
+	void evict();
+
+	const char* at(uint64_t offset) const {
+		return (const char *)data + offset;
+	}
+
+};
+
+// Stands for one chunk in the top-level tree. A hit records the chunk-local triangle index
+// rather than a pointer, since the chunk may be evicted before the hit is shaded.
+struct mesh_chunk_shape_t : public shape_t {
+
+	mesh_chunk_shape_t(mesh_store_t *s, size_t i);
+
+	const bbox_t& bound() const {
+		return __bbox;
+	}
+
+	glm::vec3 normal(const glm::vec3 &p) const;
+	glm::vec3 shading_normal(const glm::vec3 &p, const isect_t &isect) const;
+
+	bool intersect(const ray_t &ray, isect_t &isect) const;
+	bool occluded(const ray_t &ray) const;
+
+	mesh_store_t *store;
+	size_t chunk;
+
+private:
+	bbox_t __bbox;
+
+};
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef MORTON_HPP
+#define MORTON_HPP
+
+#include <stdint.h>
+
+
+// Morton (Z-order) codes, shared by the tile order, the blue-noise sample index, the wavefront
+// ray sort keys and the LBVH build.
+
+// spreads the low 16 bits of x so that there is one zero bit between each
+inline uint32_t spread_bits_2(uint32_t x) {
+	x &= 0xffff;
+	x = ( x | (x << 8) ) & 0x00ff00ff;
+	x = ( x | (x << 4) ) & 0x0f0f0f0f;
+	x = ( x | (x << 2) ) & 0x33333333;
+	x = ( x | (x << 1) ) & 0x55555555;
+	return x;
+}
+
+// spreads the low 21 bits of x so that there are two zero bits between each
+inline uint64_t spread_bits_3(uint64_t x) {
+	x &= 0x1fffff;
+	x = ( x | (x << 32) ) & 0x1f00000000ffffULL;
+	x = ( x | (x << 16) ) & 0x1f0000ff0000ffULL;
+	x = ( x | (x << 8) ) & 0x100f00f00f00f00fULL;
+	x = ( x | (x << 4) ) & 0x10c30c30c30c30c3ULL;
+	x = ( x | (x << 2) ) & 0x1249249249249249ULL;
+	return x;
+}
+
+// 16 bits per axis, y takes the higher bit of each pair
+inline uint32_t morton_2d(uint32_t x, uint32_t y) {
+	return spread_bits_2(x) | ( spread_bits_2(y) << 1 );
+}
+
+// 21 bits per axis, x takes the highest bit of each triple
+inline uint64_t morton_3d(uint64_t x, uint64_t y, uint64_t z) {
+	return ( spread_bits_3(x) << 2 ) | ( spread_bits_3(y) << 1 ) | spread_bits_3(z);
+}
+
+#endif
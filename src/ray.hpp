@@ -9,6 +9,7 @@ struct ray_t {
 	float tmin;
 	float tmax;
 
+	ray_t() : tmin(0.0), tmax(INFINITY) { }
 	ray_t(const glm::vec3 &o, const glm::vec3 &d) : origin(o), direction(d), tmin(0.0), tmax(INFINITY) { }
 
 	glm::vec3 point_at(float t) const {
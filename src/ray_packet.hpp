@@ -0,0 +1,164 @@
+#ifndef RAY_PACKET_HPP
+#define RAY_PACKET_HPP
+
+#include <glm/glm.hpp>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+#include "ray.hpp"
+
+
+// thin wrappers over the widest SIMD unit we were compiled for (-mavx selects AVX)
+
+#if defined(__AVX__)
+
+#define SIMD_WIDTH 8
+
+typedef __m256 simd_float_t;
+typedef __m256 simd_mask_t;
+
+inline simd_float_t simd_load(const float *p) { return _mm256_load_ps(p); }
+inline simd_float_t simd_loadu(const float *p) { return _mm256_loadu_ps(p); }
+inline void simd_store(float *p, simd_float_t a) { _mm256_store_ps(p, a); }
+inline simd_float_t simd_set1(float a) { return _mm256_set1_ps(a); }
+inline simd_float_t simd_add(simd_float_t a, simd_float_t b) { return _mm256_add_ps(a, b); }
+inline simd_float_t simd_sub(simd_float_t a, simd_float_t b) { return _mm256_sub_ps(a, b); }
+inline simd_float_t simd_mul(simd_float_t a, simd_float_t b) { return _mm256_mul_ps(a, b); }
+inline simd_float_t simd_div(simd_float_t a, simd_float_t b) { return _mm256_div_ps(a, b); }
+inline simd_float_t simd_min(simd_float_t a, simd_float_t b) { return _mm256_min_ps(a, b); }
+inline simd_float_t simd_max(simd_float_t a, simd_float_t b) { return _mm256_max_ps(a, b); }
+inline simd_mask_t simd_lt(simd_float_t a, simd_float_t b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+inline simd_mask_t simd_le(simd_float_t a, simd_float_t b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+inline simd_mask_t simd_and(simd_mask_t a, simd_mask_t b) { return _mm256_and_ps(a, b); }
+inline unsigned int simd_movemask(simd_mask_t m) { return _mm256_movemask_ps(m); }
+inline simd_float_t simd_select(simd_mask_t m, simd_float_t a, simd_float_t b) { return _mm256_blendv_ps(b, a, m); }
+
+#elif defined(__SSE__)
+
+#define SIMD_WIDTH 4
+
+typedef __m128 simd_float_t;
+typedef __m128 simd_mask_t;
+
+inline simd_float_t simd_load(const float *p) { return _mm_load_ps(p); }
+inline simd_float_t simd_loadu(const float *p) { return _mm_loadu_ps(p); }
+inline void simd_store(float *p, simd_float_t a) { _mm_store_ps(p, a); }
+inline simd_float_t simd_set1(float a) { return _mm_set1_ps(a); }
+inline simd_float_t simd_add(simd_float_t a, simd_float_t b) { return _mm_add_ps(a, b); }
+inline simd_float_t simd_sub(simd_float_t a, simd_float_t b) { return _mm_sub_ps(a, b); }
+inline simd_float_t simd_mul(simd_float_t a, simd_float_t b) { return _mm_mul_ps(a, b); }
+inline simd_float_t simd_div(simd_float_t a, simd_float_t b) { return _mm_div_ps(a, b); }
+inline simd_float_t simd_min(simd_float_t a, simd_float_t b) { return _mm_min_ps(a, b); }
+inline simd_float_t simd_max(simd_float_t a, simd_float_t b) { return _mm_max_ps(a, b); }
+inline simd_mask_t simd_lt(simd_float_t a, simd_float_t b) { return _mm_cmplt_ps(a, b); }
+inline simd_mask_t simd_le(simd_float_t a, simd_float_t b) { return _mm_cmple_ps(a, b); }
+inline simd_mask_t simd_and(simd_mask_t a, simd_mask_t b) { return _mm_and_ps(a, b); }
+inline unsigned int simd_movemask(simd_mask_t m) { return _mm_movemask_ps(m); }
+inline simd_float_t simd_select(simd_mask_t m, simd_float_t a, simd_float_t b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+
+#else
+
+#define SIMD_WIDTH 1
+
+typedef float simd_float_t;
+typedef bool simd_mask_t;
+
+inline simd_float_t simd_load(const float *p) { return *p; }
+inline simd_float_t simd_loadu(const float *p) { return *p; }
+inline void simd_store(float *p, simd_float_t a) { *p = a; }
+inline simd_float_t simd_set1(float a) { return a; }
+inline simd_float_t simd_add(simd_float_t a, simd_float_t b) { return a + b; }
+inline simd_float_t simd_sub(simd_float_t a, simd_float_t b) { return a - b; }
+inline simd_float_t simd_mul(simd_float_t a, simd_float_t b) { return a * b; }
+inline simd_float_t simd_div(simd_float_t a, simd_float_t b) { return a / b; }
+inline simd_float_t simd_min(simd_float_t a, simd_float_t b) { return (a < b) ? a : b; }
+inline simd_float_t simd_max(simd_float_t a, simd_float_t b) { return (a > b) ? a : b; }
+inline simd_mask_t simd_lt(simd_float_t a, simd_float_t b) { return a < b; }
+inline simd_mask_t simd_le(simd_float_t a, simd_float_t b) { return a <= b; }
+inline simd_mask_t simd_and(simd_mask_t a, simd_mask_t b) { return a && b; }
+inline unsigned int simd_movemask(simd_mask_t m) { return m ? 1 : 0; }
+inline simd_float_t simd_select(simd_mask_t m, simd_float_t a, simd_float_t b) { return m ? a : b; }
+
+#endif
+
+
+struct shape_t;
+
+// up to 16 rays in structure-of-arrays layout; t and shape hold the closest hit of each lane
+struct ray_packet_t {
+
+	static const size_t max_size = 16;
+
+	float ox[max_size] __attribute__((aligned(32)));
+	float oy[max_size] __attribute__((aligned(32)));
+	float oz[max_size] __attribute__((aligned(32)));
+	float dx[max_size] __attribute__((aligned(32)));
+	float dy[max_size] __attribute__((aligned(32)));
+	float dz[max_size] __attribute__((aligned(32)));
+	float inv_dx[max_size] __attribute__((aligned(32)));
+	float inv_dy[max_size] __attribute__((aligned(32)));
+	float inv_dz[max_size] __attribute__((aligned(32)));
+	float tmin[max_size] __attribute__((aligned(32)));
+	float t[max_size] __attribute__((aligned(32)));
+	const shape_t *shape[max_size];
+	const shape_t *object_shape[max_size];
+	size_t object_index[max_size];
+
+	size_t size;
+
+	ray_packet_t(size_t n) : size(n) {
+		for (size_t i = 0; i < max_size; i++) {
+			ox[i] = oy[i] = oz[i] = 0.0f;
+			dx[i] = dy[i] = dz[i] = 1.0f;
+			inv_dx[i] = inv_dy[i] = inv_dz[i] = 1.0f;
+			tmin[i] = 0.0f;
+			t[i] = INFINITY;
+			shape[i] = NULL;
+			object_shape[i] = NULL;
+			object_index[i] = 0;
+		}
+	}
+
+	unsigned int full_mask() const {
+		return (1u << size) - 1;
+	}
+
+	void set(size_t i, const ray_t &ray) {
+		ox[i] = ray.origin.x;
+		oy[i] = ray.origin.y;
+		oz[i] = ray.origin.z;
+		dx[i] = ray.direction.x;
+		dy[i] = ray.direction.y;
+		dz[i] = ray.direction.z;
+		inv_dx[i] = 1.0f / ray.direction.x;
+		inv_dy[i] = 1.0f / ray.direction.y;
+		inv_dz[i] = 1.0f / ray.direction.z;
+		tmin[i] = ray.tmin;
+		t[i] = ray.tmax;
+		shape[i] = NULL;
+		object_shape[i] = NULL;
+		object_index[i] = 0;
+	}
+
+	ray_t ray(size_t i) const {
+		ray_t r(glm::vec3(ox[i], oy[i], oz[i]), glm::vec3(dx[i], dy[i], dz[i]));
+		r.tmin = tmin[i];
+		return r;
+	}
+
+	// all rays share one direction octant, so one near/far child order fits every lane
+	bool coherent() const {
+		for (size_t i = 1; i < size; i++) {
+			if ( (dx[i] < 0.0f) != (dx[0] < 0.0f) || (dy[i] < 0.0f) != (dy[0] < 0.0f) || (dz[i] < 0.0f) != (dz[0] < 0.0f) )
+				return false;
+		}
+		return true;
+	}
+
+};
+
+#endif
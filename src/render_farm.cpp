@@ -0,0 +1,446 @@
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+#include "render_farm.hpp"
+
+using namespace std;
+using namespace tbb;
+using namespace grkt;
+
+static const size_t FARM_BATCHES_IN_FLIGHT = 2;     // per worker, so a worker never waits for its next batch
+static const size_t FARM_BATCHES_PER_WORKER = 16;
+static const int FARM_POLL_MSEC = 100;
+static const int FARM_RECEIVE_TIMEOUT_SEC = 10;     // for any one read once a message is due, and for the whole hello
+// a batch may take this many times the slowest one back so far, but never less than the minimum;
+// before any is back there is nothing to go by and only the first deadline applies
+static const double FARM_DEADLINE_FACTOR = 8.0;
+static const double FARM_MIN_DEADLINE_SEC = 10.0;
+static const double FARM_FIRST_DEADLINE_SEC = 600.0;
+// from the spawn, for a worker to load the scene and say hello; one still silent then is killed
+static const double FARM_CONNECT_DEADLINE_SEC = 120.0;
+
+
+static bool read_all(int fd, void *p, size_t n) {
+	char *bytes = (char *)p;
+	while (n > 0) {
+		ssize_t r = recv(fd, bytes, n, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return false;
+		bytes += r;
+		n -= r;
+	}
+	return true;
+}
+
+static bool write_all(int fd, const void *p, size_t n) {
+	const char *bytes = (const char *)p;
+	while (n > 0) {
+		// a peer that has gone away is an error here, not a SIGPIPE
+		ssize_t w = send(fd, bytes, n, MSG_NOSIGNAL);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return false;
+		bytes += w;
+		n -= w;
+	}
+	return true;
+}
+
+static bool send_message(int fd, uint32_t type, size_t first, size_t count, const void *payload = NULL, size_t size = 0) {
+	farm_message_t message;
+	message.type = type;
+	message.first = (uint32_t)first;
+	message.count = (uint32_t)count;
+	message.size = (uint32_t)size;
+	return write_all(fd, &message, sizeof(message)) && ( size == 0 || write_all(fd, payload, size) );
+}
+
+static size_t tile_payload_size(const tile_t &tile) {
+	return (tile.x1 - tile.x0) * (tile.y1 - tile.y0) * ( 3 + sizeof(unsigned short) );
+}
+
+static size_t batch_payload_size(const context_t *ctx, const farm_batch_t &batch) {
+	size_t size = 0;
+	for (size_t t = batch.first; t < batch.first + batch.count; t++)
+		size += tile_payload_size(ctx->tiles[t]);
+	return size;
+}
+
+// moves a batch's pixels between the frame and a message: each tile's rgb rows, then its sample rows
+static void copy_batch(const context_t *ctx, const farm_batch_t &batch, unsigned char *rgb, unsigned short *samples, char *payload, bool to_payload) {
+	size_t width = ctx->screen.width;
+	for (size_t t = batch.first; t < batch.first + batch.count; t++) {
+		const tile_t &tile = ctx->tiles[t];
+		size_t row = tile.x1 - tile.x0;
+		for (size_t j = tile.y0; j < tile.y1; j++) {
+			unsigned char *p = rgb + 3 * ( tile.x0 + width * j );
+			if (to_payload)
+				memcpy(payload, p, row * 3);
+			else
+				memcpy(p, payload, row * 3);
+			payload += row * 3;
+		}
+		for (size_t j = tile.y0; j < tile.y1; j++) {
+			unsigned short *p = samples + tile.x0 + width * j;
+			if (to_payload)
+				memcpy(payload, p, row * sizeof(unsigned short));
+			else
+				memcpy(p, payload, row * sizeof(unsigned short));
+			payload += row * sizeof(unsigned short);
+		}
+	}
+}
+
+static farm_hello_t make_hello(const context_t *ctx, uint64_t key) {
+	farm_hello_t hello;
+	hello.key = key;
+	hello.width = (uint32_t)ctx->screen.width;
+	hello.height = (uint32_t)ctx->screen.height;
+	hello.tile_count = (uint32_t)ctx->tiles.size();
+	hello.sample_size = (uint32_t)ctx->sample_size;
+	hello.seed = ctx->seed;
+	hello.pid = (uint32_t)getpid();
+	return hello;
+}
+
+static bool make_address(const char *socket_path, sockaddr_un &addr) {
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+		return false;
+	strcpy(addr.sun_path, socket_path);
+	return true;
+}
+
+
+bool farm_coordinator_t::render(const char *socket_path, const vector<string> &worker_command, size_t worker_count) {
+	size_t tile_count = context->tiles.size();
+	stat = farm_stat_t();
+	stat.batch_size = std::max(tile_count / ( std::max(worker_count, (size_t)1) * FARM_BATCHES_PER_WORKER ), (size_t)1);
+	queue.clear();
+	for (size_t first = 0; first < tile_count; first += stat.batch_size)
+		queue.push_back(farm_batch_t(first, std::min(stat.batch_size, tile_count - first)));
+	stat.batch_count = queue.size();
+	tiles_done = 0;
+	slowest_batch = 0.0;
+	connected.clear();
+	pending.clear();
+
+	sockaddr_un addr;
+	if (!make_address(socket_path, addr))
+		return false;
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0)
+		return false;
+	unlink(socket_path);
+	if (bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, (int)worker_count + 4) != 0) {
+		close(listen_fd);
+		listen_fd = -1;
+		return false;
+	}
+
+	spawn(worker_command, worker_count);
+
+	vector<pollfd> fds;
+	while (tiles_done < tile_count) {
+		size_t alive = reap_children(false);
+		if (workers.empty() && alive == 0)
+			break;
+
+		// the listening socket, then the workers, then the connections still saying hello
+		size_t pending_base = 1 + workers.size();
+		fds.resize(pending_base + pending.size());
+		fds[0].fd = listen_fd;
+		fds[0].events = POLLIN;
+		for (size_t i = 0; i < workers.size(); i++) {
+			fds[i + 1].fd = workers[i].fd;
+			fds[i + 1].events = POLLIN;
+		}
+		for (size_t i = 0; i < pending.size(); i++) {
+			fds[pending_base + i].fd = pending[i].fd;
+			fds[pending_base + i].events = POLLIN;
+		}
+		if (poll(&fds[0], fds.size(), FARM_POLL_MSEC) < 0 && errno != EINTR)
+			break;
+
+		// back to front, so losing a worker leaves the indices still to visit alone
+		for (size_t i = workers.size(); i-- > 0; ) {
+			if (fds[i + 1].revents != 0 && !receive(workers[i]))
+				lose(i);
+		}
+		// a finished hello adds to workers, which is not indexed again until the next poll
+		tick_count now = tick_count::now();
+		for (size_t i = pending.size(); i-- > 0; ) {
+			// a hello trickled in a byte at a time runs out of time like a silent one
+			bool keep = true;
+			if ((now - pending[i].accepted).seconds() > FARM_RECEIVE_TIMEOUT_SEC)
+				keep = false;
+			else if (fds[pending_base + i].revents != 0)
+				keep = greet(pending[i]);
+			if (!keep || pending[i].received == sizeof(pending[i].bytes)) {
+				if (!keep)
+					close(pending[i].fd);
+				pending.erase(pending.begin() + i);
+			}
+		}
+		if (fds[0].revents & POLLIN)
+			accept_worker();
+		expire();
+		if ((tick_count::now() - spawn_time).seconds() > FARM_CONNECT_DEADLINE_SEC)
+			kill_unconnected();
+
+		for (size_t i = workers.size(); i-- > 0; )
+			dispatch(workers[i]);
+	}
+
+	// no workers left; every batch they held is back in the queue
+	renderer_t renderer(context, rgb, samples);
+	while (!queue.empty()) {
+		farm_batch_t batch = queue.front();
+		queue.pop_front();
+		parallel_for(blocked_range<size_t>(batch.first, batch.first + batch.count), renderer);
+		tiles_done += batch.count;
+		stat.local_batches++;
+	}
+
+	for (size_t i = 0; i < workers.size(); i++) {
+		send_message(workers[i].fd, FARM_DONE, 0, 0);
+		close(workers[i].fd);
+	}
+	workers.clear();
+	for (size_t i = 0; i < pending.size(); i++)
+		close(pending[i].fd);
+	pending.clear();
+	// a child that never connected is not told it is done, so waiting on it could take forever
+	kill_unconnected();
+	reap_children(true);
+
+	close(listen_fd);
+	listen_fd = -1;
+	unlink(socket_path);
+	return true;
+}
+
+void farm_coordinator_t::spawn(const vector<string> &worker_command, size_t worker_count) {
+	// everything the child touches is made before fork, since only the forking thread carries over
+	vector<char *> argv;
+	for (size_t i = 0; i < worker_command.size(); i++)
+		argv.push_back(const_cast<char *>(worker_command[i].c_str()));
+	argv.push_back(NULL);
+
+	for (size_t i = 0; i < worker_count; i++) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			// a worker reports its scene setup too; only the coordinator's goes to stdout
+			int null_fd = open("/dev/null", O_WRONLY);
+			if (null_fd >= 0)
+				dup2(null_fd, 1);
+			close(listen_fd);
+			execvp(argv[0], &argv[0]);
+			_exit(127);
+		}
+		if (pid > 0) {
+			children.push_back(pid);
+			stat.workers_started++;
+		}
+	}
+	spawn_time = tick_count::now();
+}
+
+void farm_coordinator_t::accept_worker() {
+	int fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	// the hello is read without blocking as it arrives, see greet()
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+		close(fd);
+		return;
+	}
+	pending.push_back(farm_pending_t(fd));
+}
+
+// Reads what has arrived of a hello. False when the peer went away or is not a worker for this frame; once
+// the whole hello is in, the connection is taken on as a worker.
+bool farm_coordinator_t::greet(farm_pending_t &connection) {
+	ssize_t r = recv(connection.fd, connection.bytes + connection.received, sizeof(connection.bytes) - connection.received, 0);
+	if (r < 0 && ( errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK ))
+		return true;
+	if (r <= 0)
+		return false;
+	connection.received += r;
+	if (connection.received < sizeof(connection.bytes))
+		return true;
+
+	farm_message_t message;
+	farm_hello_t hello;
+	memcpy(&message, connection.bytes, sizeof(message));
+	memcpy(&hello, connection.bytes + sizeof(message), sizeof(hello));
+	farm_hello_t expected = make_hello(context, key);
+	if (message.type != FARM_HELLO || message.size != sizeof(hello)
+		|| hello.key != expected.key || hello.width != expected.width || hello.height != expected.height
+		|| hello.tile_count != expected.tile_count || hello.sample_size != expected.sample_size || hello.seed != expected.seed)
+		return false;
+
+	// from here on messages are read whole, blocking; a peer that stops halfway through one must not stall the farm
+	int flags = fcntl(connection.fd, F_GETFL);
+	if (flags < 0 || fcntl(connection.fd, F_SETFL, flags & ~O_NONBLOCK) != 0)
+		return false;
+	timeval timeout;
+	timeout.tv_sec = FARM_RECEIVE_TIMEOUT_SEC;
+	timeout.tv_usec = 0;
+	setsockopt(connection.fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	workers.push_back(farm_worker_t(connection.fd, (pid_t)hello.pid));
+	connected.push_back((pid_t)hello.pid);
+	stat.workers_connected++;
+	return true;
+}
+
+bool farm_coordinator_t::receive(farm_worker_t &worker) {
+	farm_message_t message;
+	if (!read_all(worker.fd, &message, sizeof(message)) || message.type != FARM_RESULT)
+		return false;
+
+	// results come back in the order the batches went out
+	if (worker.in_flight.empty())
+		return false;
+	farm_batch_t batch = worker.in_flight.front();
+	if (message.first != batch.first || message.count != batch.count || message.size != batch_payload_size(context, batch))
+		return false;
+
+	vector<char> payload(message.size);
+	if (!read_all(worker.fd, &payload[0], payload.size()))
+		return false;
+	copy_batch(context, batch, rgb, samples, &payload[0], false);
+
+	// a worker takes its batches one after the other, so the next one starts about now
+	tick_count now = tick_count::now();
+	slowest_batch = std::max(slowest_batch, (now - worker.batch_start).seconds());
+	worker.batch_start = now;
+
+	worker.in_flight.erase(worker.in_flight.begin());
+	worker.tiles_rendered += batch.count;
+	tiles_done += batch.count;
+	stat.bytes_received += sizeof(message) + message.size;
+	return true;
+}
+
+void farm_coordinator_t::dispatch(farm_worker_t &worker) {
+	while (worker.in_flight.size() < FARM_BATCHES_IN_FLIGHT && !queue.empty()) {
+		farm_batch_t batch = queue.front();
+		queue.pop_front();
+		if (worker.in_flight.empty())
+			worker.batch_start = tick_count::now();
+		worker.in_flight.push_back(batch);
+		if (!send_message(worker.fd, FARM_TILES, batch.first, batch.count)) {
+			// the worker is gone; poll reports the hang-up on the next round
+			break;
+		}
+	}
+}
+
+void farm_coordinator_t::lose(size_t index) {
+	farm_worker_t &worker = workers[index];
+	for (size_t i = worker.in_flight.size(); i-- > 0; )
+		queue.push_front(worker.in_flight[i]);
+	stat.requeued_batches += worker.in_flight.size();
+	stat.workers_lost++;
+
+	close(worker.fd);
+	// one of ours that misbehaved rather than died is stopped before it takes more of the machine
+	if (find(children.begin(), children.end(), worker.pid) != children.end())
+		kill(worker.pid, SIGKILL);
+	workers.erase(workers.begin() + index);
+}
+
+void farm_coordinator_t::expire() {
+	double deadline = (slowest_batch > 0.0) ? std::max(FARM_MIN_DEADLINE_SEC, FARM_DEADLINE_FACTOR * slowest_batch) : FARM_FIRST_DEADLINE_SEC;
+	tick_count now = tick_count::now();
+	for (size_t i = workers.size(); i-- > 0; ) {
+		if (!workers[i].in_flight.empty() && (now - workers[i].batch_start).seconds() > deadline) {
+			stat.workers_timed_out++;
+			lose(i);
+		}
+	}
+}
+
+void farm_coordinator_t::kill_unconnected() {
+	for (size_t i = 0; i < children.size(); i++) {
+		if (find(connected.begin(), connected.end(), children[i]) == connected.end())
+			kill(children[i], SIGKILL);
+	}
+}
+
+size_t farm_coordinator_t::reap_children(bool wait) {
+	for (size_t i = children.size(); i-- > 0; ) {
+		if (waitpid(children[i], NULL, wait ? 0 : WNOHANG) != 0)
+			children.erase(children.begin() + i);
+	}
+	return children.size();
+}
+
+
+bool grkt::farm_work(const context_t *ctx, uint64_t scene_key, const char *socket_path) {
+	sockaddr_un addr;
+	if (!make_address(socket_path, addr))
+		return false;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return false;
+	if (connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+		close(fd);
+		return false;
+	}
+
+	farm_hello_t hello = make_hello(ctx, scene_key);
+	bool ok = send_message(fd, FARM_HELLO, 0, 0, &hello, sizeof(hello));
+
+	// batches are rendered into a frame of our own and only their tiles are sent back
+	size_t pixel_count = ctx->screen.width * ctx->screen.height;
+	vector<unsigned char> rgb(pixel_count * 3);
+	vector<unsigned short> samples(pixel_count);
+	renderer_t renderer(ctx, &rgb[0], &samples[0]);
+	vector<char> payload;
+
+	farm_message_t message;
+	while (ok) {
+		if (!read_all(fd, &message, sizeof(message))) {
+			// the coordinator went away or turned us down
+			ok = false;
+			break;
+		}
+		if (message.type == FARM_DONE)
+			break;
+		if (message.type != FARM_TILES || (size_t)message.first + message.count > ctx->tiles.size()) {
+			ok = false;
+			break;
+		}
+
+		farm_batch_t batch(message.first, message.count);
+		parallel_for(blocked_range<size_t>(batch.first, batch.first + batch.count), renderer);
+
+		payload.resize(batch_payload_size(ctx, batch));
+		copy_batch(ctx, batch, &rgb[0], &samples[0], &payload[0], true);
+		ok = send_message(fd, FARM_RESULT, batch.first, batch.count, &payload[0], payload.size());
+	}
+
+	close(fd);
+	return ok;
+}
@@ -0,0 +1,135 @@
+#ifndef GRKT_RENDER_FARM_HPP
+#define GRKT_RENDER_FARM_HPP
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+#include <tbb/tick_count.h>
+
+#include "grkt.hpp"
+
+
+namespace grkt {
+
+	enum farm_message_type_t {
+		FARM_HELLO,           // worker -> coordinator, a farm_hello_t follows
+		FARM_TILES,           // coordinator -> worker, render tiles [first, first + count)
+		FARM_RESULT,          // worker -> coordinator, each tile's rgb then samples, in tile order
+		FARM_DONE             // coordinator -> worker, no more work
+	};
+
+	struct farm_message_t {
+		uint32_t type;
+		uint32_t first;
+		uint32_t count;
+		uint32_t size;        // bytes that follow
+	};
+
+	// what a worker renders, checked so a worker started with other options is turned away; key stands for
+	// the model and every option that changes a pixel, the rest is checked field by field
+	struct farm_hello_t {
+		uint64_t key;
+		uint32_t width;
+		uint32_t height;
+		uint32_t tile_count;
+		uint32_t sample_size;
+		uint32_t seed;
+		uint32_t pid;
+	};
+
+	struct farm_batch_t {
+		size_t first;
+		size_t count;
+
+		farm_batch_t(size_t f = 0, size_t c = 0) : first(f), count(c) { }
+	};
+
+	struct farm_worker_t {
+		int fd;
+		pid_t pid;
+		size_t tiles_rendered;
+		std::vector<farm_batch_t> in_flight;
+		tbb::tick_count batch_start;    // when the worker got to the first batch in flight
+
+		farm_worker_t(int f, pid_t p) : fd(f), pid(p), tiles_rendered(0) { }
+	};
+
+	// a connection whose hello is still arriving; it is read as poll reports bytes, so a silent peer holds up nothing
+	struct farm_pending_t {
+		int fd;
+		size_t received;
+		char bytes[sizeof(farm_message_t) + sizeof(farm_hello_t)];
+		tbb::tick_count accepted;
+
+		farm_pending_t(int f) : fd(f), received(0), accepted(tbb::tick_count::now()) { }
+	};
+
+	struct farm_stat_t {
+		size_t workers_started;
+		size_t workers_connected;
+		size_t workers_lost;
+		size_t workers_timed_out; // lost because a batch took far longer than any batch before it
+		size_t batch_count;
+		size_t batch_size;
+		size_t requeued_batches;
+		size_t local_batches;     // rendered by the coordinator after every worker was gone
+		uint64_t bytes_received;
+
+		farm_stat_t() : workers_started(0), workers_connected(0), workers_lost(0), workers_timed_out(0), batch_count(0), batch_size(0),
+			requeued_batches(0), local_batches(0), bytes_received(0) { }
+	};
+
+	// Renders a frame with worker processes. The coordinator listens on a Unix-domain socket, starts the
+	// workers with worker_command, and keeps a couple of batches of consecutive tiles in flight with each
+	// of them; the pixels come back into rgb and samples. A worker that goes away, or sits on a batch past its
+	// deadline, has its batches put back at the front of the queue, and once none are left the coordinator
+	// renders what remains itself. Workers that have not said hello by the connect deadline are killed, so a
+	// child that hangs before connecting does not hold up the frame. Only workers whose hello carries the
+	// coordinator's key are taken on; hellos are read as they arrive, so a connection that stays silent delays no one.
+	// Every pixel depends only on its position and the frame seed, so the image is the one renderer_t makes.
+	struct farm_coordinator_t {
+		const context_t *context;
+		unsigned char *rgb;
+		unsigned short *samples;
+		farm_stat_t stat;
+
+		farm_coordinator_t(const context_t *ctx, uint64_t scene_key, unsigned char *rgb_buf, unsigned short *sample_buf) :
+			context(ctx), rgb(rgb_buf), samples(sample_buf), key(scene_key), listen_fd(-1), slowest_batch(0.0) { }
+
+		bool render(const char *socket_path, const std::vector<std::string> &worker_command, size_t worker_count);
+
+	private:
+		uint64_t key;
+		int listen_fd;
+		std::vector<pid_t> children;
+		std::vector<pid_t> connected;  // of every worker taken on, whether still here or lost
+		tbb::tick_count spawn_time;
+		std::vector<farm_worker_t> workers;
+		std::vector<farm_pending_t> pending;
+		std::deque<farm_batch_t> queue;
+		size_t tiles_done;
+		double slowest_batch;     // seconds, of the batches back so far
+
+		farm_coordinator_t(const farm_coordinator_t &);
+		farm_coordinator_t& operator=(const farm_coordinator_t &);
+
+		void spawn(const std::vector<std::string> &worker_command, size_t worker_count);
+		void accept_worker();
+		bool greet(farm_pending_t &connection);
+		bool receive(farm_worker_t &worker);
+		void dispatch(farm_worker_t &worker);
+		void lose(size_t index);
+		void expire();
+		void kill_unconnected();
+		size_t reap_children(bool wait);
+
+	};
+
+	// the worker side: connects to the coordinator and renders the batches it is sent until told to stop
+	bool farm_work(const context_t *ctx, uint64_t scene_key, const char *socket_path);
+
+}
+
+#endif
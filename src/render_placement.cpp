@@ -0,0 +1,280 @@
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <tbb/task_group.h>
+
+#include "render_placement.hpp"
+#include "wavefront.hpp"
+
+using namespace std;
+using namespace tbb;
+using namespace grkt;
+
+
+static void parse_cpu_list(const char *list, vector<int> &cpus) {
+	// "0-3,8-11"
+	const char *p = list;
+	while (*p != '\0' && *p != '\n') {
+		char *end;
+		long first = strtol(p, &end, 10);
+		if (end == p)
+			break;
+		long last = first;
+		p = end;
+		if (*p == '-') {
+			last = strtol(p + 1, &end, 10);
+			p = end;
+		}
+		for (long cpu = first; cpu <= last; cpu++)
+			cpus.push_back((int)cpu);
+		if (*p == ',')
+			p++;
+	}
+}
+
+static bool numa_node_less(const numa_node_t &a, const numa_node_t &b) {
+	return a.id < b.id;
+}
+
+// renders a node's share of the tiles with whatever threads the arena it runs in has
+struct node_render_task_t {
+	const context_t *context;
+	unsigned char *rgb;
+	unsigned short *samples;
+	uint32_t *costs;
+	image_output_t *output;
+	size_t wavefront_batch;
+
+	node_render_task_t(const context_t *ctx, unsigned char *rgb_buf, unsigned short *sample_buf, uint32_t *cost_buf, image_output_t *out, size_t batch) :
+		context(ctx), rgb(rgb_buf), samples(sample_buf), costs(cost_buf), output(out), wavefront_batch(batch) { }
+
+	void operator()() const {
+		if (wavefront_batch > 0) {
+			wavefront_renderer_t wavefront(context, rgb, samples, costs, output, wavefront_batch);
+			wavefront.render();
+		} else {
+			parallel_for(blocked_range<size_t>(0, context->tiles.size()), renderer_t(context, rgb, samples, costs, output));
+		}
+	}
+
+};
+
+// copies the tree from inside a node's arena, so its pages are first touched there
+struct replicate_task_t {
+	const bvh_tree_t *tree;
+	bvh_tree_t **replica;
+
+	replicate_task_t(const bvh_tree_t *t, bvh_tree_t **r) : tree(t), replica(r) { }
+
+	void operator()() const {
+		*replica = tree->replicate();
+	}
+
+};
+
+// the work has to be spawned and waited for inside the arena, or it runs wherever the caller is
+template<typename F>
+struct arena_run_t {
+	task_group *group;
+	F task;
+
+	arena_run_t(task_group *g, const F &f) : group(g), task(f) { }
+
+	void operator()() const {
+		group->run(task);
+	}
+
+};
+
+struct arena_wait_t {
+	task_group *group;
+
+	arena_wait_t(task_group *g) : group(g) { }
+
+	void operator()() const {
+		group->wait();
+	}
+
+};
+
+
+pinning_observer_t::pinning_observer_t(task_arena &arena, const vector<int> &c) : task_scheduler_observer(arena), cpus(c) {
+	CPU_ZERO(&process_mask);
+	sched_getaffinity(0, sizeof(process_mask), &process_mask);
+	observe(true);
+}
+
+pinning_observer_t::~pinning_observer_t() {
+	observe(false);
+}
+
+void pinning_observer_t::on_scheduler_entry(bool) {
+	int slot = this_task_arena::current_thread_index();
+	if (slot < 0 || cpus.empty())
+		return;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpus[slot % cpus.size()], &set);
+	sched_setaffinity(0, sizeof(set), &set);
+}
+
+void pinning_observer_t::on_scheduler_exit(bool) {
+	// a thread that leaves may serve another arena next
+	sched_setaffinity(0, sizeof(process_mask), &process_mask);
+}
+
+
+render_placement_t::~render_placement_t() {
+	release();
+}
+
+vector<numa_node_t> render_placement_t::detect_nodes() {
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		for (long cpu = 0; cpu < n && cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, &allowed);
+	}
+
+	vector<numa_node_t> nodes;
+	DIR *dir = opendir("/sys/devices/system/node");
+	if (dir != NULL) {
+		struct dirent *entry;
+		while ((entry = readdir(dir)) != NULL) {
+			int id;
+			if (sscanf(entry->d_name, "node%d", &id) != 1)
+				continue;
+
+			char path[320];
+			snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+			FILE *fp = fopen(path, "r");
+			if (fp == NULL)
+				continue;
+			char list[1024];
+			vector<int> cpus;
+			if (fgets(list, sizeof(list), fp) != NULL)
+				parse_cpu_list(list, cpus);
+			fclose(fp);
+
+			numa_node_t node;
+			node.id = id;
+			for (size_t i = 0; i < cpus.size(); i++) {
+				if (cpus[i] < CPU_SETSIZE && CPU_ISSET(cpus[i], &allowed))
+					node.cpus.push_back(cpus[i]);
+			}
+			if (!node.cpus.empty())
+				nodes.push_back(node);
+		}
+		closedir(dir);
+	}
+	sort(nodes.begin(), nodes.end(), numa_node_less);
+
+	if (nodes.empty()) {
+		numa_node_t node;
+		node.id = 0;
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &allowed))
+				node.cpus.push_back(cpu);
+		}
+		nodes.push_back(node);
+	}
+	return nodes;
+}
+
+size_t render_placement_t::cpu_count(const vector<numa_node_t> &nodes) {
+	size_t count = 0;
+	for (size_t i = 0; i < nodes.size(); i++)
+		count += nodes[i].cpus.size();
+	return count;
+}
+
+void render_placement_t::setup(size_t threads, bool pin, bool replicate, const bvh_tree_t *scene_tree) {
+	release();
+	thread_count = threads;
+	pinned = pin;
+
+	if (!pinned) {
+		arenas.push_back(new task_arena((int)threads));
+		return;
+	}
+
+	// one node's cores are used up before the next node is touched, and pinned there is at most a thread per core
+	vector<numa_node_t> available = detect_nodes();
+	size_t remaining = threads;
+	for (size_t i = 0; i < available.size() && remaining > 0; i++) {
+		size_t n = std::min(remaining, available[i].cpus.size());
+		numa_node_t node;
+		node.id = available[i].id;
+		node.cpus.assign(available[i].cpus.begin(), available[i].cpus.begin() + n);
+		nodes.push_back(node);
+
+		// the first node keeps a slot for the main thread, which helps there while it waits; the others get all workers
+		arenas.push_back(new task_arena((int)n, (nodes.size() == 1) ? 1 : 0));
+		observers.push_back(new pinning_observer_t(*arenas.back(), node.cpus));
+		remaining -= n;
+	}
+	thread_count = threads - remaining;
+
+	if (replicate && scene_tree != NULL) {
+		replicated_tree = scene_tree;
+		replicas.resize(arenas.size(), NULL);
+		vector<task_group *> groups(arenas.size());
+		for (size_t i = 0; i < arenas.size(); i++) {
+			groups[i] = new task_group();
+			arenas[i]->execute(arena_run_t<replicate_task_t>(groups[i], replicate_task_t(scene_tree, &replicas[i])));
+		}
+		for (size_t i = 0; i < arenas.size(); i++) {
+			arenas[i]->execute(arena_wait_t(groups[i]));
+			delete groups[i];
+		}
+	}
+}
+
+void render_placement_t::release() {
+	for (size_t i = 0; i < observers.size(); i++)
+		delete observers[i];
+	for (size_t i = 0; i < arenas.size(); i++)
+		delete arenas[i];
+	for (size_t i = 0; i < replicas.size(); i++)
+		delete replicas[i];
+	observers.clear();
+	arenas.clear();
+	replicas.clear();
+	replicated_tree = NULL;
+	nodes.clear();
+	thread_count = 0;
+	pinned = false;
+}
+
+void render_placement_t::render(const context_t *ctx, unsigned char *rgb, unsigned short *samples, uint32_t *costs, image_output_t *output, size_t wavefront_batch) const {
+	size_t arena_count = arenas.size();
+	size_t tile_count = ctx->tiles.size();
+
+	// each arena renders a run of the tiles as a context of its own, with its node's copy of the tree if there is one
+	vector<context_t> node_contexts(arena_count, *ctx);
+	size_t first = 0;
+	for (size_t i = 0; i < arena_count; i++) {
+		size_t count = (i + 1 == arena_count) ? tile_count - first : tile_count * nodes[i].cpus.size() / thread_count;
+		node_contexts[i].tiles.assign(ctx->tiles.begin() + first, ctx->tiles.begin() + first + count);
+		if (!replicas.empty() && ctx->bvh_tree == replicated_tree)
+			node_contexts[i].bvh_tree = replicas[i];
+		first += count;
+	}
+
+	vector<task_group *> groups(arena_count);
+	for (size_t i = 0; i < arena_count; i++) {
+		groups[i] = new task_group();
+		node_render_task_t task(&node_contexts[i], rgb, samples, costs, output, wavefront_batch);
+		arenas[i]->execute(arena_run_t<node_render_task_t>(groups[i], task));
+	}
+	for (size_t i = 0; i < arena_count; i++) {
+		arenas[i]->execute(arena_wait_t(groups[i]));
+		delete groups[i];
+	}
+}
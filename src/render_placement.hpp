@@ -0,0 +1,121 @@
+#ifndef GRKT_RENDER_PLACEMENT_HPP
+#define GRKT_RENDER_PLACEMENT_HPP
+
+#include <vector>
+#include <sched.h>
+#include <sys/mman.h>
+#include <tbb/task_arena.h>
+#include <tbb/task_scheduler_observer.h>
+
+#include "grkt.hpp"
+
+
+namespace grkt {
+
+	struct image_output_t;
+
+	// Zeroed pages that are mapped but not yet touched, so each one is placed on the NUMA node of the thread
+	// that writes it first rather than on the node of the thread that allocated it.
+	template<typename T>
+	struct first_touch_array_t {
+		T *data;
+		size_t count;
+
+		first_touch_array_t() : data(NULL), count(0) { }
+
+		~first_touch_array_t() {
+			release();
+		}
+
+		bool allocate(size_t n) {
+			release();
+			void *p = mmap(NULL, n * sizeof(T), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (p == MAP_FAILED)
+				return false;
+			data = (T *)p;
+			count = n;
+			return true;
+		}
+
+		void release() {
+			if (data != NULL)
+				munmap(data, count * sizeof(T));
+			data = NULL;
+			count = 0;
+		}
+
+		size_t size() const {
+			return count;
+		}
+
+		T& operator[](size_t i) {
+			return data[i];
+		}
+
+		const T& operator[](size_t i) const {
+			return data[i];
+		}
+
+	private:
+		first_touch_array_t(const first_touch_array_t &);
+		first_touch_array_t& operator=(const first_touch_array_t &);
+
+	};
+
+	struct numa_node_t {
+		int id;
+		std::vector<int> cpus;    // the ones this process may run on
+	};
+
+	// binds each thread that enters the arena to one of cpus, by its slot, and lets it go again on the way out
+	struct pinning_observer_t : public tbb::task_scheduler_observer {
+		std::vector<int> cpus;
+		cpu_set_t process_mask;
+
+		pinning_observer_t(tbb::task_arena &arena, const std::vector<int> &c);
+		~pinning_observer_t();
+
+		void on_scheduler_entry(bool is_worker);
+		void on_scheduler_exit(bool is_worker);
+
+	};
+
+	// Where a frame's threads run. Inactive, the frame goes to the global TBB pool as it always has.
+	// Otherwise the frame runs in a task_arena of thread_count threads. Pinned, the threads fill one NUMA node's
+	// cores before the next and every node in use gets an arena of its own, bound to its cores, and a share of
+	// the Morton-ordered tiles in proportion to its threads, so each node writes, and first touches, one
+	// contiguous part of the frame. With replicas a node also traces against its own copy of the scene's BVH.
+	struct render_placement_t {
+		size_t thread_count;
+		bool pinned;
+		std::vector<numa_node_t> nodes;          // the nodes in use, each with the cores its threads are bound to
+		std::vector<tbb::task_arena *> arenas;
+		std::vector<pinning_observer_t *> observers;
+		std::vector<bvh_tree_t *> replicas;
+		const bvh_tree_t *replicated_tree;
+
+		render_placement_t() : thread_count(0), pinned(false), replicated_tree(NULL) { }
+		~render_placement_t();
+
+		// the NUMA nodes with the cores this process may use, from sysfs; a single node when there is no such thing
+		static std::vector<numa_node_t> detect_nodes();
+		static size_t cpu_count(const std::vector<numa_node_t> &nodes);
+
+		bool active() const {
+			return ( thread_count > 0 );
+		}
+
+		void setup(size_t threads, bool pin, bool replicate, const bvh_tree_t *scene_tree);
+		void release();
+
+		void render(const context_t *ctx, unsigned char *rgb, unsigned short *samples, uint32_t *costs, image_output_t *output, size_t wavefront_batch) const;
+
+	private:
+		render_placement_t(const render_placement_t &);
+		render_placement_t& operator=(const render_placement_t &);
+
+	};
+
+}
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef SAMPLER_HPP
+#define SAMPLER_HPP
+
+#include <stdint.h>
+
+#include "morton.hpp"
+
+
+// PCG32 (O'Neill); small enough to seed per pixel
+struct rng_t {
+	uint64_t state;
+	uint64_t inc;
+
+	rng_t(uint64_t seed = 0, uint64_t stream = 0) : state(0), inc((stream << 1) | 1) {
+		next();
+		state += seed;
+		next();
+	}
+
+	uint32_t next() {
+		uint64_t old = state;
+		state = old * 6364136223846793005ULL + inc;
+		uint32_t xorshifted = (uint32_t)( ( (old >> 18) ^ old ) >> 27 );
+		uint32_t rot = (uint32_t)(old >> 59);
+		return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+	}
+
+	// uniform in [0, 1)
+	float operator() () {
+		return (next() >> 8) * (1.0f / 16777216.0f);
+	}
+
+};
+
+inline uint32_t hash_uint(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x7feb352dU;
+	x ^= x >> 15;
+	x *= 0x846ca68bU;
+	x ^= x >> 16;
+	return x;
+}
+
+// PCG hash (Jarzynski and Olano), one round of the PCG32 output function over a counter
+inline uint32_t pcg_hash(uint32_t x) {
+	uint32_t state = x * 747796405u + 2891336453u;
+	uint32_t word = ( (state >> ( (state >> 28) + 4 )) ^ state ) * 277803737u;
+	return (word >> 22) ^ word;
+}
+
+inline uint32_t reverse_bits(uint32_t x) {
+	x = ( (x >> 1) & 0x55555555u ) | ( (x & 0x55555555u) << 1 );
+	x = ( (x >> 2) & 0x33333333u ) | ( (x & 0x33333333u) << 2 );
+	x = ( (x >> 4) & 0x0f0f0f0fu ) | ( (x & 0x0f0f0f0fu) << 4 );
+	x = ( (x >> 8) & 0x00ff00ffu ) | ( (x & 0x00ff00ffu) << 8 );
+	return (x >> 16) | (x << 16);
+}
+
+// Owen scrambling by hashing (Burley, "Practical Hash-based Owen Scrambling"): every bit is flipped
+// depending only on the bits above it, so a scrambled (0,2)-sequence keeps its stratification
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+	x = reverse_bits(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return reverse_bits(x);
+}
+
+// the first two Sobol dimensions, which together form a (0,2)-sequence
+inline uint32_t sobol_sample(uint32_t index, uint32_t dim) {
+	if (dim == 0)
+		return reverse_bits(index);
+
+	uint32_t x = 0;
+	for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1) {
+		if (index & 1)
+			x ^= v;
+	}
+	return x;
+}
+
+enum sampler_type_t {
+	SAMPLER_RANDOM,       // one PCG32 stream per pixel
+	SAMPLER_PCG_HASH,     // a hash of pixel, sample and dimension
+	SAMPLER_SOBOL,        // Owen-scrambled Sobol pairs, decorrelated per pixel
+	SAMPLER_BLUE_NOISE    // one Owen-scrambled Sobol sequence shared out in pixel Z-order
+};
+
+// The numbers a pixel's samples are made of. Each sample asks for its dimensions in order, and except
+// for SAMPLER_RANDOM the value depends only on (pixel, sample, dimension), never on what came before,
+// so the state is a few integers and any sample can be drawn in any order.
+struct sampler_t {
+	sampler_type_t type;
+	uint32_t pixel_seed;      // the pixel and the frame seed hashed together, or the pixel's place in the shared sequence
+	uint32_t seed;
+	uint32_t sample;
+	uint32_t dimension;
+	rng_t rng;                // SAMPLER_RANDOM only
+
+	sampler_t() : type(SAMPLER_RANDOM), pixel_seed(0), seed(0), sample(0), dimension(0) { }
+
+	sampler_t(sampler_type_t t, uint32_t i, uint32_t j, uint32_t width, uint32_t frame_seed, uint32_t samples_per_pixel) :
+		type(t), seed(frame_seed), sample(0), dimension(0) {
+		uint32_t pixel = i + width * j;
+		pixel_seed = hash_uint(pixel ^ hash_uint(frame_seed));
+		if (type == SAMPLER_RANDOM) {
+			rng = rng_t(pixel_seed, frame_seed);
+		} else if (type == SAMPLER_BLUE_NOISE) {
+			// Ahmed and Wonka: neighbouring pixels take neighbouring runs of one sequence, which turns their
+			// errors into blue noise. The quadrants at every level of the Z-order are visited in a random order.
+			uint32_t code = morton_2d(i, j);
+			uint32_t shuffled = 0;
+			for (int level = 15; level >= 0; level--) {
+				// the digits above this level; shifted as 64 bits since at the top level they are all 32 gone
+				uint32_t prefix = (uint32_t)( (uint64_t)code >> (2 * level + 2) );
+				uint32_t digit = ( (code >> (2 * level)) & 3 ) ^ ( hash_uint(prefix ^ hash_uint(level + frame_seed)) & 3 );
+				shuffled |= digit << (2 * level);
+			}
+			pixel_seed = shuffled * samples_per_pixel;   // indices wrap past 2^32 samples per frame
+		}
+	}
+
+	void start_sample(uint32_t index) {
+		// a random stream simply carries on, so the image matches the one made before samplers existed
+		sample = index;
+		dimension = 0;
+	}
+
+	// uniform in [0, 1)
+	float operator() () {
+		if (type == SAMPLER_RANDOM)
+			return rng();
+
+		uint32_t d = dimension++;
+		uint32_t bits;
+		switch (type) {
+			case SAMPLER_PCG_HASH: {
+				bits = pcg_hash(pixel_seed + pcg_hash(sample + pcg_hash(d + seed)));
+				break;
+			}
+			case SAMPLER_SOBOL: {
+				// dimensions pair up; each pair shuffles the sample order its own way so pairs do not correlate
+				uint32_t pair_seed = hash_uint(pixel_seed ^ hash_uint(d >> 1));
+				uint32_t index = nested_uniform_scramble(sample, pair_seed);
+				bits = nested_uniform_scramble(sobol_sample(index, d & 1), hash_uint(pair_seed + d));
+				break;
+			}
+			default: {
+				uint32_t pair_seed = hash_uint(seed ^ hash_uint(d >> 1));
+				uint32_t index = nested_uniform_scramble(pixel_seed + sample, pair_seed);
+				bits = nested_uniform_scramble(sobol_sample(index, d & 1), hash_uint(pair_seed + d));
+				break;
+			}
+		}
+		return (bits >> 8) * (1.0f / 16777216.0f);
+	}
+
+};
+
+#endif
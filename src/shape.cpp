@@ -3,6 +3,31 @@
 using namespace glm;
 
 
+unsigned int shape_t::intersect_packet(ray_packet_t &packet, unsigned int mask) const {
+	unsigned int hit = 0;
+	for (size_t i = 0; i < packet.size; i++) {
+		if ( (mask & (1u << i)) == 0 )
+			continue;
+		
+		isect_t isect;
+		isect.t = packet.t[i];
+		if (intersect(packet.ray(i), isect)) {
+			packet.t[i] = isect.t;
+			packet.shape[i] = isect.shape;
+			packet.object_shape[i] = isect.object_shape;
+			packet.object_index[i] = isect.object_index;
+			hit |= (1u << i);
+		}
+	}
+	return hit;
+}
+
+bool shape_t::occluded(const ray_t &ray) const {
+	isect_t isect;
+	isect.t = ray.tmax;
+	return intersect(ray, isect);
+}
+
 plane_t::plane_t(const glm::vec3 &p, const glm::vec3 &n) : __point(p), __normal(n) { 
 	__bbox.max_point = glm::vec3(1.0f, __point.y, 1.0f);
 	__bbox.min_point = glm::vec3(-1.0f, __point.y, -1.0f);
@@ -16,7 +41,13 @@ bool plane_t::intersect(const ray_t &ray, isect_t &isect) const {
 		return false;
 
 	float t = -1.0 * (dot(ray.origin, __normal) + d) / a;
-	if (t < isect.t) {
+	
+	// the plane is the square its bounding box spans, not an infinite one
+	vec3 p = ray.point_at(t);
+	if (p.x < __bbox.min_point.x || p.x > __bbox.max_point.x || p.z < __bbox.min_point.z || p.z > __bbox.max_point.z)
+		return false;
+	
+	if (t > ray.tmin && t < isect.t) {
 		isect.t = t;
 		isect.shape = this;
 		return true;
@@ -41,7 +72,7 @@ bool sphere_t::intersect(const ray_t &ray, isect_t &isect) const {
 	}
 
 	float t = -b - sqrtf(det);
-	if (t < 0.0f) {
+	if (t < ray.tmin) {
 		return false;
 	}
 	
@@ -5,6 +5,7 @@
 #include <glm/glm.hpp>
 
 #include "ray.hpp"
+#include "ray_packet.hpp"
 #include "bbox.hpp"
 
 struct shape_t;
@@ -14,8 +15,10 @@ typedef boost::shared_ptr<shape_t> shape_ref_t;
 struct isect_t {
 	float t;
 	const shape_t *shape;
+	const shape_t *object_shape;  // when shape is an instance, the shape hit inside it
+	size_t object_index;          // when shape is a chunk of an out-of-core mesh, the triangle hit inside it
 	
-	isect_t() : t(INFINITY) { }
+	isect_t() : t(INFINITY), shape(NULL), object_shape(NULL), object_index(0) { }
 	
 };
 
@@ -24,8 +27,16 @@ struct shape_t {
 	virtual ~shape_t() { }
 	
 	virtual const bbox_t& bound() const = 0;
+	virtual void update_bound() { }  // recompute a cached bound after the geometry moved
 	virtual glm::vec3 normal(const glm::vec3 &p) const = 0;
 	virtual bool intersect(const ray_t &ray, isect_t &isect) const = 0;
+	virtual unsigned int intersect_packet(ray_packet_t &packet, unsigned int mask) const;
+	virtual bool occluded(const ray_t &ray) const;
+	
+	virtual glm::vec3 shading_normal(const glm::vec3 &p, const isect_t &isect) const {
+		#pragma unused (isect)
+		return normal(p);
+	}
 	
 };
 
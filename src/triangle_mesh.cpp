@@ -1,15 +1,163 @@
+#include <algorithm>
 #include <openctmpp.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_scan.h>
+#include <tbb/blocked_range.h>
+
 #include "shape.hpp"
 #include "triangle_mesh.hpp"
 
 using namespace std;
 using namespace glm;
 using namespace glm::gtx;
+using namespace tbb;
+
+
+// load() copies CTM_VERTICES straight into the vertices, so vec3 must be three packed floats; the array size
+// goes negative, and compiling fails, if it is not
+typedef char ctm_vertex_layout_check_t[( sizeof(vec3) == 3 * sizeof(CTMfloat) ) ? 1 : -1];
+
+typedef vector<triangle_t> triangle_list_t;
+
+// constructs each range's triangles in a block of its own; the references alias the block's count, so there is
+// no allocation per face and the only count a thread touches is the one of the block it is filling
+struct refine_task_t {
+	const triangle_mesh_t *mesh;
+	shape_ref_t *refs;
+	
+	refine_task_t(const triangle_mesh_t *m, shape_ref_t *r) : mesh(m), refs(r) { }
+	
+	void operator() (const blocked_range<size_t> &range) const {
+		boost::shared_ptr<triangle_list_t> block(new triangle_list_t(range.size()));
+		triangle_list_t &triangles = *block;
+		for (size_t i = range.begin(); i != range.end(); i++) {
+			triangle_t &triangle = triangles[i - range.begin()];
+			triangle = triangle_t(mesh, i);
+			refs[i] = shape_ref_t(block, &triangle);
+		}
+	}
+	
+};
+
+struct face_normal_task_t {
+	const triangle_mesh_t *mesh;
+	vec3 *face_normals;
+	
+	face_normal_task_t(const triangle_mesh_t *m, vec3 *n) : mesh(m), face_normals(n) { }
+	
+	void operator() (const blocked_range<size_t> &range) const {
+		for (size_t i = range.begin(); i != range.end(); i++) {
+			const unsigned int *indices = &mesh->indices[3 * i];
+			const vec3 &v0 = mesh->vertices[indices[0]];
+			face_normals[i] = cross(mesh->vertices[indices[1]] - v0, mesh->vertices[indices[2]] - v0);
+		}
+	}
+	
+};
+
+struct vertex_count_task_t {
+	const unsigned int *indices;
+	unsigned int *counts;
+	
+	vertex_count_task_t(const unsigned int *i, unsigned int *c) : indices(i), counts(c) { }
+	
+	void operator() (const blocked_range<size_t> &range) const {
+		for (size_t i = range.begin(); i != range.end(); i++) {
+			__sync_fetch_and_add(&counts[indices[i]], 1);
+		}
+	}
+	
+};
+
+// turns per-vertex counts into the offsets they end at
+struct offset_scan_t {
+	unsigned int *offsets;
+	unsigned int sum;
+	
+	offset_scan_t(unsigned int *o) : offsets(o), sum(0) { }
+	offset_scan_t(offset_scan_t &other, split) : offsets(other.offsets), sum(0) { }
+	
+	template<typename Tag>
+	void operator() (const blocked_range<size_t> &range, Tag) {
+		unsigned int s = sum;
+		for (size_t i = range.begin(); i != range.end(); i++) {
+			s += offsets[i];
+			if (Tag::is_final_scan())
+				offsets[i] = s;
+		}
+		sum = s;
+	}
+	
+	void reverse_join(offset_scan_t &left) {
+		sum = left.sum + sum;
+	}
+	
+	void assign(offset_scan_t &other) {
+		sum = other.sum;
+	}
+	
+};
+
+struct vertex_face_task_t {
+	const unsigned int *indices;
+	unsigned int *cursor;
+	unsigned int *faces;
+	
+	vertex_face_task_t(const unsigned int *i, unsigned int *c, unsigned int *f) : indices(i), cursor(c), faces(f) { }
+	
+	void operator() (const blocked_range<size_t> &range) const {
+		for (size_t i = range.begin(); i != range.end(); i++) {
+			faces[__sync_fetch_and_add(&cursor[indices[i]], 1)] = i / 3;
+		}
+	}
+	
+};
+
+// the faces were filled in whatever order the threads got to them; face order makes the sums match a serial pass bit for bit
+struct vertex_face_sort_task_t {
+	const unsigned int *face_offsets;
+	unsigned int *faces;
+	
+	vertex_face_sort_task_t(const unsigned int *o, unsigned int *f) : face_offsets(o), faces(f) { }
+	
+	void operator() (const blocked_range<size_t> &range) const {
+		for (size_t i = range.begin(); i != range.end(); i++) {
+			std::sort(faces + face_offsets[i], faces + face_offsets[i + 1]);
+		}
+	}
+	
+};
+
+// each vertex sums its own faces, so threads never write the same normal
+struct vertex_normal_task_t {
+	const vec3 *face_normals;
+	const unsigned int *face_offsets;
+	const unsigned int *faces;
+	vec3 *normals;
+	
+	vertex_normal_task_t(const vec3 *fn, const unsigned int *o, const unsigned int *f, vec3 *n) : face_normals(fn), face_offsets(o), faces(f), normals(n) { }
+	
+	void operator() (const blocked_range<size_t> &range) const {
+		for (size_t i = range.begin(); i != range.end(); i++) {
+			vec3 normal(0.0f);
+			for (unsigned int k = face_offsets[i]; k < face_offsets[i + 1]; k++) {
+				normal += face_normals[faces[k]];
+			}
+			normals[i] = normalize(normal);
+		}
+	}
+	
+};
+
 
 
 triangle_t::triangle_t(const triangle_mesh_t *m, size_t n) : __mesh(m) {
 	indices = &__mesh->indices[3 * n];
-	
+	update_bound();
+}
+
+void triangle_t::update_bound() {
+	__bbox = bbox_t();
 	for (int i = 0; i < 3; i++)
 		__bbox.merge(v(i));
 }
@@ -37,7 +185,7 @@ bool triangle_t::intersect(const ray_t &ray, isect_t &isect) const {
     return false;
 
 	float t = dot(e1, qv) * inv_det;
-	if (isect.t > t) {
+	if (t > ray.tmin && isect.t > t) {
 		isect.t = t;
 		isect.shape = this;
 		return true;	
@@ -47,6 +195,65 @@ bool triangle_t::intersect(const ray_t &ray, isect_t &isect) const {
 
 }
 
+unsigned int triangle_t::intersect_packet(ray_packet_t &packet, unsigned int mask) const {
+	vec3 e0 = v(1) - v(0);
+	vec3 e1 = v(2) - v(0);
+	
+	simd_float_t e0x = simd_set1(e0.x), e0y = simd_set1(e0.y), e0z = simd_set1(e0.z);
+	simd_float_t e1x = simd_set1(e1.x), e1y = simd_set1(e1.y), e1z = simd_set1(e1.z);
+	simd_float_t v0x = simd_set1(v(0).x), v0y = simd_set1(v(0).y), v0z = simd_set1(v(0).z);
+	simd_float_t zero = simd_set1(0.0f);
+	simd_float_t one = simd_set1(1.0f);
+	
+	unsigned int hit = 0;
+	for (size_t i = 0; i < packet.size; i += SIMD_WIDTH) {
+		if ( ( (mask >> i) & ( (1u << SIMD_WIDTH) - 1 ) ) == 0 )
+			continue;
+		
+		simd_float_t dx = simd_load(&packet.dx[i]), dy = simd_load(&packet.dy[i]), dz = simd_load(&packet.dz[i]);
+		
+		// pv = cross(direction, e1)
+		simd_float_t pvx = simd_sub(simd_mul(dy, e1z), simd_mul(dz, e1y));
+		simd_float_t pvy = simd_sub(simd_mul(dz, e1x), simd_mul(dx, e1z));
+		simd_float_t pvz = simd_sub(simd_mul(dx, e1y), simd_mul(dy, e1x));
+		simd_float_t inv_det = simd_div(one, simd_add(simd_add(simd_mul(e0x, pvx), simd_mul(e0y, pvy)), simd_mul(e0z, pvz)));
+		
+		simd_float_t tvx = simd_sub(simd_load(&packet.ox[i]), v0x);
+		simd_float_t tvy = simd_sub(simd_load(&packet.oy[i]), v0y);
+		simd_float_t tvz = simd_sub(simd_load(&packet.oz[i]), v0z);
+		simd_float_t u = simd_mul(simd_add(simd_add(simd_mul(tvx, pvx), simd_mul(tvy, pvy)), simd_mul(tvz, pvz)), inv_det);
+		
+		// qv = cross(tv, e0)
+		simd_float_t qvx = simd_sub(simd_mul(tvy, e0z), simd_mul(tvz, e0y));
+		simd_float_t qvy = simd_sub(simd_mul(tvz, e0x), simd_mul(tvx, e0z));
+		simd_float_t qvz = simd_sub(simd_mul(tvx, e0y), simd_mul(tvy, e0x));
+		simd_float_t v = simd_mul(simd_add(simd_add(simd_mul(dx, qvx), simd_mul(dy, qvy)), simd_mul(dz, qvz)), inv_det);
+		simd_float_t t = simd_mul(simd_add(simd_add(simd_mul(e1x, qvx), simd_mul(e1y, qvy)), simd_mul(e1z, qvz)), inv_det);
+		
+		simd_float_t t_closest = simd_load(&packet.t[i]);
+		simd_mask_t m = simd_and(simd_le(zero, u), simd_le(zero, v));
+		m = simd_and(m, simd_le(simd_add(u, v), one));
+		m = simd_and(m, simd_lt(simd_load(&packet.tmin[i]), t));
+		m = simd_and(m, simd_lt(t, t_closest));
+		
+		unsigned int lanes = simd_movemask(m) & (mask >> i) & ( (1u << SIMD_WIDTH) - 1 );
+		if (lanes == 0)
+			continue;
+		
+		float tt[SIMD_WIDTH] __attribute__((aligned(32)));
+		simd_store(tt, t);
+		for (size_t k = 0; k < SIMD_WIDTH; k++) {
+			if (lanes & (1u << k)) {
+				packet.t[i + k] = tt[k];
+				packet.shape[i + k] = this;
+			}
+		}
+		hit |= lanes << i;
+	}
+	
+	return hit;
+}
+
 vec3 triangle_t::normal(const vec3 &p) const {
 	vec3 e0 = v(1) - v(0);
   vec3 e1 = v(2) - v(0);
@@ -60,32 +267,39 @@ vec3 triangle_t::normal(const vec3 &p) const {
 
 void triangle_mesh_t::refine_to_triangles(vector<shape_ref_t> &triangles) const {
 	size_t triangle_count = indices.size() / 3;
-	triangles.reserve(triangle_count);
+	if (triangle_count == 0)
+		return;
 	
-	for (size_t i = 0; i < triangle_count; i++) {
-		triangle_t *triangle = new triangle_t(this, i);
-		shape_ref_t t = shape_ref_t(triangle);
-		triangles.push_back(t);		
-	}
+	size_t first = triangles.size();
+	triangles.resize(first + triangle_count);
 	
+	parallel_for(blocked_range<size_t>(0, triangle_count, 1024), refine_task_t(this, &triangles[first]));
 }
 
-void triangle_mesh_t::compute_vertex_normals(const vector<shape_ref_t> &triangles) {
+void triangle_mesh_t::compute_vertex_normals() {
+	size_t triangle_count = indices.size() / 3;
 	normals.resize(vertices.size());
+	if (vertices.empty())
+		return;
 	
-	for (size_t i = 0; i < triangles.size(); i++) {
-		shape_t *shape = triangles[i].get();
-		triangle_t *t = dynamic_cast<triangle_t *>(shape);
-		vec3 normal = cross(t->v(1) - t->v(0), t->v(2) - t->v(0));
-		for (size_t j = 0; j < 3; j++) {
-			normals[t->indices[j]] += normal;
-		}
-	}
-
-	for (size_t i = 0; i < normals.size(); i++) {
-		normals[i] = normalize(normals[i]);
+	vector<vec3> face_normals(triangle_count);
+	parallel_for(blocked_range<size_t>(0, triangle_count, 1024), face_normal_task_t(this, &face_normals[0]));
+	
+	// faces around each vertex, in face order, so the sums match a serial pass bit for bit
+	vector<unsigned int> face_offsets(vertices.size() + 1, 0);
+	vector<unsigned int> faces(indices.size());
+	if (!indices.empty()) {
+		parallel_for(blocked_range<size_t>(0, indices.size(), 4096), vertex_count_task_t(&indices[0], &face_offsets[1]));
+		offset_scan_t scan(&face_offsets[0]);
+		parallel_scan(blocked_range<size_t>(1, face_offsets.size(), 4096), scan);
+		
+		vector<unsigned int> cursor(face_offsets.begin(), face_offsets.end() - 1);
+		parallel_for(blocked_range<size_t>(0, indices.size(), 4096), vertex_face_task_t(&indices[0], &cursor[0], &faces[0]));
+		parallel_for(blocked_range<size_t>(0, vertices.size(), 1024), vertex_face_sort_task_t(&face_offsets[0], &faces[0]));
 	}
-
+	
+	parallel_for(blocked_range<size_t>(0, vertices.size(), 1024),
+		vertex_normal_task_t(&face_normals[0], &face_offsets[0], faces.empty() ? NULL : &faces[0], &normals[0]));
 }
 
 bool triangle_mesh_t::load(const char* ctm_filepath, triangle_mesh_t &mesh) {
@@ -97,21 +311,17 @@ bool triangle_mesh_t::load(const char* ctm_filepath, triangle_mesh_t &mesh) {
 		CTMuint vertex_count = ctm.GetInteger(CTM_VERTEX_COUNT);
 		const CTMfloat* vertices = ctm.GetFloatArray(CTM_VERTICES);
 		
-		mesh.vertices.reserve(vertex_count);				
-		const CTMfloat* vp = vertices;
-		for (unsigned int i = 0; i < vertex_count; i++) {
-			vec3 v = vec3(*vp, *(vp + 1), *(vp + 2));
-			mesh.vertices.push_back(v);
-			vp += 3;
-		}
-		assert(mesh.vertices.size() == vertex_count);
+		mesh.vertices.resize(vertex_count);
+		if (vertex_count > 0)
+			memcpy((void *)&mesh.vertices[0], vertices, sizeof(CTMfloat) * 3 * vertex_count);
 		
 		CTMuint triangle_count = ctm.GetInteger(CTM_TRIANGLE_COUNT);
 		const CTMuint* indices = ctm.GetIntegerArray(CTM_INDICES);
 		
 		size_t index_count = triangle_count * 3;
 		mesh.indices.resize(index_count);
-		memcpy(&mesh.indices[0], indices, sizeof(unsigned int) * index_count);				
+		if (index_count > 0)
+			memcpy(&mesh.indices[0], indices, sizeof(unsigned int) * index_count);				
 		assert(mesh.indices.size() == index_count);
 		
 	} catch (ctm_error &e) {
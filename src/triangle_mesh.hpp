@@ -20,25 +20,28 @@ struct triangle_mesh_t {
 	
 	void refine(std::vector<shape_ref_t> &triangles) {
 		refine_to_triangles(triangles);
-		compute_vertex_normals(triangles);
+		compute_vertex_normals();
 	}
 	
 	void refine_to_triangles(std::vector<shape_ref_t> &triangles) const;
 	
-	void compute_vertex_normals(const std::vector<shape_ref_t> &triangles);
+	void compute_vertex_normals();
 	
 	static bool load(const char* ctm_filepath, triangle_mesh_t &mesh);
 	
 };
 
 struct triangle_t : public shape_t {
-		
+	
+	triangle_t() : indices(NULL), __mesh(NULL) { }
 	triangle_t(const triangle_mesh_t *m, size_t n);
 	
 	const bbox_t& bound() const {
 		return __bbox;
 	}
 	
+	void update_bound();
+	
 	glm::vec3 normal(const glm::vec3 &p) const;
 	
 	const glm::vec3& v(size_t i) const {
@@ -50,6 +53,7 @@ struct triangle_t : public shape_t {
 	}
 	
 	bool intersect(const ray_t &ray, isect_t &isect) const;
+	unsigned int intersect_packet(ray_packet_t &packet, unsigned int mask) const;
 	
 	const unsigned int *indices;
 	
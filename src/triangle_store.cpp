@@ -0,0 +1,124 @@
+#include "triangle_mesh.hpp"
+#include "triangle_store.hpp"
+
+using namespace std;
+using namespace glm;
+
+
+void triangle_store_t::pack(const vector<shape_ref_t> &ordered_shapes) {
+	size_t n = ordered_shapes.size();
+	
+	// pad by one SIMD block so a leaf at the end can be loaded whole
+	size_t padded = n + SIMD_WIDTH;
+	float_array_t *arrays[9] = { &v0x, &v0y, &v0z, &e0x, &e0y, &e0z, &e1x, &e1y, &e1z };
+	for (int k = 0; k < 9; k++) {
+		arrays[k]->assign(padded, 0.0f);
+	}
+	shapes.resize(n);
+	is_triangle.resize(n);
+	
+	for (size_t i = 0; i < n; i++) {
+		const shape_t *shape = ordered_shapes[i].get();
+		shapes[i] = shape;
+		
+		const triangle_t *triangle = dynamic_cast<const triangle_t *>(shape);
+		is_triangle[i] = (triangle != NULL);
+		if (triangle == NULL)
+			continue;
+		
+		vec3 e0 = triangle->v(1) - triangle->v(0);
+		vec3 e1 = triangle->v(2) - triangle->v(0);
+		v0x[i] = triangle->v(0).x; v0y[i] = triangle->v(0).y; v0z[i] = triangle->v(0).z;
+		e0x[i] = e0.x; e0y[i] = e0.y; e0z[i] = e0.z;
+		e1x[i] = e1.x; e1y[i] = e1.y; e1z[i] = e1.z;
+	}
+}
+
+unsigned int triangle_store_t::intersect_block(const ray_t &ray, size_t offset, unsigned int lanes, float tmax, float *t) const {
+	if (lanes == 0)
+		return 0;
+	
+	simd_float_t dx = simd_set1(ray.direction.x), dy = simd_set1(ray.direction.y), dz = simd_set1(ray.direction.z);
+	simd_float_t zero = simd_set1(0.0f);
+	simd_float_t one = simd_set1(1.0f);
+	
+	simd_float_t e0_x = simd_loadu(&e0x[offset]), e0_y = simd_loadu(&e0y[offset]), e0_z = simd_loadu(&e0z[offset]);
+	simd_float_t e1_x = simd_loadu(&e1x[offset]), e1_y = simd_loadu(&e1y[offset]), e1_z = simd_loadu(&e1z[offset]);
+	
+	// pv = cross(direction, e1)
+	simd_float_t pvx = simd_sub(simd_mul(dy, e1_z), simd_mul(dz, e1_y));
+	simd_float_t pvy = simd_sub(simd_mul(dz, e1_x), simd_mul(dx, e1_z));
+	simd_float_t pvz = simd_sub(simd_mul(dx, e1_y), simd_mul(dy, e1_x));
+	simd_float_t inv_det = simd_div(one, simd_add(simd_add(simd_mul(e0_x, pvx), simd_mul(e0_y, pvy)), simd_mul(e0_z, pvz)));
+	
+	simd_float_t tvx = simd_sub(simd_set1(ray.origin.x), simd_loadu(&v0x[offset]));
+	simd_float_t tvy = simd_sub(simd_set1(ray.origin.y), simd_loadu(&v0y[offset]));
+	simd_float_t tvz = simd_sub(simd_set1(ray.origin.z), simd_loadu(&v0z[offset]));
+	simd_float_t u = simd_mul(simd_add(simd_add(simd_mul(tvx, pvx), simd_mul(tvy, pvy)), simd_mul(tvz, pvz)), inv_det);
+	
+	// qv = cross(tv, e0)
+	simd_float_t qvx = simd_sub(simd_mul(tvy, e0_z), simd_mul(tvz, e0_y));
+	simd_float_t qvy = simd_sub(simd_mul(tvz, e0_x), simd_mul(tvx, e0_z));
+	simd_float_t qvz = simd_sub(simd_mul(tvx, e0_y), simd_mul(tvy, e0_x));
+	simd_float_t v = simd_mul(simd_add(simd_add(simd_mul(dx, qvx), simd_mul(dy, qvy)), simd_mul(dz, qvz)), inv_det);
+	simd_float_t tt = simd_mul(simd_add(simd_add(simd_mul(e1_x, qvx), simd_mul(e1_y, qvy)), simd_mul(e1_z, qvz)), inv_det);
+	
+	simd_mask_t m = simd_and(simd_le(zero, u), simd_le(zero, v));
+	m = simd_and(m, simd_le(simd_add(u, v), one));
+	m = simd_and(m, simd_lt(simd_set1(ray.tmin), tt));
+	m = simd_and(m, simd_lt(tt, simd_set1(tmax)));
+	
+	unsigned int hit = simd_movemask(m) & lanes;
+	if (hit != 0)
+		simd_store(t, tt);
+	return hit;
+}
+
+bool triangle_store_t::intersect(const ray_t &ray, size_t offset, size_t n, isect_t &isect) const {
+	bool hit = false;
+	float t[SIMD_WIDTH] __attribute__((aligned(32)));
+	
+	for (size_t i = offset; i < offset + n; i += SIMD_WIDTH) {
+		size_t count = std::min((size_t)SIMD_WIDTH, offset + n - i);
+		unsigned int lanes = 0;
+		for (size_t k = 0; k < count; k++) {
+			if (is_triangle[i + k]) {
+				lanes |= (1u << k);
+			} else if (shapes[i + k]->intersect(ray, isect)) {
+				hit = true;
+			}
+		}
+		
+		unsigned int mask = intersect_block(ray, i, lanes, isect.t, t);
+		for (size_t k = 0; mask != 0; k++, mask >>= 1) {
+			if ( (mask & 1) && t[k] < isect.t ) {
+				isect.t = t[k];
+				isect.shape = shapes[i + k];
+				hit = true;
+			}
+		}
+	}
+	
+	return hit;
+}
+
+bool triangle_store_t::occluded(const ray_t &ray, size_t offset, size_t n) const {
+	float t[SIMD_WIDTH] __attribute__((aligned(32)));
+	
+	for (size_t i = offset; i < offset + n; i += SIMD_WIDTH) {
+		size_t count = std::min((size_t)SIMD_WIDTH, offset + n - i);
+		unsigned int lanes = 0;
+		for (size_t k = 0; k < count; k++) {
+			if (is_triangle[i + k]) {
+				lanes |= (1u << k);
+			} else if (shapes[i + k]->occluded(ray)) {
+				return true;
+			}
+		}
+		
+		if (intersect_block(ray, i, lanes, ray.tmax, t) != 0)
+			return true;
+	}
+	
+	return false;
+}
@@ -0,0 +1,37 @@
+#ifndef TRIANGLE_STORE_HPP
+#define TRIANGLE_STORE_HPP
+
+#include <vector>
+#include <tbb/cache_aligned_allocator.h>
+
+#include "ray_packet.hpp"
+#include "shape.hpp"
+
+
+// Triangles of a BVH in leaf order, as structure-of-arrays with the edges precomputed.
+// A leaf [offset, offset + n) is tested SIMD_WIDTH triangles at a time without virtual calls.
+struct triangle_store_t {
+	typedef std::vector< float, tbb::cache_aligned_allocator<float> > float_array_t;
+
+	float_array_t v0x, v0y, v0z;
+	float_array_t e0x, e0y, e0z;
+	float_array_t e1x, e1y, e1z;
+
+	std::vector<const shape_t *> shapes;  // for hit reporting and non-triangle shapes
+	std::vector<unsigned char> is_triangle;
+
+	void pack(const std::vector<shape_ref_t> &ordered_shapes);
+
+	bool intersect(const ray_t &ray, size_t offset, size_t n, isect_t &isect) const;
+	bool occluded(const ray_t &ray, size_t offset, size_t n) const;
+
+	size_t memory_size() const {
+		return 9 * v0x.size() * sizeof(float) + shapes.size() * ( sizeof(const shape_t *) + 1 );
+	}
+
+private:
+	unsigned int intersect_block(const ray_t &ray, size_t offset, unsigned int lanes, float tmax, float *t) const;
+
+};
+
+#endif
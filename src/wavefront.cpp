@@ -0,0 +1,224 @@
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_sort.h>
+
+#include "wavefront.hpp"
+#include "image_output.hpp"
+#include "morton.hpp"
+
+using namespace std;
+using namespace glm;
+using namespace tbb;
+using namespace grkt;
+
+
+// p in the unit cube, 10 bits per axis
+static uint64_t morton_code3(const vec3 &p) {
+	vec3 q = clamp(p, 0.0f, 1.0f) * 1023.0f;
+	return morton_3d((uint64_t)q.x, (uint64_t)q.y, (uint64_t)q.z);
+}
+
+// direction octant first, since rays of one octant visit children in the same order,
+// then where the ray starts, then where it goes; camera rays share an origin and sort on direction alone
+static uint64_t ray_key(const ray_t &ray, const bbox_t &bound) {
+	const vec3 &d = ray.direction;
+	uint64_t octant = (d.x < 0.0f) | ( (d.y < 0.0f) << 1 ) | ( (d.z < 0.0f) << 2 );
+	vec3 extent = glm::max(bound.max_point - bound.min_point, vec3(1e-6f));
+	uint64_t origin = morton_code3( (ray.origin - bound.min_point) / extent );
+	uint64_t direction = morton_code3(0.5f * d + 0.5f);
+	return (octant << 60) | (origin << 30) | direction;
+}
+
+struct wavefront_stage_task_t {
+	wavefront_renderer_t *wavefront;
+	wavefront_stage_t stage;
+
+	wavefront_stage_task_t(wavefront_renderer_t *w, wavefront_stage_t s) : wavefront(w), stage(s) { }
+
+	void operator() (const blocked_range<size_t>& range) const {
+		wavefront->run(stage, range.begin(), range.end());
+	}
+
+};
+
+
+wavefront_renderer_t::wavefront_renderer_t(const context_t *ctx, unsigned char *rgb_buf, unsigned short *sample_buf, uint32_t *cost_buf, image_output_t *out, size_t batch) :
+	renderer(ctx, rgb_buf, sample_buf, cost_buf, out), batch_size(batch), batch_count(0), round_count(0), ray_count(0), shadow_ray_count(0) {
+	const bvh_tree_t *tree = ctx->bvh_tree;
+	scene_bound = tree->bound();
+}
+
+void wavefront_renderer_t::render() {
+	const vector<tile_t> &tiles = renderer.context->tiles;
+
+	// batches are runs of whole tiles, so the tiles' Morton order keeps a batch on one part of the screen
+	// and every tile is finished, and can be written out, when its batch is
+	size_t first_tile = 0;
+	size_t pixel_count = 0;
+	for (size_t t = 0; t < tiles.size(); t++) {
+		pixel_count += (tiles[t].x1 - tiles[t].x0) * (tiles[t].y1 - tiles[t].y0);
+		if (pixel_count >= batch_size || t + 1 == tiles.size()) {
+			render_batch(first_tile, t + 1);
+			first_tile = t + 1;
+			pixel_count = 0;
+		}
+	}
+}
+
+void wavefront_renderer_t::render_batch(size_t first_tile, size_t end_tile) {
+	const context_t *context = renderer.context;
+	batch_tiles.clear();
+	tile_slots.clear();
+	pixels.clear();
+	for (size_t t = first_tile; t < end_tile; t++) {
+		const tile_t &tile = context->tiles[t];
+		batch_tiles.push_back(t);
+		tile_slots.push_back(pixels.size());
+		for (size_t j = tile.y0; j < tile.y1; j++) {
+			for (size_t i = tile.x0; i < tile.x1; i++)
+				pixels.push_back(i + context->screen.width * j);
+		}
+	}
+
+	size_t n = pixels.size();
+	samplers.resize(n);
+	estimators.resize(n);
+	pixel_costs.resize(n);
+	parallel_for(blocked_range<size_t>(0, n), wavefront_stage_task_t(this, WAVEFRONT_SETUP));
+
+	active.resize(n);
+	for (size_t s = 0; s < n; s++)
+		active[s] = s;
+
+	while (!active.empty()) {
+		size_t n_rays = active.size();
+		rays.resize(n_rays);
+		isects.resize(n_rays);
+		hits.resize(n_rays);
+		intensities.resize(n_rays);
+		shadow_rays.resize(n_rays);
+		occluded.resize(n_rays);
+		order.resize(n_rays);
+
+		parallel_for(blocked_range<size_t>(0, n_rays), wavefront_stage_task_t(this, WAVEFRONT_GENERATE));
+		sort(n_rays);
+		parallel_for(blocked_range<size_t>(0, n_rays), wavefront_stage_task_t(this, WAVEFRONT_INTERSECT));
+
+		// shading leaves the hits' shadow rays in order, misses sort to the end
+		parallel_for(blocked_range<size_t>(0, n_rays), wavefront_stage_task_t(this, WAVEFRONT_SHADE));
+		sort(n_rays);
+		size_t n_shadow_rays = 0;
+		for (size_t a = 0; a < n_rays; a++)
+			n_shadow_rays += hits[a];
+		parallel_for(blocked_range<size_t>(0, n_shadow_rays), wavefront_stage_task_t(this, WAVEFRONT_SHADOW));
+
+		parallel_for(blocked_range<size_t>(0, n_rays), wavefront_stage_task_t(this, WAVEFRONT_ACCUMULATE));
+
+		round_count++;
+		ray_count += n_rays;
+		shadow_ray_count += n_shadow_rays;
+
+		size_t n_active = 0;
+		for (size_t a = 0; a < n_rays; a++) {
+			if (!renderer.converged(estimators[active[a]]))
+				active[n_active++] = active[a];
+		}
+		active.resize(n_active);
+	}
+
+	parallel_for(blocked_range<size_t>(0, batch_tiles.size()), wavefront_stage_task_t(this, WAVEFRONT_WRITE));
+	batch_count++;
+}
+
+void wavefront_renderer_t::sort(size_t n) {
+	parallel_sort(order.begin(), order.begin() + n);
+}
+
+void wavefront_renderer_t::run(wavefront_stage_t stage, size_t begin, size_t end) {
+	const context_t *context = renderer.context;
+	size_t width = context->screen.width;
+	bool count_costs = (renderer.costs != NULL);
+
+	switch (stage) {
+		case WAVEFRONT_SETUP: {
+			for (size_t s = begin; s < end; s++) {
+				samplers[s] = renderer.pixel_sampler(pixels[s] % width, pixels[s] / width);
+				estimators[s] = pixel_estimator_t();
+				pixel_costs[s] = 0;
+			}
+			break;
+		}
+		case WAVEFRONT_GENERATE: {
+			for (size_t a = begin; a < end; a++) {
+				size_t s = active[a];
+				samplers[s].start_sample(estimators[s].n);
+				rays[a] = renderer.camera_ray(pixels[s] % width, pixels[s] / width, samplers[s]);
+				isects[a] = isect_t();
+				order[a].key = ray_key(rays[a], scene_bound);
+				order[a].index = a;
+			}
+			break;
+		}
+		case WAVEFRONT_INTERSECT: {
+			for (size_t k = begin; k < end; k++) {
+				size_t a = order[k].index;
+				uint64_t cost_start = count_costs ? local_traversal_counters().cost() : 0;
+				hits[a] = context->bvh_tree->intersect(rays[a], isects[a]);
+				if (count_costs)
+					pixel_costs[active[a]] += local_traversal_counters().cost() - cost_start;
+			}
+			break;
+		}
+		case WAVEFRONT_SHADE: {
+			for (size_t a = begin; a < end; a++) {
+				order[a].index = a;
+				if (!hits[a]) {
+					order[a].key = ~(uint64_t)0;
+					continue;
+				}
+				intensities[a] = renderer.light_sample(rays[a], isects[a], samplers[active[a]], shadow_rays[a]);
+				order[a].key = ray_key(shadow_rays[a], scene_bound);
+			}
+			break;
+		}
+		case WAVEFRONT_SHADOW: {
+			for (size_t k = begin; k < end; k++) {
+				size_t a = order[k].index;
+				uint64_t cost_start = count_costs ? local_traversal_counters().cost() : 0;
+				occluded[a] = context->bvh_tree->occluded(shadow_rays[a]);
+				if (count_costs)
+					pixel_costs[active[a]] += local_traversal_counters().cost() - cost_start;
+			}
+			break;
+		}
+		case WAVEFRONT_ACCUMULATE: {
+			for (size_t a = begin; a < end; a++) {
+				pixel_estimator_t &estimator = estimators[active[a]];
+				if (hits[a]) {
+					estimator.add(renderer.radiance(intensities[a], occluded[a]));
+				} else {
+					estimator.add(vec3(0.0));
+				}
+			}
+			break;
+		}
+		case WAVEFRONT_WRITE: {
+			vector<vec3> tile_radiance;
+			for (size_t k = begin; k < end; k++) {
+				const tile_t &tile = context->tiles[batch_tiles[k]];
+				size_t area = (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+				if (renderer.output != NULL)
+					tile_radiance.resize(area);
+				vec3 *radiance = (renderer.output != NULL) ? &tile_radiance[0] : NULL;
+
+				for (size_t s = tile_slots[k]; s < tile_slots[k] + area; s++) {
+					renderer.write_pixel(pixels[s] % width, pixels[s] / width, estimators[s], tile, radiance);
+					if (count_costs)
+						renderer.costs[pixels[s]] = (uint32_t)pixel_costs[s];
+				}
+				if (renderer.output != NULL)
+					renderer.output->write_tile(tile, radiance);
+			}
+			break;
+		}
+	}
+}
@@ -0,0 +1,77 @@
+#ifndef GRKT_WAVEFRONT_HPP
+#define GRKT_WAVEFRONT_HPP
+
+#include <vector>
+#include <stdint.h>
+
+#include "grkt.hpp"
+
+
+namespace grkt {
+
+	enum wavefront_stage_t {
+		WAVEFRONT_SETUP,
+		WAVEFRONT_GENERATE,
+		WAVEFRONT_INTERSECT,
+		WAVEFRONT_SHADE,
+		WAVEFRONT_SHADOW,
+		WAVEFRONT_ACCUMULATE,
+		WAVEFRONT_WRITE
+	};
+
+	struct ray_sort_key_t {
+		uint64_t key;
+		uint32_t index;
+
+		bool operator<(const ray_sort_key_t &other) const {
+			return (key != other.key) ? key < other.key : index < other.index;
+		}
+
+	};
+
+	// Renders a batch of pixels one sample index at a time: every pixel of the batch that has not converged
+	// generates a camera ray, the rays are sorted by origin and direction and intersected together, the hits
+	// are shaded together, and their shadow rays are sorted and traced as a stage of their own.
+	// Each pixel keeps its own sampler and estimator, so the image is the one renderer_t makes.
+	struct wavefront_renderer_t {
+
+		renderer_t renderer;      // camera rays, shading and pixel output are shared with the tile renderer
+		size_t batch_size;        // pixels per batch, rounded up to whole tiles
+		bbox_t scene_bound;       // quantizes ray origins for the sort keys
+
+		// one slot per pixel of the current batch, tile by tile
+		std::vector<size_t> batch_tiles;
+		std::vector<size_t> tile_slots;      // first slot of each batch tile
+		std::vector<uint32_t> pixels;
+		std::vector<sampler_t> samplers;
+		std::vector<pixel_estimator_t> estimators;
+		std::vector<uint64_t> pixel_costs;
+
+		// one entry per ray of the current round, indexed by position in active
+		std::vector<uint32_t> active;
+		std::vector<ray_t> rays;
+		std::vector<isect_t> isects;
+		std::vector<unsigned char> hits;
+		std::vector<float> intensities;
+		std::vector<ray_t> shadow_rays;
+		std::vector<unsigned char> occluded;
+		std::vector<ray_sort_key_t> order;   // the round's rays, then its shadow rays, in coherence order
+
+		size_t batch_count;
+		size_t round_count;
+		size_t ray_count;
+		size_t shadow_ray_count;
+
+		wavefront_renderer_t(const context_t *ctx, unsigned char *rgb_buf, unsigned short *sample_buf = NULL, uint32_t *cost_buf = NULL,
+			image_output_t *out = NULL, size_t batch = 65536);
+
+		void render();
+		void render_batch(size_t first_tile, size_t end_tile);
+		void run(wavefront_stage_t stage, size_t begin, size_t end);
+		void sort(size_t n);
+
+	};
+
+}
+
+#endif